@@ -0,0 +1,115 @@
+// This file contains a bump-pointer allocator.
+//
+// A compiler allocates a large number of small objects that live until
+// the end of a compilation phase (or until the end of the process), so
+// calling calloc() for each of them is wasteful. Instead, we carve
+// objects out of large zero-filled blocks and release the blocks all at
+// once when a phase is done with them.
+
+#include "chibicc.h"
+
+#define ARENA_BLOCK_SIZE (1024 * 1024)
+
+struct ArenaBlock {
+  ArenaBlock *next;
+  size_t size;
+  // Objects are allocated right after this header.
+};
+
+// AST nodes, variables, struct members and scope records.
+_Thread_local Arena parse_arena;
+
+// AST nodes, locals and scope records of the function being compiled
+// in streaming mode. Reset as soon as the function's code is emitted.
+_Thread_local Arena func_arena;
+
+// Types. Types are shared by tokens, nodes and variables, so they
+// outlive all other arenas.
+_Thread_local Arena type_arena;
+
+// IR and operand strings of the function being compiled. Reset as
+// soon as the function's code is emitted.
+_Thread_local Arena ir_arena;
+
+static void new_block(Arena *arena, size_t size) {
+  size_t hdr = align_to(sizeof(ArenaBlock), 16);
+  ArenaBlock *blk = calloc(1, hdr + size);
+  if (!blk)
+    error("out of memory");
+  blk->next = arena->head;
+  blk->size = size;
+  arena->head = blk;
+  arena->ptr = (char *)blk + hdr;
+  arena->end = arena->ptr + size;
+}
+
+// Returns a zero-initialized, 16-byte aligned piece of memory.
+void *arena_alloc(Arena *arena, size_t size) {
+  size = align_to(size, 16);
+  arena->allocated += size;
+
+  if (arena->end - arena->ptr < size) {
+    // A large object gets its own block so that we don't waste the
+    // rest of the current one.
+    if (size > ARENA_BLOCK_SIZE / 4) {
+      char *ptr = arena->ptr, *end = arena->end;
+      new_block(arena, size);
+      void *p = arena->ptr;
+      arena->ptr = ptr;
+      arena->end = end;
+      return p;
+    }
+    new_block(arena, ARENA_BLOCK_SIZE);
+  }
+
+  void *p = arena->ptr;
+  arena->ptr += size;
+  return p;
+}
+
+// Releases all objects allocated from a given arena.
+void arena_free(Arena *arena) {
+  ArenaBlock *blk = arena->head;
+  while (blk) {
+    ArenaBlock *next = blk->next;
+    free(blk);
+    blk = next;
+  }
+  *arena = (Arena){.allocated = arena->allocated};
+}
+
+// Releases all objects allocated from a given arena like arena_free(),
+// but keeps its first block for the objects allocated next, so that an
+// arena emptied once per function doesn't call calloc() every time.
+void arena_reset(Arena *arena) {
+  // Blocks are listed newest first, so the last regular one is the
+  // first block. Large objects have blocks of their own.
+  ArenaBlock *first = NULL;
+  ArenaBlock *blk = arena->head;
+  while (blk) {
+    ArenaBlock *next = blk->next;
+    if (blk->size == ARENA_BLOCK_SIZE) {
+      free(first);
+      first = blk;
+    } else {
+      free(blk);
+    }
+    blk = next;
+  }
+
+  if (!first) {
+    *arena = (Arena){.allocated = arena->allocated};
+    return;
+  }
+
+  // Objects are zero-initialized, so clear what has been used. Only
+  // the current block may be partly used.
+  char *start = (char *)first + align_to(sizeof(ArenaBlock), 16);
+  char *end = start + ARENA_BLOCK_SIZE;
+  memset(start, 0, (arena->end == end ? arena->ptr : end) - start);
+
+  first->next = NULL;
+  arena->head = first;
+  arena->ptr = start;
+  arena->end = end;
+}
@@ -0,0 +1,95 @@
+// This program runs a command and prints the CPU cycles and
+// instructions it took in user mode, as well as its user time:
+//
+//   counters <command> [ <arg>... ]
+//
+// writes "<cycles> <instructions> <seconds>" to stderr. The counters
+// are read with perf_event_open(2), so that the perf tool isn't
+// needed. If the kernel doesn't allow hardware counters, e.g. in a
+// virtual machine, "-" is printed instead of their values.
+
+#include <linux/perf_event.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/resource.h>
+#include <sys/syscall.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+// Opens a counter of a given process that starts counting when the
+// process calls exec().
+static int open_counter(pid_t pid, uint64_t config) {
+  struct perf_event_attr attr = {
+    .type = PERF_TYPE_HARDWARE,
+    .size = sizeof(attr),
+    .config = config,
+    .disabled = 1,
+    .enable_on_exec = 1,
+    .exclude_kernel = 1,
+    .exclude_hv = 1,
+  };
+  return syscall(SYS_perf_event_open, &attr, pid, -1, -1, 0);
+}
+
+static void print_counter(int fd) {
+  uint64_t val;
+  if (fd == -1 || read(fd, &val, sizeof(val)) != sizeof(val))
+    fprintf(stderr, "- ");
+  else
+    fprintf(stderr, "%llu ", (unsigned long long)val);
+}
+
+int main(int argc, char **argv) {
+  if (argc < 2) {
+    fprintf(stderr, "usage: counters <command> [ <arg>... ]\n");
+    return 1;
+  }
+
+  // The child waits until the counters are attached to it.
+  int fds[2];
+  if (pipe(fds) == -1) {
+    perror("pipe");
+    return 1;
+  }
+
+  pid_t pid = fork();
+  if (pid == -1) {
+    perror("fork");
+    return 1;
+  }
+
+  if (pid == 0) {
+    char c;
+    close(fds[1]);
+    if (read(fds[0], &c, 1) != 1)
+      _exit(127);
+    execvp(argv[1], argv + 1);
+    perror(argv[1]);
+    _exit(127);
+  }
+
+  close(fds[0]);
+  int cycles = open_counter(pid, PERF_COUNT_HW_CPU_CYCLES);
+  int insns = open_counter(pid, PERF_COUNT_HW_INSTRUCTIONS);
+  if (write(fds[1], "x", 1) != 1) {
+    perror("write");
+    return 1;
+  }
+  close(fds[1]);
+
+  int status;
+  struct rusage ru;
+  if (wait4(pid, &status, 0, &ru) == -1) {
+    perror("wait4");
+    return 1;
+  }
+
+  print_counter(cycles);
+  print_counter(insns);
+  fprintf(stderr, "%.4f\n", ru.ru_utime.tv_sec + ru.ru_utime.tv_usec / 1e6);
+
+  if (WIFEXITED(status))
+    return WEXITSTATUS(status);
+  return 128 + WTERMSIG(status);
+}
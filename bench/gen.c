@@ -0,0 +1,147 @@
+// This program generates synthetic C programs for benchmarking the
+// throughput of the compiler.
+//
+//   gen <kind> <scale>
+//
+// writes a program of a given kind to stdout. Each kind stresses a
+// different part of the compiler, and its size grows linearly with
+// `scale`:
+//
+//   globals  many global variables, each looked up by name repeatedly
+//   scopes   deeply nested blocks whose locals shadow outer locals
+//   structs  wide structs and member accesses
+//   funcs    long functions of arithmetic and control flow
+//   strings  large string literals
+//
+// The programs only use the subset of C that chibicc supports, and
+// can also be compiled with gcc.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+static void gen_globals(int scale) {
+  int n = scale * 100;
+  for (int i = 0; i < n; i++)
+    printf("int g%d;\n", i);
+
+  for (int i = 0; i < n; i += 100) {
+    printf("int f%d() {\n", i);
+    for (int j = i; j < i + 100; j++)
+      printf("  g%d = g%d + %d;\n", j, (j * 7) % n, j);
+    printf("  return g%d;\n}\n", i);
+  }
+  printf("int main() { return 0; }\n");
+}
+
+static void gen_scopes(int scale) {
+  int depth = 100;
+
+  for (int i = 0; i < scale; i++) {
+    printf("int f%d(int x) {\n", i);
+    printf("  int a0 = x;\n");
+    for (int d = 1; d <= depth; d++) {
+      printf("%*s{ int x = a%d + 1; int a%d = x * 2;\n", d, "", d - 1, d);
+      printf("%*s  struct T { int v; } t; t.v = a%d;\n", d, "", d);
+    }
+    for (int d = depth; d >= 1; d--)
+      printf("%*s}\n", d, "");
+    printf("  return a0;\n}\n");
+  }
+  printf("int main() { return 0; }\n");
+}
+
+static char *type_names[] = {"char", "short", "int", "long", "int *"};
+
+static void gen_structs(int scale) {
+  int width = 200;
+
+  for (int i = 0; i < scale; i++) {
+    printf("struct S%d {\n", i);
+    for (int j = 0; j < width; j++)
+      printf("  %s m%d;\n", type_names[j % 5], j);
+    printf("};\n");
+
+    printf("long f%d() {\n", i);
+    printf("  struct S%d s;\n  struct S%d *p = &s;\n  long sum = 0;\n", i, i);
+    for (int j = 0; j < width; j += 5) {
+      printf("  s.m%d = %d;\n", j, j);
+      printf("  p->m%d = s.m%d + 1;\n", j + 2, j);
+      printf("  sum = sum + p->m%d + s.m%d;\n", j + 2, j + 3);
+    }
+    printf("  return sum;\n}\n");
+  }
+  printf("int main() { return 0; }\n");
+}
+
+static void gen_funcs(int scale) {
+  int len = 500;
+
+  for (int i = 0; i < scale; i++) {
+    printf("int f%d(int x, int y) {\n", i);
+    printf("  int z = 0;\n  int i;\n");
+    for (int j = 0; j < len; j++) {
+      switch (j % 4) {
+      case 0:
+        printf("  x = x * %d + y - %d;\n", j % 13 + 1, j);
+        break;
+      case 1:
+        printf("  if (x < y) y = y + %d; else z = z - x / %d;\n", j, j % 7 + 1);
+        break;
+      case 2:
+        printf("  for (i = 0; i < %d; i = i + 1) z = z + i * x;\n", j % 10);
+        break;
+      case 3:
+        printf("  while (z > %d) z = z - y;\n", j * 100);
+        break;
+      }
+    }
+    printf("  return x + y + z;\n}\n");
+  }
+  printf("int main() { return 0; }\n");
+}
+
+static void gen_strings(int scale) {
+  int len = 4000;
+
+  for (int i = 0; i < scale; i++) {
+    printf("char *f%d() {\n  char *s = \"", i);
+    for (int j = 0; j < len; j++) {
+      switch (j % 50) {
+      case 10: printf("\\n"); break;
+      case 20: printf("\\\""); break;
+      case 30: printf("\\\\"); break;
+      case 40: printf("\\t"); break;
+      default: putchar('a' + (i + j) % 26);
+      }
+    }
+    printf("\";\n  return s;\n}\n");
+  }
+  printf("int main() { return 0; }\n");
+}
+
+int main(int argc, char **argv) {
+  if (argc != 3) {
+    fprintf(stderr, "usage: gen <kind> <scale>\n");
+    return 1;
+  }
+
+  char *kind = argv[1];
+  int scale = atoi(argv[2]);
+
+  if (!strcmp(kind, "globals"))
+    gen_globals(scale);
+  else if (!strcmp(kind, "scopes"))
+    gen_scopes(scale);
+  else if (!strcmp(kind, "structs"))
+    gen_structs(scale);
+  else if (!strcmp(kind, "funcs"))
+    gen_funcs(scale);
+  else if (!strcmp(kind, "strings"))
+    gen_strings(scale);
+  else {
+    fprintf(stderr, "unknown kind: %s\n", kind);
+    return 1;
+  }
+  return 0;
+}
@@ -0,0 +1,88 @@
+#!/bin/bash
+# Measures the throughput of the compiler on inputs generated by
+# bench/gen and compares it against bench/baseline.
+#
+#   bench/run.sh            run and compare against the baseline
+#   bench/run.sh --update   run and replace the baseline
+#
+# SCALE sets the size of the inputs and RUNS the number of runs of
+# which the fastest is taken. The script fails if the throughput of
+# any input drops below THRESHOLD times its baseline.
+
+cd "$(dirname "$0")/.."
+
+chibicc=${CHIBICC:-./chibicc}
+gen=bench/gen
+baseline=bench/baseline
+scale=${SCALE:-20}
+runs=${RUNS:-5}
+threshold=${THRESHOLD:-0.8}
+
+tmp=`mktemp -d /tmp/chibicc-bench-XXXXXX`
+trap 'rm -rf $tmp' INT TERM HUP EXIT
+
+# Prints a number from the JSON written by --stats. A key of the form
+# "phase.key" selects a key of a phase.
+json() {
+    case $2 in
+    *.*) grep "\"${2%.*}\": {" $1 | sed "s/.*\"${2#*.}\": \([0-9.]*\).*/\1/" ;;
+    *) grep -o "\"$2\": [0-9.]*" $1 | head -1 | sed 's/.*: //' ;;
+    esac
+}
+
+printf '%-8s %-3s %7s %8s %8s %11s %10s %9s %9s %9s %7s\n' \
+    input opt lines tokens time tokens/s lines/s tok-rss parse-rss cg-rss vs-base
+
+status=0
+for kind in globals scopes structs funcs strings; do
+    $gen $kind $scale > $tmp/$kind.c || exit 1
+    lines=$(wc -l < $tmp/$kind.c)
+
+    for opt in -O0 -O1; do
+        best=
+        for i in $(seq $runs); do
+            $chibicc $opt --stats=$tmp/stats.json -o /dev/null $tmp/$kind.c || exit 1
+            t=$(json $tmp/stats.json elapsed)
+            if [ -z "$best" ] || awk "BEGIN { exit !($t < $best) }"; then
+                best=$t
+                cp $tmp/stats.json $tmp/best.json
+            fi
+        done
+
+        tokens=$(json $tmp/best.json tokens)
+        tps=$(awk "BEGIN { printf \"%d\", $tokens / $best }")
+        lps=$(awk "BEGIN { printf \"%d\", $lines / $best }")
+        echo "$kind $opt $tps" >> $tmp/baseline
+
+        ratio=-
+        base=$(awk "\$1 == \"$kind\" && \$2 == \"$opt\" { print \$3 }" $baseline 2> /dev/null)
+        if [ -n "$base" ]; then
+            ratio=$(awk "BEGIN { printf \"%.2f\", $tps / $base }")
+            if awk "BEGIN { exit !($ratio < $threshold) }"; then
+                ratio="$ratio!"
+                status=1
+            fi
+        fi
+
+        printf '%-8s %-3s %7d %8d %8.4f %11d %10d %9d %9d %9d %7s\n' \
+            $kind $opt $lines $tokens $best $tps $lps \
+            $(json $tmp/best.json tokenize.max_rss_kb) \
+            $(json $tmp/best.json parse.max_rss_kb) \
+            $(json $tmp/best.json codegen.max_rss_kb) $ratio
+    done
+done
+
+echo
+echo "time is the fastest of $runs runs in seconds, and rss columns are the"
+echo "max RSS in KiB at the end of tokenize, parse and codegen."
+
+if [ "$1" = --update ]; then
+    cp $tmp/baseline $baseline
+    echo "updated $baseline"
+    exit 0
+fi
+
+if [ $status -ne 0 ]; then
+    echo "throughput dropped below $threshold of the baseline (marked with !)"
+fi
+exit $status
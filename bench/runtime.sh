@@ -0,0 +1,58 @@
+#!/bin/bash
+# Measures how fast the code generated by chibicc runs. This is run by
+# `make bench-runtime` once bench/runtime/*.exe and *.O1.exe are built.
+#
+# For each program at -O0 and -O1, prints the cycles, instructions and
+# user time of the fastest of RUNS runs, and the size of its assembly
+# in bytes and instructions. The output of each program is checked
+# against the same program compiled by $CC.
+
+cd "$(dirname "$0")/.."
+
+cc=${CC:-cc}
+runs=${RUNS:-3}
+
+tmp=`mktemp -d /tmp/chibicc-bench-XXXXXX`
+trap 'rm -rf $tmp' INT TERM HUP EXIT
+
+printf '%-11s %-3s %14s %14s %8s %9s %7s\n' \
+    program opt cycles instructions time 's bytes' 's insns'
+
+for src in bench/runtime/*.c; do
+    name=$(basename $src .c)
+    $cc -O2 -w -o $tmp/$name $src -xc bench/runtime/common || exit 1
+    $tmp/$name > $tmp/expected
+
+    for opt in -O0 -O1; do
+        base=bench/runtime/$name
+        [ $opt = -O1 ] && base=$base.O1
+
+        best=
+        for i in $(seq $runs); do
+            bench/counters ./$base.exe > $tmp/out 2> $tmp/counters || {
+                echo "$base.exe failed"
+                exit 1
+            }
+            if ! cmp -s $tmp/out $tmp/expected; then
+                echo "$base.exe: wrong output: $(cat $tmp/out)"
+                exit 1
+            fi
+
+            read cycles insns time < $tmp/counters
+            if [ -z "$best" ] || awk "BEGIN { exit !($time < $best) }"; then
+                best=$time
+                best_cycles=$cycles
+                best_insns=$insns
+            fi
+        done
+
+        # Instructions are indented lines other than directives.
+        ninsns=$(grep -c '^  [^.]' $base.s)
+        printf '%-11s %-3s %14s %14s %8.4f %9d %7d\n' $name $opt \
+            $best_cycles $best_insns $best $(wc -c < $base.s) $ninsns
+    done
+done
+
+echo
+echo "time is user time in seconds. Cycles and instructions are \"-\" if"
+echo "the kernel doesn't allow reading hardware counters."
@@ -0,0 +1,26 @@
+// Tight loops calling small helper functions.
+
+int report();
+
+int mix(int a, int b) {
+  return a * 3 + b;
+}
+
+long scale(long x, long n) {
+  return x * n - x / 8;
+}
+
+int lt(int a, int b) {
+  return a < b;
+}
+
+int main() {
+  long sum = 0;
+  int i;
+  int j;
+  for (i = 0; lt(i, 20000); i = i + 1)
+    for (j = 0; lt(j, 2000); j = j + 1)
+      sum = scale(sum, 3) / 4 + mix(i, j);
+  report("calls", sum);
+  return 0;
+}
@@ -0,0 +1,15 @@
+// Recursive calls, which stresses the prologue, the epilogue and
+// argument passing.
+
+int report();
+
+int fib(int n) {
+  if (n < 2)
+    return n;
+  return fib(n - 1) + fib(n - 2);
+}
+
+int main() {
+  report("fib", fib(35));
+  return 0;
+}
@@ -0,0 +1,14 @@
+// Nested counting loops with a loop-carried dependency.
+
+int report();
+
+int main() {
+  long sum = 0;
+  int i;
+  int j;
+  for (i = 0; i < 20000; i = i + 1)
+    for (j = 0; j < 5000; j = j + 1)
+      sum = sum + i * j - (sum / 1024);
+  report("loops", sum);
+  return 0;
+}
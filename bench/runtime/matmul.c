@@ -0,0 +1,38 @@
+// Multiplies integer matrices, which stresses array indexing and
+// multiplication.
+
+int report();
+
+int a[160][160];
+int b[160][160];
+long c[160][160];
+
+int main() {
+  int n = 160;
+  int i;
+  int j;
+  int k;
+
+  for (i = 0; i < n; i = i + 1)
+    for (j = 0; j < n; j = j + 1) {
+      a[i][j] = i + j;
+      b[i][j] = i - j;
+    }
+
+  int r;
+  for (r = 0; r < 15; r = r + 1)
+    for (i = 0; i < n; i = i + 1)
+      for (j = 0; j < n; j = j + 1) {
+        long s = 0;
+        for (k = 0; k < n; k = k + 1)
+          s = s + a[i][k] * b[k][j];
+        c[i][j] = c[i][j] + s;
+      }
+
+  long sum = 0;
+  for (i = 0; i < n; i = i + 1)
+    for (j = 0; j < n; j = j + 1)
+      sum = sum + c[i][j] * (i + 1) - c[j][i];
+  report("matmul", sum);
+  return 0;
+}
@@ -0,0 +1,47 @@
+// Follows a linked list whose nodes are shuffled in memory, so that
+// each step is a dependent load. A struct can't refer to itself yet,
+// so links are indices into the array of nodes.
+
+int report();
+
+struct Node {
+  int next;
+  long val;
+};
+
+struct Node nodes[65536];
+int order[65536];
+
+int main() {
+  int n = 65536;
+  int i;
+
+  // Shuffle the nodes with a linear congruential generator. There's
+  // no % operator, so the remainder is computed with a division.
+  long seed = 12345;
+  for (i = 0; i < n; i = i + 1)
+    order[i] = i;
+  for (i = n - 1; i > 0; i = i - 1) {
+    seed = seed * 1103515245 + 12345;
+    seed = seed - seed / 2147483648 * 2147483648;
+    int j = seed - seed / (i + 1) * (i + 1);
+    int t = order[i];
+    order[i] = order[j];
+    order[j] = t;
+  }
+
+  for (i = 0; i < n - 1; i = i + 1) {
+    nodes[order[i]].next = order[i + 1];
+    nodes[order[i]].val = i;
+  }
+  nodes[order[n - 1]].next = order[0];
+
+  struct Node *p = &nodes[order[0]];
+  long sum = 0;
+  for (i = 0; i < 20000000; i = i + 1) {
+    sum = sum + p->val;
+    p = &nodes[p->next];
+  }
+  report("pointer", sum);
+  return 0;
+}
@@ -0,0 +1,34 @@
+// Copies 64-byte structs between elements of an array.
+
+int report();
+
+struct Vec {
+  long x[7];
+  int tag;
+  int pad;
+};
+
+struct Vec vecs[256];
+
+int main() {
+  int i;
+  int j;
+  for (i = 0; i < 256; i = i + 1) {
+    vecs[i].x[0] = i;
+    vecs[i].tag = i * 3;
+  }
+
+  struct Vec tmp;
+  long sum = 0;
+  for (j = 0; j < 80000; j = j + 1) {
+    for (i = 1; i < 256; i = i + 1) {
+      tmp = vecs[i - 1];
+      tmp.x[0] = tmp.x[0] + 1;
+      vecs[i - 1] = vecs[i];
+      vecs[i] = tmp;
+    }
+    sum = sum + vecs[j / 400].x[0] + vecs[0].tag;
+  }
+  report("structcopy", sum);
+  return 0;
+}
@@ -0,0 +1,273 @@
+// This file implements an on-disk cache of compiler outputs.
+//
+// Build systems often recompile a file whose preprocessed contents
+// haven't changed. The cache maps a hash of the input, the compiler
+// binary and the flags that affect code generation to the assembly
+// that was generated for it, so that such a file doesn't have to be
+// parsed or compiled again.
+//
+// Each entry is a file named after its key in the cache directory.
+// Entries are written to a temporary file and renamed into place, so
+// concurrent compilers never see a partially written entry. A hit
+// updates the modification time of the entry, and entries with the
+// oldest modification time are evicted first once the total size
+// exceeds the limit.
+
+#include "chibicc.h"
+
+static char *cache_dir;
+static int64_t cache_limit;
+
+// Identifies the compiler binary, so that entries generated by a
+// different build of chibicc are never used.
+static char *compiler_id;
+
+// Statistics of this process. They are added to the counters in the
+// cache directory by cache_finish().
+static int nhits;
+static int nmisses;
+static bool need_evict;
+static pthread_mutex_t cache_lock = PTHREAD_MUTEX_INITIALIZER;
+
+void cache_init(char *dir, int64_t limit) {
+  if (mkdir(dir, 0777) == -1 && errno != EEXIST)
+    error("cannot create cache directory: %s: %s", dir, strerror(errno));
+
+  cache_dir = dir;
+  cache_limit = limit;
+
+  struct stat st;
+  if (stat("/proc/self/exe", &st) == 0)
+    compiler_id = format("%ld.%ld.%ld", (long)st.st_size, (long)st.st_mtim.tv_sec,
+                         (long)st.st_mtim.tv_nsec);
+  else
+    compiler_id = "unknown";
+}
+
+bool cache_enabled(void) {
+  return cache_dir;
+}
+
+// 128-bit FNV-1a. Keys are that long so that a collision, which would
+// silently produce a wrong output, is practically impossible.
+typedef unsigned __int128 uint128_t;
+
+static uint128_t fnv128(uint128_t hash, char *s, size_t len) {
+  uint128_t prime = ((uint128_t)1 << 88) | 0x13b;
+  for (size_t i = 0; i < len; i++) {
+    hash ^= (unsigned char)s[i];
+    hash *= prime;
+  }
+  return hash;
+}
+
+// Returns the key of a given input. `flags` are the options that
+// change the output for the same input.
+char *cache_key(char *input, char *flags) {
+  uint128_t hash = ((uint128_t)0x6c62272e07bb0142 << 64) | 0x62b821756295c58d;
+  hash = fnv128(hash, compiler_id, strlen(compiler_id) + 1);
+  hash = fnv128(hash, flags, strlen(flags) + 1);
+  hash = fnv128(hash, input, strlen(input));
+  return format("%016lx%016lx", (unsigned long)(hash >> 64), (unsigned long)hash);
+}
+
+static char *entry_path(char *key) {
+  return format("%s/%s.s", cache_dir, key);
+}
+
+// Returns the contents of the entry for a given key, or NULL if
+// there is no such entry.
+char *cache_get(char *key, size_t *len) {
+  char *path = entry_path(key);
+  FILE *in = fopen(path, "r");
+  char *buf = NULL;
+  struct stat st;
+
+  if (in && fstat(fileno(in), &st) == 0) {
+    buf = malloc(st.st_size + 1);
+    *len = fread(buf, 1, st.st_size, in);
+    if (*len != st.st_size) {
+      free(buf);
+      buf = NULL;
+    }
+  }
+  if (in)
+    fclose(in);
+
+  // Mark the entry as recently used.
+  if (buf)
+    utimensat(AT_FDCWD, path, NULL, 0);
+  free(path);
+
+  pthread_mutex_lock(&cache_lock);
+  if (buf)
+    nhits++;
+  else
+    nmisses++;
+  pthread_mutex_unlock(&cache_lock);
+  return buf;
+}
+
+void cache_put(char *key, char *data, size_t len) {
+  char *tmp = format("%s/tmp.XXXXXX", cache_dir);
+  int fd = mkstemp(tmp);
+  if (fd == -1) {
+    free(tmp);
+    return;
+  }
+
+  fchmod(fd, 0644);
+
+  // A failure to write to the cache is not an error. The entry is
+  // simply not added.
+  bool ok = true;
+  for (size_t off = 0; off < len;) {
+    ssize_t n = write(fd, data + off, len - off);
+    if (n == -1 && errno == EINTR)
+      continue;
+    if (n <= 0) {
+      ok = false;
+      break;
+    }
+    off += n;
+  }
+  close(fd);
+
+  char *path = entry_path(key);
+  if (!ok || rename(tmp, path) == -1)
+    unlink(tmp);
+  free(tmp);
+  free(path);
+
+  pthread_mutex_lock(&cache_lock);
+  need_evict = true;
+  pthread_mutex_unlock(&cache_lock);
+}
+
+typedef struct {
+  char *path;
+  int64_t size;
+  struct timespec mtime;
+} CacheEntry;
+
+// Returns the entries in the cache directory and their total size.
+static CacheEntry *read_entries(int *nentries, int64_t *total) {
+  DIR *dir = opendir(cache_dir);
+  if (!dir)
+    error("cannot open cache directory: %s: %s", cache_dir, strerror(errno));
+
+  CacheEntry *entries = NULL;
+  int len = 0, cap = 0;
+  *total = 0;
+
+  for (struct dirent *de; (de = readdir(dir));) {
+    int namelen = strlen(de->d_name);
+    if (namelen < 2 || strcmp(de->d_name + namelen - 2, ".s"))
+      continue;
+
+    char *path = format("%s/%s", cache_dir, de->d_name);
+    struct stat st;
+    if (stat(path, &st) == -1) {
+      free(path);
+      continue;
+    }
+
+    if (len == cap) {
+      cap = cap ? cap * 2 : 64;
+      entries = realloc(entries, sizeof(CacheEntry) * cap);
+    }
+    entries[len++] = (CacheEntry){path, st.st_size, st.st_mtim};
+    *total += st.st_size;
+  }
+
+  closedir(dir);
+  *nentries = len;
+  return entries;
+}
+
+static int cmp_mtime(const void *a, const void *b) {
+  const struct timespec *x = &((CacheEntry *)a)->mtime;
+  const struct timespec *y = &((CacheEntry *)b)->mtime;
+  if (x->tv_sec != y->tv_sec)
+    return (x->tv_sec < y->tv_sec) ? -1 : 1;
+  if (x->tv_nsec != y->tv_nsec)
+    return (x->tv_nsec < y->tv_nsec) ? -1 : 1;
+  return 0;
+}
+
+// Removes the least recently used entries until the cache fits in the
+// size limit.
+static void evict(void) {
+  int n;
+  int64_t total;
+  CacheEntry *entries = read_entries(&n, &total);
+  qsort(entries, n, sizeof(CacheEntry), cmp_mtime);
+
+  for (int i = 0; i < n && total > cache_limit; i++)
+    if (unlink(entries[i].path) == 0)
+      total -= entries[i].size;
+
+  for (int i = 0; i < n; i++)
+    free(entries[i].path);
+  free(entries);
+}
+
+// The hit and miss counters of all processes that used the cache are
+// kept in this file. It is locked while being updated.
+static FILE *open_stats(void) {
+  char *path = format("%s/stats", cache_dir);
+  int fd = open(path, O_RDWR | O_CREAT, 0666);
+  free(path);
+  if (fd == -1)
+    return NULL;
+
+  struct flock lock = {.l_type = F_WRLCK, .l_whence = SEEK_SET};
+  while (fcntl(fd, F_SETLKW, &lock) == -1 && errno == EINTR);
+  return fdopen(fd, "r+");
+}
+
+static void read_stats(FILE *fp, long *hits, long *misses) {
+  *hits = *misses = 0;
+  if (fscanf(fp, "hits %ld\nmisses %ld\n", hits, misses) != 2)
+    *hits = *misses = 0;
+}
+
+// Records the statistics of this process and evicts old entries.
+void cache_finish(void) {
+  if (!cache_dir)
+    return;
+
+  FILE *fp = open_stats();
+  if (fp) {
+    long hits, misses;
+    read_stats(fp, &hits, &misses);
+    rewind(fp);
+    fprintf(fp, "hits %ld\nmisses %ld\n", hits + nhits, misses + nmisses);
+    fclose(fp);
+  }
+
+  if (need_evict)
+    evict();
+}
+
+void cache_print_stats(FILE *out) {
+  long hits = 0, misses = 0;
+  FILE *fp = open_stats();
+  if (fp) {
+    read_stats(fp, &hits, &misses);
+    fclose(fp);
+  }
+
+  int n;
+  int64_t total;
+  CacheEntry *entries = read_entries(&n, &total);
+  for (int i = 0; i < n; i++)
+    free(entries[i].path);
+  free(entries);
+
+  fprintf(out, "cache directory: %s\n", cache_dir);
+  fprintf(out, "hits: %ld\n", hits);
+  fprintf(out, "misses: %ld\n", misses);
+  fprintf(out, "entries: %d\n", n);
+  fprintf(out, "size: %ld bytes (limit %ld bytes)\n", (long)total, (long)cache_limit);
+}
@@ -1,23 +1,135 @@
 #define _POSIX_C_SOURCE 200809L
 #include <assert.h>
 #include <ctype.h>
+#include <dirent.h>
+#include <elf.h>
 #include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
 #include <stdarg.h>
 #include <stdbool.h>
+#include <stddef.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
 
 typedef struct Type Type;
 typedef struct Node Node;
 typedef struct Member Member;
+typedef struct Param Param;
+
+//
+// arena.c
+//
+
+typedef struct ArenaBlock ArenaBlock;
+
+// Bump-pointer allocator
+typedef struct {
+  ArenaBlock *head; // List of allocated blocks
+  char *ptr;        // Next free byte in the current block
+  char *end;        // End of the current block
+  int64_t allocated; // Bytes allocated, kept across arena_free()
+} Arena;
+
+extern _Thread_local Arena parse_arena;
+extern _Thread_local Arena func_arena;
+extern _Thread_local Arena type_arena;
+extern _Thread_local Arena ir_arena;
+
+void *arena_alloc(Arena *arena, size_t size);
+void arena_free(Arena *arena);
+void arena_reset(Arena *arena);
+
+//
+// hashmap.c
+//
+
+typedef struct {
+  char *key;
+  int keylen;
+  void *val;
+} HashEntry;
+
+typedef struct {
+  HashEntry *buckets;
+  int capacity;
+  int used;
+} HashMap;
+
+void *hashmap_get(HashMap *map, char *key);
+void *hashmap_get2(HashMap *map, char *key, int keylen);
+void hashmap_put(HashMap *map, char *key, void *val);
+void hashmap_put2(HashMap *map, char *key, int keylen, void *val);
+
+extern _Thread_local int64_t hashmap_nprobes;
 
 //
 // strings.c
 //
 
 char *format(char *fmt, ...);
+char *arena_format(Arena *arena, char *fmt, ...);
+char *intern(char *s, int len);
+void free_interned(void);
+
+//
+// stats.c
+//
+
+typedef enum {
+  PHASE_NONE = -1,
+  PHASE_TOKENIZE,
+  PHASE_PARSE,
+  PHASE_OPTIMIZE,
+  PHASE_IR,
+  PHASE_CODEGEN,
+  PHASE_ASSEMBLE,
+  NUM_PHASES,
+} Phase;
+
+// Counters of the current thread. All fields are int64_t so that
+// stats_merge() can add them up as an array.
+typedef struct {
+  int64_t wall_ns[NUM_PHASES];
+  int64_t cpu_ns[NUM_PHASES];
+  int64_t ntokens;
+  int64_t token_bytes;
+  int64_t nnodes;
+  int64_t ntypes;
+  int64_t nobjs;
+  int64_t ninsns;
+  int64_t var_lookups;
+  int64_t var_probes;
+  int64_t tag_lookups;
+  int64_t tag_probes;
+} Stats;
+
+extern _Thread_local Stats stats;
+
+void stats_init(void);
+Phase stats_phase(Phase phase);
+void stats_merge(void);
+void stats_print(FILE *out);
+void stats_print_json(FILE *out);
+
+//
+// cache.c
+//
+
+void cache_init(char *dir, int64_t limit);
+bool cache_enabled(void);
+char *cache_key(char *input, char *flags);
+char *cache_get(char *key, size_t *len);
+void cache_put(char *key, char *data, size_t len);
+void cache_finish(void);
+void cache_print_stats(FILE *out);
 
 //
 // tokenize.c
@@ -33,28 +145,75 @@ typedef enum {
   TK_EOF,     // End-of-file markers
 } TokenKind;
 
+// Punctuator IDs. A single-character punctuator is identified by
+// its character code, so the parser can write e.g. is_punct(tok, '+').
+typedef enum {
+  PUNCT_EQ = 256, // ==
+  PUNCT_NE,       // !=
+  PUNCT_LE,       // <=
+  PUNCT_GE,       // >=
+  PUNCT_ARROW,    // ->
+} PunctKind;
+
+// Keyword IDs
+typedef enum {
+  KW_RETURN = 1,
+  KW_IF,
+  KW_ELSE,
+  KW_FOR,
+  KW_WHILE,
+  KW_SIZEOF,
+  KW_VOID,
+  KW_CHAR,
+  KW_SHORT,
+  KW_INT,
+  KW_LONG,
+  KW_STRUCT,
+  KW_UNION,
+} KeywordKind;
+
 // Token type
+//
+// tokenize() returns the tokens of a file in one array, so the token
+// after `tok` is `tok + 1`. Identifiers, numbers and string literals
+// keep their values in side tables, which are read with tok_name(),
+// tok_val(), tok_str() and tok_type().
 typedef struct Token Token;
 struct Token {
   TokenKind kind; // Token kind
-  Token *next;    // Next token
-  int64_t val;    // If kind is TK_NUM, its value
-  char *loc;      // Token location
-  int len;        // Token length
-  Type *ty;       // Used if TK_STR
-  char *str;      // String literal contents including terminating '\0'
 
+  // PunctKind or character code if TK_PUNCT, KeywordKind if
+  // TK_KEYWORD, and an index into a side table if TK_IDENT, TK_NUM
+  // or TK_STR.
+  int id;
+
+  int offset;     // Offset of the token in the input
+  int len;        // Token length
   int line_no;    // Line number
 };
 
 void error(char *fmt, ...);
 void error_at(char *loc, char *fmt, ...);
 void error_tok(Token *tok, char *fmt, ...);
-bool equal(Token *tok, char *op);
-Token *skip(Token *tok, char *op);
-bool consume(Token **rest, Token *tok, char *str);
+char *tok_loc(Token *tok);
+char *tok_name(Token *tok);
+int64_t tok_val(Token *tok);
+char *tok_str(Token *tok);
+Type *tok_type(Token *tok);
+bool is_keyword(Token *tok, int keyword);
+bool is_punct(Token *tok, int punct);
+Token *skip_punct(Token *tok, int punct);
+bool consume_punct(Token **rest, Token *tok, int punct);
+char *read_file(char *path, size_t *mapped);
+void free_file(char *buf, size_t mapped);
+Token *tokenize(char *filename, char *p);
+Token *tokenize_first(char *filename, char *p);
+Token *tokenize_next(void);
 Token *tokenize_file(char *filename);
 
+#define MAX(x, y) ((x) < (y) ? (y) : (x))
+#define MIN(x, y) ((x) < (y) ? (x) : (y))
+
 #define unreachable() error("internal error at %s:%d", __FILE__, __LINE__)
 
 //
@@ -71,6 +230,10 @@ struct Obj {
 
   // Local variable
   int offset;
+  int live_begin; // Scope lifetime in parser ticks; locals whose
+  int live_end;   // lifetimes don't overlap may share a stack slot.
+  int promoted_id;  // Nonzero if -O1 keeps it in IR values instead
+                    // of a stack slot
 
   // Global variable or function
   bool is_function;
@@ -78,6 +241,7 @@ struct Obj {
 
   // Global variable
   char *init_data;
+  bool is_readonly; // Placed in .rodata
 
   // Function
   Obj *params;
@@ -116,35 +280,54 @@ typedef enum {
 // AST node type
 struct Node {
   NodeKind kind; // Node kind
+
+  // Number of intermediate values codegen has to keep aside while
+  // evaluating this node. Computed by codegen.
+  int need;
+
   Node *next;    // Next node
   Type *ty;      // Type, e.g. int or pointer to int
   Token *tok;    // Representative token
 
-  Node *lhs;     // Left-hand side
-  Node *rhs;     // Right-hand side
-
-  // "if" or "for" statement
-  Node *cond;
-  Node *then;
-  Node *els;
-  Node *init;
-  Node *inc;
-
-  // Block or statement expression
-  Node *body;
-
-  // Struct member access
-  Member *member;
-
-  // Function call
-  char *funcname;
-  Node *args;
-
-  Obj *var;      // Used if kind == ND_VAR
-  int64_t val;   // Used if kind == ND_NUM
+  // Each kind uses only some of the following fields, so they share
+  // storage, and a node is allocated only as large as its kind needs.
+  // Code that visits the children of a node has to look at its kind.
+  union {
+    // Operators. Unary ones only use lhs.
+    struct {
+      Node *lhs;     // Left-hand side
+      union {
+        Node *rhs;      // Right-hand side
+        Member *member; // Struct member access
+      };
+    };
+
+    // "if" or "for" statement
+    struct {
+      Node *cond;
+      Node *then;
+      Node *els;
+      Node *init;
+      Node *inc;
+    };
+
+    // Block or statement expression
+    Node *body;
+
+    // Function call
+    struct {
+      char *funcname;
+      Node *args;
+    };
+
+    Obj *var;      // Used if kind == ND_VAR
+    int64_t val;   // Used if kind == ND_NUM
+  };
 };
 
-Obj *parse(Token *tok);
+Obj *parse(Token *tok, void (*emit)(Obj *fn));
+Node *new_node(NodeKind kind, Token *tok);
+Node *copy_node(Node *node);
 
 //
 // type.c
@@ -178,29 +361,36 @@ struct Type {
   // the C spec.
   Type *base;
 
-  // Declaration
-  Token *name;
+  // Canonical pointer to this type, created by pointer_to()
+  Type *pointer;
 
   // Array
   int array_len;
 
   // Struct
   Member *members;
+  HashMap *member_map; // Members keyed by interned name
 
   // Function type
   Type *return_ty;
-  Type *params;
-  Type *next;
+  Param *params;
 };
 
 // Struct member
 struct Member {
   Member *next;
   Type *ty;
-  Token *name;
+  char *name; // Interned
   int offset;
 };
 
+// Function parameter
+struct Param {
+  Param *next;
+  Type *ty;
+  char *name; // Interned
+};
+
 extern Type *ty_void;
 extern Type *ty_char;
 extern Type *ty_short;
@@ -208,15 +398,130 @@ extern Type *ty_int;
 extern Type *ty_long;
 
 bool is_integer(Type *ty);
-Type *copy_type(Type *ty);
+void reset_types(void);
 Type *pointer_to(Type *base);
 Type *func_type(Type *return_ty);
 Type *array_of(Type *base, int size);
 void add_type(Node *node);
 
+//
+// optimize.c
+//
+
+void optimize_function(Obj *fn);
+void optimize(Obj *prog, bool inline_fns);
+
+//
+// ir.c
+//
+
+typedef struct IrInst IrInst;
+typedef struct IrBlock IrBlock;
+typedef struct IrFunc IrFunc;
+
+// IR instructions are in three-address form. Each instruction
+// defines at most one value, which is identified by a positive
+// integer. Until the IR is taken out of SSA form right before
+// instruction selection, each value is defined exactly once.
+typedef enum {
+  IR_IMM,    // dst = val
+  IR_ADDR,   // dst = &var + val
+  IR_PARAM,  // dst = val'th argument register
+  IR_COPY,   // dst = lhs
+  IR_SEXT,   // dst = lhs sign-extended from ty->size bytes
+  IR_NEG,    // dst = -lhs
+  IR_ADD,    // dst = lhs + rhs
+  IR_SUB,    // dst = lhs - rhs
+  IR_MUL,    // dst = lhs * rhs
+  IR_DIV,    // dst = lhs / rhs
+  IR_EQ,     // dst = lhs == rhs
+  IR_NE,     // dst = lhs != rhs
+  IR_LT,     // dst = lhs < rhs
+  IR_LE,     // dst = lhs <= rhs
+  IR_LOAD,   // dst = *lhs, sign-extended from ty->size bytes
+  IR_STORE,  // *lhs = rhs, truncated to ty->size bytes
+  IR_MEMCPY, // Copy ty->size bytes from rhs to lhs
+  IR_CALL,   // dst = funcname(args...)
+  IR_PHI,    // dst = phi[i] if control came from preds[i]
+  IR_JMP,    // goto then
+  IR_BR,     // if (lhs) goto then; else goto els
+  IR_RET,    // return lhs (no value if lhs == 0)
+} IrOp;
+
+struct IrInst {
+  IrInst *next;
+  IrOp op;
+  Token *tok;     // Representative token for .loc
+  int dst;
+  int lhs;
+  int rhs;
+
+  int64_t val;    // IR_IMM, IR_ADDR and IR_PARAM
+  Obj *var;       // IR_ADDR
+  Type *ty;       // IR_SEXT, IR_LOAD, IR_STORE and IR_MEMCPY
+
+  char *funcname; // IR_CALL
+
+  // Arguments of IR_CALL, or the incoming value from each
+  // predecessor of IR_PHI
+  int *args;
+  int nargs;
+
+  // IR_JMP and IR_BR
+  IrBlock *then;
+  IrBlock *els;
+};
+
+// A basic block. Its last instruction is always IR_JMP, IR_BR or
+// IR_RET.
+struct IrBlock {
+  IrBlock *next;  // Next block in layout order
+  int id;
+  IrInst *insts;
+
+  IrBlock **preds;
+  int npreds;
+
+  // Dominator tree
+  IrBlock *idom;
+  IrBlock *dom_child;
+  IrBlock *dom_sibling;
+  int rpo;        // Reverse postorder number, or -1 if unreachable
+};
+
+struct IrFunc {
+  Obj *fn;
+  IrBlock *blocks;
+  int nblocks;
+  int nvalues;    // Values are numbered from 1 to nvalues
+};
+
+IrFunc *lower_to_ir(Obj *fn);
+IrInst *new_inst(IrOp op, Token *tok);
+int new_value(IrFunc *f);
+IrInst *terminator(IrBlock *bb);
+int num_operands(IrInst *inst);
+int *operand(IrInst *inst, int i);
+int successors(IrBlock *bb, IrBlock **succs);
+
+//
+// iropt.c
+//
+
+void optimize_ir(IrFunc *f);
+void leave_ssa(IrFunc *f);
+
 //
 // codegen.c
 //
 
-void codegen(Obj *prog, FILE *out);
+void codegen(Obj *prog, FILE *out, int opt_level, int njobs);
+void codegen_function(Obj *fn, FILE *out, int opt_level);
+void codegen_data(Obj *prog, FILE *out);
 int align_to(int n, int align);
+
+//
+// elf.c
+//
+
+void assemble(char *text, FILE *out);
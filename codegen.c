@@ -1,37 +1,249 @@
 #include "chibicc.h"
 
-static FILE *output_file;
-static int depth;
+static _Thread_local FILE *output_file;
+static _Thread_local int depth;
+static char *tmpreg64[] = {"%rbx", "%r12", "%r13", "%r14", "%r15"};
+static _Thread_local int ntmpreg;
 static char *argreg8[] = {"%dil", "%sil", "%dl", "%cl", "%r8b", "%r9b"};
 static char *argreg16[] = {"%di", "%si", "%dx", "%cx", "%r8w", "%r9w"};
 static char *argreg32[] = {"%edi", "%esi", "%edx", "%ecx", "%r8d", "%r9d"};
 static char *argreg64[] = {"%rdi", "%rsi", "%rdx", "%rcx", "%r8", "%r9"};
-static Obj *current_fn;
+static _Thread_local Obj *current_fn;
 
 static void gen_expr(Node *node);
 static void gen_stmt(Node *node);
 
+// Assembly is accumulated in a large buffer and written out with a
+// single fwrite() each time the buffer fills up.
+#define OUTBUF_SIZE (1 << 16)
+static _Thread_local char outbuf[OUTBUF_SIZE];
+static _Thread_local int outbuf_len;
+
+// Line number of the last emitted .loc directive
+static _Thread_local int last_loc;
+
+static void flush_output(void) {
+  fwrite(outbuf, 1, outbuf_len, output_file);
+  outbuf_len = 0;
+}
+
+static void out_bytes(char *s, int len) {
+  if (outbuf_len + len > OUTBUF_SIZE) {
+    flush_output();
+    if (len > OUTBUF_SIZE) {
+      fwrite(s, 1, len, output_file);
+      return;
+    }
+  }
+  memcpy(outbuf + outbuf_len, s, len);
+  outbuf_len += len;
+}
+
+static void out_int(int64_t val) {
+  char buf[24];
+  char *p = buf + sizeof(buf);
+  uint64_t u = (val < 0) ? -(uint64_t)val : val;
+
+  do {
+    *--p = '0' + u % 10;
+    u /= 10;
+  } while (u);
+
+  if (val < 0)
+    *--p = '-';
+  out_bytes(p, buf + sizeof(buf) - p);
+}
+
+// Emits a line of assembly. This is a small replacement for fprintf()
+// that understands only the conversions we need for registers, labels,
+// immediates and `offset(%rbp)` operands: %s, %d, %ld and %%.
 static void println(char *fmt, ...) {
   va_list ap;
   va_start(ap, fmt);
-  vfprintf(output_file, fmt, ap);
+
+  // Instructions are indented, and so are directives.
+  if (fmt[0] == ' ' && fmt[2] != '.')
+    stats.ninsns++;
+
+  for (char *p = fmt; *p;) {
+    if (*p != '%') {
+      char *q = p;
+      while (*q && *q != '%')
+        q++;
+      out_bytes(p, q - p);
+      p = q;
+      continue;
+    }
+
+    switch (p[1]) {
+    case '%':
+      out_bytes("%", 1);
+      p += 2;
+      break;
+    case 's': {
+      char *str = va_arg(ap, char *);
+      out_bytes(str, strlen(str));
+      p += 2;
+      break;
+    }
+    case 'd':
+      out_int(va_arg(ap, int));
+      p += 2;
+      break;
+    case 'l':
+      assert(p[2] == 'd');
+      out_int(va_arg(ap, long));
+      p += 3;
+      break;
+    default:
+      unreachable();
+    }
+  }
+
   va_end(ap);
-  fprintf(output_file, "\n");
+  out_bytes("\n", 1);
+}
+
+// Emits a .loc directive unless the line number hasn't changed
+// since the last one.
+static void emit_loc(Token *tok) {
+  if (tok->line_no == last_loc)
+    return;
+  last_loc = tok->line_no;
+  println("  .loc 1 %d", tok->line_no);
 }
 
+static _Thread_local int label_id;
+
 static int count(void) {
-  static int i = 1;
-  return i++;
+  return ++label_id;
 }
 
+// Intermediate values are kept on a virtual stack. The bottom
+// `ntmpreg` slots of the stack live in callee-saved registers, which
+// also survive function calls made while evaluating the rest of an
+// expression. Only deeper slots spill to the machine stack.
 static void push(void) {
-  println("  push %%rax");
+  if (depth < ntmpreg)
+    println("  mov %%rax, %s", tmpreg64[depth]);
+  else
+    println("  push %%rax");
   depth++;
 }
 
 static void pop(char *arg) {
-  println("  pop %s", arg);
   depth--;
+  if (depth < ntmpreg)
+    println("  mov %s, %s", tmpreg64[depth], arg);
+  else
+    println("  pop %s", arg);
+}
+
+// Returns true if a given node is a constant that fits in the
+// 32-bit immediate field of an instruction.
+static bool is_imm32(Node *node) {
+  return node->kind == ND_NUM && node->val == (int32_t)node->val;
+}
+
+// If one operand of a binary node is a constant that can be encoded
+// into the instruction itself, returns the constant and sets *other
+// to the operand that has to be computed into %rax.
+static Node *imm_operand(Node *node, Node **other) {
+  Node *lhs = node->lhs;
+  Node *rhs = node->rhs;
+
+  switch (node->kind) {
+  case ND_DIV:
+    // Any nonzero divisor is turned into shifts or a multiplication.
+    if (rhs->kind == ND_NUM && rhs->val != 0) {
+      *other = lhs;
+      return rhs;
+    }
+    return NULL;
+  case ND_SUB:
+    if (is_imm32(rhs)) {
+      *other = lhs;
+      return rhs;
+    }
+    return NULL;
+  case ND_ADD:
+  case ND_MUL:
+  case ND_EQ:
+  case ND_NE:
+  case ND_LT:
+  case ND_LE:
+    if (is_imm32(rhs)) {
+      *other = lhs;
+      return rhs;
+    }
+    if (is_imm32(lhs)) {
+      *other = rhs;
+      return lhs;
+    }
+    return NULL;
+  }
+  return NULL;
+}
+
+// Computes the number of virtual stack slots needed to evaluate each
+// node (Sethi-Ullman numbering). For a binary operator, codegen
+// evaluates the operand with the larger need first, so that only one
+// slot is held while evaluating the other one.
+static int label(Node *node) {
+  if (!node)
+    return 0;
+
+  int need = 0;
+
+  switch (node->kind) {
+  case ND_ADD:
+  case ND_SUB:
+  case ND_MUL:
+  case ND_DIV:
+  case ND_EQ:
+  case ND_NE:
+  case ND_LT:
+  case ND_LE:
+  case ND_ASSIGN: {
+    int l = label(node->lhs);
+    int r = label(node->rhs);
+    Node *other;
+    if (imm_operand(node, &other))
+      need = other->need;
+    else
+      need = (l == r) ? l + 1 : MAX(l, r);
+    break;
+  }
+  case ND_FUNCALL: {
+    int i = 0;
+    for (Node *arg = node->args; arg; arg = arg->next, i++)
+      need = MAX(need, i + MAX(label(arg), 1));
+    break;
+  }
+  case ND_NUM:
+  case ND_VAR:
+    break;
+  case ND_IF:
+  case ND_FOR:
+    need = MAX(label(node->cond), label(node->then));
+    need = MAX(need, label(node->els));
+    need = MAX(need, label(node->init));
+    need = MAX(need, label(node->inc));
+    break;
+  case ND_BLOCK:
+  case ND_STMT_EXPR:
+    for (Node *n = node->body; n; n = n->next)
+      need = MAX(need, label(n));
+    break;
+  case ND_MEMBER:
+    need = label(node->lhs);
+    break;
+  default:
+    need = MAX(label(node->lhs), label(node->rhs));
+  }
+
+  node->need = need;
+  return need;
 }
 
 // Round up `n` to the nearest multiple of `align`. For instance,
@@ -91,15 +303,41 @@ static void load(Type *ty) {
     println("  mov (%%rax), %%rax");
 }
 
-// Store %rax to an address that the stack top is pointing to.
-static void store(Type *ty) {
-  pop("%rdi");
+// Structs up to this size are copied with a sequence of moves.
+// Larger ones are copied with `rep movsb`.
+#define INLINE_COPY_MAX 128
 
-  if(ty->kind == TY_STRUCT || ty->kind == TY_UNION){
-    for(int i = 0; i < ty->size; i++){
-      println("  mov %d(%%rax), %%r8b", i);
-      println("  mov %%r8b, %d(%%rdi)", i);
+// Copies `size` bytes from where %rax is pointing to to where %rdi
+// is pointing to. %rax is preserved.
+static void copy_struct(int size) {
+  if (size > INLINE_COPY_MAX) {
+    println("  mov %%rax, %%rsi");
+    println("  mov $%d, %%ecx", size);
+    println("  rep movsb");
+    return;
+  }
+
+  // movdqu doesn't require alignment, so 16-byte chunks can be
+  // copied through %xmm0 regardless of the struct's alignment.
+  int i = 0;
+  for (; i + 16 <= size; i += 16) {
+    println("  movdqu %d(%%rax), %%xmm0", i);
+    println("  movdqu %%xmm0, %d(%%rdi)", i);
+  }
+
+  static char *tmpreg[] = {"%r8", "%r8d", "%r8w", "%r8b"};
+  for (int sz = 8, r = 0; sz > 0; sz /= 2, r++) {
+    for (; i + sz <= size; i += sz) {
+      println("  mov %d(%%rax), %s", i, tmpreg[r]);
+      println("  mov %s, %d(%%rdi)", tmpreg[r], i);
     }
+  }
+}
+
+// Store %rax to an address that %rdi is pointing to.
+static void store(Type *ty) {
+  if(ty->kind == TY_STRUCT || ty->kind == TY_UNION){
+    copy_struct(ty->size);
     return;
   }
 
@@ -113,9 +351,247 @@ static void store(Type *ty) {
     println("  mov %%rax, (%%rdi)");
 }
 
+// Multiplies %rax by a constant.
+// Returns true if gen_mul_imm() can multiply by a given constant,
+// i.e. if it's an imm32 or a power of two.
+static bool is_mul_imm(int64_t c) {
+  uint64_t abs = (c < 0) ? -(uint64_t)c : c;
+  return c == (int32_t)c || (abs & (abs - 1)) == 0;
+}
+
+static void gen_mul_imm(int64_t c) {
+  // INT64_MIN can't be negated, but it's a power of two.
+  if (c == INT64_MIN) {
+    println("  shl $63, %%rax");
+    return;
+  }
+
+  if (c < 0) {
+    gen_mul_imm(-c);
+    println("  neg %%rax");
+    return;
+  }
+
+  // Multiplication by a power of two is a shift.
+  if (c && (c & (c - 1)) == 0) {
+    if (c > 1)
+      println("  shl $%d, %%rax", __builtin_ctzll(c));
+    return;
+  }
+
+  // x*3, x*5 and x*9 are a single lea.
+  if (c == 3 || c == 5 || c == 9) {
+    println("  lea (%%rax,%%rax,%d), %%rax", (int)c - 1);
+    return;
+  }
+
+  println("  imul $%ld, %%rax, %%rax", c);
+}
+
+// Computes the magic number and the shift amount to divide a signed
+// 64-bit integer by `d` with a multiplication. |d| must be at least 2.
+// See Hacker's Delight, 2nd edition, section 10-4.
+static void signed_magic(int64_t d, int64_t *magic, int *shift) {
+  uint64_t two63 = (uint64_t)1 << 63;
+  uint64_t ad = (d < 0) ? -(uint64_t)d : d;
+  uint64_t t = two63 + ((uint64_t)d >> 63);
+  uint64_t anc = t - 1 - t % ad;
+  uint64_t q1 = two63 / anc;
+  uint64_t r1 = two63 - q1 * anc;
+  uint64_t q2 = two63 / ad;
+  uint64_t r2 = two63 - q2 * ad;
+  uint64_t delta;
+  int p = 63;
+
+  do {
+    p++;
+    q1 *= 2;
+    r1 *= 2;
+    if (r1 >= anc) {
+      q1++;
+      r1 -= anc;
+    }
+    q2 *= 2;
+    r2 *= 2;
+    if (r2 >= ad) {
+      q2++;
+      r2 -= ad;
+    }
+    delta = ad - r2;
+  } while (q1 < delta || (q1 == delta && r1 == 0));
+
+  *magic = q2 + 1;
+  if (d < 0)
+    *magic = -*magic;
+  *shift = p - 64;
+}
+
+// Divides %rax by a nonzero constant, rounding toward zero, without
+// using the slow idiv instruction.
+static void gen_div_imm(int64_t d) {
+  if (d == 1)
+    return;
+
+  if (d == -1) {
+    println("  neg %%rax");
+    return;
+  }
+
+  uint64_t ad = (d < 0) ? -(uint64_t)d : d;
+
+  if ((ad & (ad - 1)) == 0) {
+    // Add 2^k-1 to a negative dividend before shifting it, so that
+    // the result is rounded toward zero.
+    int k = __builtin_ctzll(ad);
+    println("  mov %%rax, %%rdx");
+    println("  sar $63, %%rdx");
+    println("  shr $%d, %%rdx", 64 - k);
+    println("  add %%rdx, %%rax");
+    println("  sar $%d, %%rax", k);
+    if (d < 0)
+      println("  neg %%rax");
+    return;
+  }
+
+  int64_t magic;
+  int shift;
+  signed_magic(d, &magic, &shift);
+
+  // %rdx = high 64 bits of the dividend times the magic number
+  println("  mov %%rax, %%rcx");
+  println("  mov $%ld, %%rdx", magic);
+  println("  imul %%rdx");
+  if (d > 0 && magic < 0)
+    println("  add %%rcx, %%rdx");
+  if (d < 0 && magic > 0)
+    println("  sub %%rcx, %%rdx");
+  if (shift)
+    println("  sar $%d, %%rdx", shift);
+
+  // Add one if the quotient is negative.
+  println("  mov %%rdx, %%rax");
+  println("  shr $63, %%rax");
+  println("  add %%rdx, %%rax");
+}
+
+// Generates code for a binary operator one of whose operands is
+// a constant that is encoded into the instruction.
+static void gen_binary_imm(Node *node, Node *imm, Node *other) {
+  gen_expr(other);
+
+  int64_t c = imm->val;
+
+  switch (node->kind) {
+  case ND_ADD:
+    println("  add $%ld, %%rax", c);
+    return;
+  case ND_SUB:
+    println("  sub $%ld, %%rax", c);
+    return;
+  case ND_MUL:
+    gen_mul_imm(c);
+    return;
+  case ND_DIV:
+    gen_div_imm(c);
+    return;
+  }
+  unreachable();
+}
+
+// Computes the lhs of a binary operator into %rax and the rhs into %rdi.
+static void gen_operands(Node *node) {
+  if (node->lhs->need > node->rhs->need) {
+    gen_expr(node->lhs);
+    push();
+    gen_expr(node->rhs);
+    println("  mov %%rax, %%rdi");
+    pop("%rax");
+  } else {
+    gen_expr(node->rhs);
+    push();
+    gen_expr(node->lhs);
+    pop("%rdi");
+  }
+}
+
+// Emits a cmp instruction for an ==, !=, < or <= node and returns
+// the condition code that holds if the comparison is true.
+static char *gen_cmp(Node *node) {
+  Node *other;
+  Node *imm = imm_operand(node, &other);
+  bool swapped = false;
+
+  if (imm) {
+    gen_expr(other);
+    println("  cmp $%ld, %%rax", imm->val);
+    swapped = (imm == node->lhs);
+  } else {
+    gen_operands(node);
+    println("  cmp %%rdi, %%rax");
+  }
+
+  switch (node->kind) {
+  case ND_EQ: return "e";
+  case ND_NE: return "ne";
+  case ND_LT: return swapped ? "g" : "l";
+  case ND_LE: return swapped ? "ge" : "le";
+  }
+  unreachable();
+}
+
+static char *negate_cc(char *cc) {
+  if (!strcmp(cc, "e")) return "ne";
+  if (!strcmp(cc, "ne")) return "e";
+  if (!strcmp(cc, "l")) return "ge";
+  if (!strcmp(cc, "ge")) return "l";
+  if (!strcmp(cc, "le")) return "g";
+  if (!strcmp(cc, "g")) return "le";
+  unreachable();
+}
+
+// Generates code that jumps to `true_label` if a given condition is
+// true and to `false_label` if it is false. Either label may be NULL,
+// in which case control falls through on that outcome.
+//
+// Comparisons set the flags with cmp and are followed directly by a
+// conditional jump, instead of materializing a boolean in %rax and
+// testing it again.
+static void gen_cond(Node *node, char *true_label, char *false_label) {
+  emit_loc(node->tok);
+
+  char *cc;
+
+  switch (node->kind) {
+  case ND_NUM: {
+    char *label = node->val ? true_label : false_label;
+    if (label)
+      println("  jmp %s", label);
+    return;
+  }
+  case ND_EQ:
+  case ND_NE:
+  case ND_LT:
+  case ND_LE:
+    cc = gen_cmp(node);
+    break;
+  default:
+    gen_expr(node);
+    println("  cmp $0, %%rax");
+    cc = "ne";
+  }
+
+  if (true_label) {
+    println("  j%s %s", cc, true_label);
+    if (false_label)
+      println("  jmp %s", false_label);
+  } else if (false_label) {
+    println("  j%s %s", negate_cc(cc), false_label);
+  }
+}
+
 // Generate code for a given node.
 static void gen_expr(Node *node) {
-  println("  .loc 1 %d", node->tok->line_no);
+  emit_loc(node->tok);
 
   switch (node->kind) {
   case ND_NUM:
@@ -138,9 +614,18 @@ static void gen_expr(Node *node) {
     gen_addr(node->lhs);
     return;
   case ND_ASSIGN:
-    gen_addr(node->lhs);
-    push();
-    gen_expr(node->rhs);
+    if (node->rhs->need > node->lhs->need) {
+      gen_expr(node->rhs);
+      push();
+      gen_addr(node->lhs);
+      println("  mov %%rax, %%rdi");
+      pop("%rax");
+    } else {
+      gen_addr(node->lhs);
+      push();
+      gen_expr(node->rhs);
+      pop("%rdi");
+    }
     store(node->ty);
     return;
   case ND_STMT_EXPR:
@@ -162,16 +647,39 @@ static void gen_expr(Node *node) {
     for (int i = nargs - 1; i >= 0; i--)
       pop(argreg64[i]);
 
+    // Keep %rsp aligned to 16 bytes at the call as the ABI requires.
+    // It moves only for values spilled to the machine stack.
+    bool pad = MAX(depth - ntmpreg, 0) % 2;
+    if (pad)
+      println("  sub $8, %%rsp");
+
     println("  mov $0, %%rax");
     println("  call %s", node->funcname);
+
+    if (pad)
+      println("  add $8, %%rsp");
+    return;
+  }
+  }
+
+  switch (node->kind) {
+  case ND_EQ:
+  case ND_NE:
+  case ND_LT:
+  case ND_LE:
+    println("  set%s %%al", gen_cmp(node));
+    println("  movzb %%al, %%rax");
     return;
   }
+
+  Node *other;
+  Node *imm = imm_operand(node, &other);
+  if (imm) {
+    gen_binary_imm(node, imm, other);
+    return;
   }
 
-  gen_expr(node->rhs);
-  push();
-  gen_expr(node->lhs);
-  pop("%rdi");
+  gen_operands(node);
 
   switch (node->kind) {
   case ND_ADD:
@@ -187,60 +695,41 @@ static void gen_expr(Node *node) {
     println("  cqo");
     println("  idiv %%rdi");
     return;
-  case ND_EQ:
-  case ND_NE:
-  case ND_LT:
-  case ND_LE:
-    println("  cmp %%rdi, %%rax");
-
-    if (node->kind == ND_EQ)
-      println("  sete %%al");
-    else if (node->kind == ND_NE)
-      println("  setne %%al");
-    else if (node->kind == ND_LT)
-      println("  setl %%al");
-    else if (node->kind == ND_LE)
-      println("  setle %%al");
-
-    println("  movzb %%al, %%rax");
-    return;
   }
 
   error_tok(node->tok, "invalid expression");
 }
 
 static void gen_stmt(Node *node) {
-  println("  .loc 1 %d", node->tok->line_no);
+  emit_loc(node->tok);
 
   switch (node->kind) {
   case ND_IF: {
     int c = count();
-    gen_expr(node->cond);
-    println("  cmp $0, %%rax");
-    println("  je  .L.else.%d", c);
+    char *els = arena_format(&ir_arena, ".L.else.%s.%d", current_fn->name, c);
+    gen_cond(node->cond, NULL, els);
     gen_stmt(node->then);
-    println("  jmp .L.end.%d", c);
-    println(".L.else.%d:", c);
+    println("  jmp .L.end.%s.%d", current_fn->name, c);
+    println(".L.else.%s.%d:", current_fn->name, c);
     if (node->els)
       gen_stmt(node->els);
-    println(".L.end.%d:", c);
+    println(".L.end.%s.%d:", current_fn->name, c);
     return;
   }
   case ND_FOR: {
     int c = count();
     if (node->init)
       gen_stmt(node->init);
-    println(".L.begin.%d:", c);
+    println(".L.begin.%s.%d:", current_fn->name, c);
     if (node->cond) {
-      gen_expr(node->cond);
-      println("  cmp $0, %%rax");
-      println("  je  .L.end.%d", c);
+      char *end = arena_format(&ir_arena, ".L.end.%s.%d", current_fn->name, c);
+      gen_cond(node->cond, NULL, end);
     }
     gen_stmt(node->then);
     if (node->inc)
       gen_expr(node->inc);
-    println("  jmp .L.begin.%d", c);
-    println(".L.end.%d:", c);
+    println("  jmp .L.begin.%s.%d", current_fn->name, c);
+    println(".L.end.%s.%d:", current_fn->name, c);
     return;
   }
   case ND_BLOCK:
@@ -259,20 +748,105 @@ static void gen_stmt(Node *node) {
   error_tok(node->tok, "invalid statement");
 }
 
-// Assign offsets to local variables.
-static void assign_lvar_offsets(Obj *prog) {
-  for (Obj *fn = prog; fn; fn = fn->next) {
-    if (!fn->is_function)
-      continue;
+static bool is_live_together(Obj *a, Obj *b) {
+  return a->live_begin <= b->live_end && b->live_begin <= a->live_end;
+}
+
+// Sort by decreasing alignment so that variables sharing the frame
+// are packed without padding. Ties keep the order of `fn->locals`.
+static int cmp_align(const void *x, const void *y) {
+  Obj *a = *(Obj **)x;
+  Obj *b = *(Obj **)y;
+  if (a->ty->align != b->ty->align)
+    return b->ty->align - a->ty->align;
+  return b->live_begin - a->live_begin;
+}
+
+// Assign offsets to local variables. Variables from scopes that are
+// never live at the same time share stack slots: each variable gets
+// the lowest offset that doesn't overlap a variable already placed
+// whose lifetime intersects its own. Variables promoted to IR values
+// get no slot.
+//
+// Placed variables are kept sorted by offset, so the lowest free
+// offset is found in one pass over them.
+static void assign_lvar_offsets(Obj *fn) {
+  int nvars = 0;
+  for (Obj *var = fn->locals; var; var = var->next)
+    if (!var->promoted_id)
+      nvars++;
+
+  Obj **vars = calloc(nvars, sizeof(Obj *));
+  int i = 0;
+  for (Obj *var = fn->locals; var; var = var->next)
+    if (!var->promoted_id)
+      vars[i++] = var;
+  qsort(vars, nvars, sizeof(Obj *), cmp_align);
+
+  // An object placed at `start` occupies [start, start + size)
+  // bytes below %rbp.
+  int *start = calloc(nvars, sizeof(int));
+  int *placed = calloc(nvars, sizeof(int));
+  int stack_size = 0;
+
+  for (int i = 0; i < nvars; i++) {
+    Obj *var = vars[i];
+    int size = var->ty->size;
 
-    int offset = 0;
-    for (Obj *var = fn->locals; var; var = var->next) {
-      offset += var->ty->size;
-      offset = align_to(offset, var->ty->align);
-      var->offset = -offset;
+    // A variable that doesn't overlap `pos` when it's visited begins
+    // after it or ends before it, and so does every variable visited
+    // later or earlier, respectively, as `pos` only moves up.
+    int pos = 0;
+    for (int k = 0; k < i; k++) {
+      int j = placed[k];
+      if (is_live_together(var, vars[j]) &&
+          pos < start[j] + vars[j]->ty->size && start[j] < pos + size)
+        pos = align_to(start[j] + vars[j]->ty->size, var->ty->align);
     }
-    fn->stack_size = align_to(offset, 16);
+
+    int k = i;
+    while (k > 0 && start[placed[k - 1]] > pos) {
+      placed[k] = placed[k - 1];
+      k--;
+    }
+    placed[k] = i;
+    start[i] = pos;
+    var->offset = -(pos + size);
+    stack_size = MAX(stack_size, pos + size);
+  }
+
+  fn->stack_size = align_to(stack_size, 16);
+  free(vars);
+  free(start);
+  free(placed);
+}
+
+// Returns a given sequence of bytes as the contents of an assembler
+// string literal.
+static char *quote_bytes(char *p, int len) {
+  char *buf;
+  size_t buflen;
+  FILE *out = open_memstream(&buf, &buflen);
+
+  for (int i = 0; i < len; i++) {
+    unsigned char c = p[i];
+    if (c == '"' || c == '\\')
+      fprintf(out, "\\%c", c);
+    else if (' ' <= c && c <= '~')
+      fputc(c, out);
+    else
+      fprintf(out, "\\%03o", c);
   }
+
+  fclose(out);
+  return buf;
+}
+
+// Only string literals have initial data, and they end with '\0', so
+// they are written as a single .string directive.
+static void emit_init_data(char *p, int size) {
+  assert(size > 0 && p[size - 1] == '\0');
+  println("  .string \"%s\"", quote_bytes(p, size - 1));
 }
 
 static void emit_data(Obj *prog) {
@@ -280,16 +854,28 @@ static void emit_data(Obj *prog) {
     if (var->is_function)
       continue;
 
-    println("  .data");
-    println("  .globl %s", var->name);
-    println("%s:", var->name);
+    // Zero-initialized variables go to .bss, which takes no space in
+    // the object file.
+    if (!var->init_data) {
+      println("  .globl %s", var->name);
+      println("  .bss");
+      if (var->ty->align > 1)
+        println("  .align %d", var->ty->align);
+      println("%s:", var->name);
+      println("  .zero %d", var->ty->size);
+      continue;
+    }
 
-    if (var->init_data) {
-      for (int i = 0; i < var->ty->size; i++)
-        println("  .byte %d", var->init_data[i]);
+    if (var->is_readonly) {
+      println("  .section .rodata");
     } else {
-      println("  .zero %d", var->ty->size);
+      println("  .globl %s", var->name);
+      println("  .data");
     }
+    if (var->ty->align > 1)
+      println("  .align %d", var->ty->align);
+    println("%s:", var->name);
+    emit_init_data(var->init_data, var->ty->size);
   }
 }
 
@@ -311,43 +897,786 @@ static void store_gp(int r, int offset, int sz){
   unreachable();
 }
 
-static void emit_text(Obj *prog) {
-  for (Obj *fn = prog; fn; fn = fn->next) {
-    if (!fn->is_function || !fn->is_definition)
-      continue;
+//
+// Code generation from the IR (-O1)
+//
+// Values that are not constants or addresses are assigned to the
+// callee-saved registers by linear scan, so that they survive calls
+// without being saved. Values that don't fit are spilled to the
+// frame. Instructions compute their result in %rax, which together
+// with %rdi, %rcx, %rdx, %rsi and %r8 is free for scratch use.
+//
 
-    println("  .globl %s", fn->name);
-    println("  .text");
-    println("%s:", fn->name);
-    current_fn = fn;
+static _Thread_local IrFunc *cur_ir;
+static _Thread_local IrInst **ir_def;
 
-    // Prologue
-    println("  push %%rbp");
-    println("  mov %%rsp, %%rbp");
-    println("  sub $%d, %%rsp", fn->stack_size);
+// Location of each value: a register or a stack slot.
+static _Thread_local char **ir_loc;
 
-    // Save passed-by-register arguments to the stack
-    int i = 0;
-    for (Obj *var = fn->params; var; var = var->next) {
-      store_gp(i++, var->offset, var->ty->size);
+// Operand of each value as the source of an instruction, or NULL if
+// it has to be computed into a register first.
+static _Thread_local char **ir_opnd;
+
+static _Thread_local int *ir_nuses;
+static _Thread_local int *ir_label;
+
+// Returns true if a given value is recomputed wherever it is used
+// instead of being kept in a register.
+static bool is_remat(int v) {
+  return ir_def[v] && (ir_def[v]->op == IR_IMM || ir_def[v]->op == IR_ADDR);
+}
+
+static bool is_ir_imm(int v) {
+  return ir_def[v] && ir_def[v]->op == IR_IMM;
+}
+
+static char *addr_operand(IrInst *def) {
+  if (def->var->is_local)
+    return arena_format(&ir_arena, "%d(%%rbp)", def->var->offset + (int)def->val);
+  if (def->val)
+    return arena_format(&ir_arena, "%s+%ld(%%rip)", def->var->name, def->val);
+  return arena_format(&ir_arena, "%s(%%rip)", def->var->name);
+}
+
+// Computes a given value into a register.
+static void load_value(int v, char *reg) {
+  IrInst *def = ir_def[v];
+  if (def && def->op == IR_IMM)
+    println("  mov $%ld, %s", def->val, reg);
+  else if (def && def->op == IR_ADDR)
+    println("  lea %s, %s", addr_operand(def), reg);
+  else if (strcmp(ir_loc[v], reg))
+    println("  mov %s, %s", ir_loc[v], reg);
+}
+
+static void store_value(char *reg, int v) {
+  if (v && strcmp(ir_loc[v], reg))
+    println("  mov %s, %s", reg, ir_loc[v]);
+}
+
+// Returns an operand for the right-hand side of an instruction whose
+// other operand is in %rax.
+static char *src_operand(int v, char *scratch) {
+  if (ir_opnd[v])
+    return ir_opnd[v];
+  load_value(v, scratch);
+  return scratch;
+}
+
+// Returns a memory operand that refers to where a given value points
+// to. A variable's address is folded into the operand.
+static char *mem_operand(int v, char *scratch) {
+  IrInst *def = ir_def[v];
+  if (def && def->op == IR_ADDR)
+    return addr_operand(def);
+  load_value(v, scratch);
+  return arena_format(&ir_arena, "(%s)", scratch);
+}
+
+// Returns the register an instruction computes its result into: the
+// register of the result itself if it has one and no operand other
+// than the first one is in it, or %rax.
+static char *result_reg(IrInst *inst) {
+  char *loc = ir_loc[inst->dst];
+  if (!loc || loc[0] != '%')
+    return "%rax";
+  if (inst->rhs && ir_loc[inst->rhs] && !strcmp(ir_loc[inst->rhs], loc))
+    return "%rax";
+  return loc;
+}
+
+// Returns the low `size` bytes of a 64-bit register.
+static char *sub_reg(char *reg, int size) {
+  static char *regs[][4] = {
+    {"%rax", "%eax", "%ax", "%al"},
+    {"%rdi", "%edi", "%di", "%dil"},
+    {"%rbx", "%ebx", "%bx", "%bl"},
+    {"%r12", "%r12d", "%r12w", "%r12b"},
+    {"%r13", "%r13d", "%r13w", "%r13b"},
+    {"%r14", "%r14d", "%r14w", "%r14b"},
+    {"%r15", "%r15d", "%r15w", "%r15b"},
+  };
+  int col = (size == 4) ? 1 : (size == 2) ? 2 : 3;
+  for (int i = 0; i < sizeof(regs) / sizeof(*regs); i++)
+    if (!strcmp(regs[i][0], reg))
+      return regs[i][col];
+  unreachable();
+}
+
+static bool is_cmp(IrOp op) {
+  return op == IR_EQ || op == IR_NE || op == IR_LT || op == IR_LE;
+}
+
+static char *ir_cc(IrOp op) {
+  switch (op) {
+  case IR_EQ: return "e";
+  case IR_NE: return "ne";
+  case IR_LT: return "l";
+  case IR_LE: return "le";
+  }
+  unreachable();
+}
+
+// Returns true if a comparison only feeds the conditional branch at
+// the end of its block, so that the branch can use the flags
+// directly. Copies inserted by leave_ssa() may come in between
+// because mov doesn't change the flags.
+static bool is_fused_cmp(IrInst *inst) {
+  if (!is_cmp(inst->op) || ir_nuses[inst->dst] != 1)
+    return false;
+
+  IrInst *next = inst->next;
+  while (next->op == IR_COPY)
+    next = next->next;
+  return next->op == IR_BR && next->lhs == inst->dst;
+}
+
+static void gen_ir_inst(IrInst *inst, IrBlock *next_bb) {
+  if (inst->tok)
+    emit_loc(inst->tok);
+
+  switch (inst->op) {
+  case IR_IMM:
+  case IR_ADDR:
+    return;
+  case IR_PARAM:
+    store_value(argreg64[inst->val], inst->dst);
+    return;
+  case IR_COPY:
+    if (ir_loc[inst->dst][0] == '%') {
+      load_value(inst->lhs, ir_loc[inst->dst]);
+      return;
+    }
+    if (!is_remat(inst->lhs) && ir_loc[inst->lhs][0] == '%') {
+      store_value(ir_loc[inst->lhs], inst->dst);
+      return;
+    }
+    load_value(inst->lhs, "%rax");
+    store_value("%rax", inst->dst);
+    return;
+  case IR_SEXT: {
+    char *r = result_reg(inst);
+    load_value(inst->lhs, r);
+    if (inst->ty->size == 1)
+      println("  movsbq %s, %s", sub_reg(r, 1), r);
+    else if (inst->ty->size == 2)
+      println("  movswq %s, %s", sub_reg(r, 2), r);
+    else
+      println("  movslq %s, %s", sub_reg(r, 4), r);
+    store_value(r, inst->dst);
+    return;
+  }
+  case IR_NEG: {
+    char *r = result_reg(inst);
+    load_value(inst->lhs, r);
+    println("  neg %s", r);
+    store_value(r, inst->dst);
+    return;
+  }
+  case IR_ADD:
+  case IR_SUB: {
+    char *r = result_reg(inst);
+    load_value(inst->lhs, r);
+    char *src = src_operand(inst->rhs, "%rdi");
+    println("  %s %s, %s", inst->op == IR_ADD ? "add" : "sub", src, r);
+    store_value(r, inst->dst);
+    return;
+  }
+  case IR_MUL:
+    if (is_ir_imm(inst->rhs) && is_mul_imm(ir_def[inst->rhs]->val)) {
+      load_value(inst->lhs, "%rax");
+      gen_mul_imm(ir_def[inst->rhs]->val);
+      store_value("%rax", inst->dst);
+    } else {
+      char *r = result_reg(inst);
+      load_value(inst->lhs, r);
+      println("  imul %s, %s", src_operand(inst->rhs, "%rdi"), r);
+      store_value(r, inst->dst);
     }
+    return;
+  case IR_DIV:
+    if (is_ir_imm(inst->rhs) && ir_def[inst->rhs]->val) {
+      load_value(inst->lhs, "%rax");
+      gen_div_imm(ir_def[inst->rhs]->val);
+    } else {
+      load_value(inst->rhs, "%rdi");
+      load_value(inst->lhs, "%rax");
+      println("  cqo");
+      println("  idiv %%rdi");
+    }
+    store_value("%rax", inst->dst);
+    return;
+  case IR_EQ:
+  case IR_NE:
+  case IR_LT:
+  case IR_LE: {
+    char *lhs = ir_loc[inst->lhs];
+    if (!lhs || lhs[0] != '%') {
+      load_value(inst->lhs, "%rax");
+      lhs = "%rax";
+    }
+    println("  cmp %s, %s", src_operand(inst->rhs, "%rdi"), lhs);
+    if (is_fused_cmp(inst))
+      return;
+
+    char *r = result_reg(inst);
+    println("  set%s %%al", ir_cc(inst->op));
+    println("  movzb %%al, %s", r);
+    store_value(r, inst->dst);
+    return;
+  }
+  case IR_LOAD: {
+    char *src = mem_operand(inst->lhs, "%rax");
+    char *r = result_reg(inst);
+    if (inst->ty->size == 1)
+      println("  movsbq %s, %s", src, r);
+    else if (inst->ty->size == 2)
+      println("  movswq %s, %s", src, r);
+    else if (inst->ty->size == 4)
+      println("  movslq %s, %s", src, r);
+    else
+      println("  mov %s, %s", src, r);
+    store_value(r, inst->dst);
+    return;
+  }
+  case IR_STORE: {
+    int size = inst->ty->size;
+    char *dst = mem_operand(inst->lhs, "%rax");
 
-    // Emit code
-    gen_stmt(fn->body);
-    assert(depth == 0);
+    // A narrow store keeps the low bits of a constant, so truncate it
+    // to fit the immediate field.
+    if (is_ir_imm(inst->rhs) && (size < 8 || ir_opnd[inst->rhs])) {
+      int64_t val = ir_def[inst->rhs]->val;
+      char *suffix = "q";
+      if (size == 1) {
+        val = (int8_t)val;
+        suffix = "b";
+      } else if (size == 2) {
+        val = (int16_t)val;
+        suffix = "w";
+      } else if (size == 4) {
+        val = (int32_t)val;
+        suffix = "l";
+      }
+      println("  mov%s $%ld, %s", suffix, val, dst);
+      return;
+    }
 
-    // Epilogue
-    println(".L.return.%s:", fn->name);
-    println("  mov %%rbp, %%rsp");
-    println("  pop %%rbp");
-    println("  ret");
+    char *src = ir_loc[inst->rhs];
+    if (!src || src[0] != '%') {
+      load_value(inst->rhs, "%rdi");
+      src = "%rdi";
+    }
+    println("  mov %s, %s", (size == 8) ? src : sub_reg(src, size), dst);
+    return;
   }
+  case IR_MEMCPY:
+    load_value(inst->rhs, "%rax");
+    load_value(inst->lhs, "%rdi");
+    copy_struct(inst->ty->size);
+    return;
+  case IR_CALL:
+    for (int i = 0; i < inst->nargs; i++)
+      load_value(inst->args[i], argreg64[i]);
+    println("  mov $0, %%rax");
+    println("  call %s", inst->funcname);
+    store_value("%rax", inst->dst);
+    return;
+  case IR_JMP:
+    if (inst->then != next_bb)
+      println("  jmp .L.bb.%s.%d", current_fn->name, ir_label[inst->then->id]);
+    return;
+  case IR_BR: {
+    IrInst *def = ir_def[inst->lhs];
+    if (is_ir_imm(inst->lhs)) {
+      IrBlock *target = def->val ? inst->then : inst->els;
+      if (target != next_bb)
+        println("  jmp .L.bb.%s.%d", current_fn->name, ir_label[target->id]);
+      return;
+    }
+
+    char *cc = "ne";
+    if (def && is_fused_cmp(def)) {
+      cc = ir_cc(def->op);
+    } else {
+      load_value(inst->lhs, "%rax");
+      println("  cmp $0, %%rax");
+    }
+
+    if (inst->then == next_bb) {
+      println("  j%s .L.bb.%s.%d", negate_cc(cc), current_fn->name, ir_label[inst->els->id]);
+      return;
+    }
+    println("  j%s .L.bb.%s.%d", cc, current_fn->name, ir_label[inst->then->id]);
+    if (inst->els != next_bb)
+      println("  jmp .L.bb.%s.%d", current_fn->name, ir_label[inst->els->id]);
+    return;
+  }
+  case IR_RET:
+    if (inst->lhs)
+      load_value(inst->lhs, "%rax");
+    if (next_bb)
+      println("  jmp .L.return.%s", current_fn->name);
+    return;
+  }
+  unreachable();
+}
+
+static void extend_interval(int *start, int *end, int v, int pos) {
+  start[v] = MIN(start[v], pos);
+  end[v] = MAX(end[v], pos);
+}
+
+// Computes a conservative live interval [start, end] for each value.
+// Instruction i reads its operands at 2i and writes its result at
+// 2i+1, so a value may take over the register of an operand that
+// dies at the same instruction.
+//
+// Liveness is solved one value at a time: starting from the blocks
+// that use a value before defining it, the value is live into a block
+// and out of its predecessors, and further up until a block that
+// defines it. This takes time proportional to the size of the live
+// sets rather than blocks times values.
+static void live_intervals(int *start, int *end) {
+  IrFunc *f = cur_ir;
+  int nvalues = f->nvalues;
+  int nblocks = f->nblocks;
+
+  int *first = calloc(nblocks, sizeof(int));
+  int *last = calloc(nblocks, sizeof(int));
+  int *npreds = calloc(nblocks, sizeof(int));
+  IrBlock ***preds = calloc(nblocks, sizeof(IrBlock **));
+
+  // A block defining or using a value before defining it, chained per
+  // value from def_head[] or use_head[]. Entries are 1-based.
+  int nrefs = 0;
+  for (IrBlock *bb = f->blocks; bb; bb = bb->next)
+    for (IrInst *inst = bb->insts; inst; inst = inst->next)
+      nrefs += num_operands(inst) + 1;
+  IrBlock **ref_block = calloc(nrefs + 1, sizeof(IrBlock *));
+  int *ref_next = calloc(nrefs + 1, sizeof(int));
+  int *def_head = calloc(nvalues + 1, sizeof(int));
+  int *use_head = calloc(nvalues + 1, sizeof(int));
+  nrefs = 0;
+
+  // Block ID + 1 of the block that last defined or used each value
+  int *def_mark = calloc(nvalues + 1, sizeof(int));
+  int *use_mark = calloc(nvalues + 1, sizeof(int));
+  int pos = 0;
+
+  for (IrBlock *bb = f->blocks; bb; bb = bb->next) {
+    int id = bb->id;
+    first[id] = pos;
+
+    IrBlock *succs[2];
+    int nsuccs = successors(bb, succs);
+    for (int i = 0; i < nsuccs; i++)
+      npreds[succs[i]->id]++;
+
+    for (IrInst *inst = bb->insts; inst; inst = inst->next, pos++) {
+      for (int i = 0; i < num_operands(inst); i++) {
+        int v = *operand(inst, i);
+        if (!v || is_remat(v))
+          continue;
+        extend_interval(start, end, v, pos * 2);
+        if (def_mark[v] != id + 1 && use_mark[v] != id + 1) {
+          use_mark[v] = id + 1;
+          ref_block[++nrefs] = bb;
+          ref_next[nrefs] = use_head[v];
+          use_head[v] = nrefs;
+        }
+      }
+      if (inst->dst) {
+        int v = inst->dst;
+        extend_interval(start, end, v, pos * 2 + 1);
+        if (def_mark[v] != id + 1) {
+          def_mark[v] = id + 1;
+          ref_block[++nrefs] = bb;
+          ref_next[nrefs] = def_head[v];
+          def_head[v] = nrefs;
+        }
+      }
+    }
+    last[id] = pos - 1;
+  }
+
+  for (IrBlock *bb = f->blocks; bb; bb = bb->next) {
+    preds[bb->id] = calloc(npreds[bb->id], sizeof(IrBlock *));
+    npreds[bb->id] = 0;
+  }
+  for (IrBlock *bb = f->blocks; bb; bb = bb->next) {
+    IrBlock *succs[2];
+    int nsuccs = successors(bb, succs);
+    for (int i = 0; i < nsuccs; i++)
+      preds[succs[i]->id][npreds[succs[i]->id]++] = bb;
+  }
+
+  // Per block, the last value that was found to be defined in it, live
+  // into it or live out of it
+  int *defined = calloc(nblocks, sizeof(int));
+  int *live_in = calloc(nblocks, sizeof(int));
+  int *live_out = calloc(nblocks, sizeof(int));
+  IrBlock **worklist = calloc(nblocks, sizeof(IrBlock *));
+
+  for (int v = 1; v <= nvalues; v++) {
+    for (int r = def_head[v]; r; r = ref_next[r])
+      defined[ref_block[r]->id] = v;
+
+    int len = 0;
+    for (int r = use_head[v]; r; r = ref_next[r]) {
+      IrBlock *bb = ref_block[r];
+      if (live_in[bb->id] != v) {
+        live_in[bb->id] = v;
+        extend_interval(start, end, v, first[bb->id] * 2 - 1);
+        worklist[len++] = bb;
+      }
+    }
+
+    while (len) {
+      IrBlock *bb = worklist[--len];
+      for (int i = 0; i < npreds[bb->id]; i++) {
+        IrBlock *p = preds[bb->id][i];
+        if (live_out[p->id] != v) {
+          live_out[p->id] = v;
+          extend_interval(start, end, v, last[p->id] * 2 + 1);
+        }
+        if (defined[p->id] != v && live_in[p->id] != v) {
+          live_in[p->id] = v;
+          extend_interval(start, end, v, first[p->id] * 2 - 1);
+          worklist[len++] = p;
+        }
+      }
+    }
+  }
+
+  for (int i = 0; i < nblocks; i++)
+    free(preds[i]);
+  free(preds);
+  free(npreds);
+  free(first);
+  free(last);
+  free(ref_block);
+  free(ref_next);
+  free(def_head);
+  free(use_head);
+  free(def_mark);
+  free(use_mark);
+  free(defined);
+  free(live_in);
+  free(live_out);
+  free(worklist);
+}
+
+static _Thread_local int *interval_start;
+
+static int cmp_interval(const void *x, const void *y) {
+  return interval_start[*(int *)x] - interval_start[*(int *)y];
+}
+
+// Allocates registers and stack slots to values by linear scan.
+// Returns the number of callee-saved registers used and sets *nspills
+// to the number of stack slots.
+static int allocate_registers(int *reg, int *nspills) {
+  int nvalues = cur_ir->nvalues;
+  int *start = calloc(nvalues + 1, sizeof(int));
+  int *end = calloc(nvalues + 1, sizeof(int));
+  for (int v = 1; v <= nvalues; v++) {
+    start[v] = INT32_MAX;
+    end[v] = -1;
+  }
+  live_intervals(start, end);
+
+  int *vals = calloc(nvalues, sizeof(int));
+  int nvals = 0;
+  for (int v = 1; v <= nvalues; v++)
+    if (end[v] >= 0)
+      vals[nvals++] = v;
+
+  interval_start = start;
+  qsort(vals, nvals, sizeof(int), cmp_interval);
+
+  int nregs = sizeof(tmpreg64) / sizeof(*tmpreg64);
+  int active[nregs];
+  for (int i = 0; i < nregs; i++)
+    active[i] = 0;
+
+  int nused = 0;
+  *nspills = 0;
+
+  for (int i = 0; i < nvals; i++) {
+    int v = vals[i];
+    int r = -1;
+
+    for (int j = 0; j < nregs; j++) {
+      if (active[j] && end[active[j]] < start[v])
+        active[j] = 0;
+      if (!active[j] && r == -1)
+        r = j;
+    }
+
+    if (r == -1) {
+      // Spill the value that lives the longest.
+      int victim = 0;
+      for (int j = 1; j < nregs; j++)
+        if (end[active[j]] > end[active[victim]])
+          victim = j;
+
+      if (end[active[victim]] > end[v]) {
+        reg[active[victim]] = -1 - (*nspills)++;
+        active[victim] = 0;
+        r = victim;
+      } else {
+        reg[v] = -1 - (*nspills)++;
+        continue;
+      }
+    }
+
+    reg[v] = r;
+    active[r] = v;
+    nused = MAX(nused, r + 1);
+  }
+
+  free(start);
+  free(end);
+  free(vals);
+  return nused;
+}
+
+static void emit_ir_function(IrFunc *f) {
+  Obj *fn = f->fn;
+  int nvalues = f->nvalues;
+  cur_ir = f;
+
+  ir_def = calloc(nvalues + 1, sizeof(IrInst *));
+  ir_nuses = calloc(nvalues + 1, sizeof(int));
+  ir_label = calloc(f->nblocks, sizeof(int));
+
+  for (IrBlock *bb = f->blocks; bb; bb = bb->next) {
+    ir_label[bb->id] = count();
+    for (IrInst *inst = bb->insts; inst; inst = inst->next) {
+      if (inst->dst && inst->op != IR_COPY)
+        ir_def[inst->dst] = inst;
+      for (int i = 0; i < num_operands(inst); i++)
+        ir_nuses[*operand(inst, i)]++;
+    }
+  }
+
+  int *reg = calloc(nvalues + 1, sizeof(int));
+  int nspills;
+  int nsaved = allocate_registers(reg, &nspills);
+
+  ir_loc = calloc(nvalues + 1, sizeof(char *));
+  ir_opnd = calloc(nvalues + 1, sizeof(char *));
+  for (int v = 1; v <= nvalues; v++) {
+    IrInst *def = ir_def[v];
+    if (def && def->op == IR_IMM) {
+      if (def->val == (int32_t)def->val)
+        ir_opnd[v] = arena_format(&ir_arena, "$%ld", def->val);
+    } else if (!is_remat(v)) {
+      if (reg[v] >= 0)
+        ir_loc[v] = tmpreg64[reg[v]];
+      else
+        ir_loc[v] = arena_format(&ir_arena, "%d(%%rbp)",
+                                 -fn->stack_size - nsaved * 8 + reg[v] * 8);
+      ir_opnd[v] = ir_loc[v];
+    }
+  }
+
+  int frame_size = align_to(fn->stack_size + (nsaved + nspills) * 8, 16);
+
+  // Prologue
+  println("  push %%rbp");
+  println("  mov %%rsp, %%rbp");
+  println("  sub $%d, %%rsp", frame_size);
+  for (int i = 0; i < nsaved; i++)
+    println("  mov %s, %d(%%rbp)", tmpreg64[i], -fn->stack_size - i * 8 - 8);
+
+  for (IrBlock *bb = f->blocks; bb; bb = bb->next) {
+    println(".L.bb.%s.%d:", current_fn->name, ir_label[bb->id]);
+    for (IrInst *inst = bb->insts; inst; inst = inst->next)
+      gen_ir_inst(inst, bb->next);
+  }
+
+  // Epilogue
+  println(".L.return.%s:", fn->name);
+  for (int i = 0; i < nsaved; i++)
+    println("  mov %d(%%rbp), %s", -fn->stack_size - i * 8 - 8, tmpreg64[i]);
+  println("  mov %%rbp, %%rsp");
+  println("  pop %%rbp");
+  println("  ret");
+
+  free(ir_def);
+  free(ir_nuses);
+  free(ir_label);
+  free(reg);
+  free(ir_loc);
+  free(ir_opnd);
 }
 
-void codegen(Obj *prog, FILE *out) {
+static void emit_function(Obj *fn) {
+  // Use as many callee-saved registers for intermediate values as
+  // the deepest expression needs. They are saved below the locals.
+  ntmpreg = MIN(label(fn->body), sizeof(tmpreg64) / sizeof(*tmpreg64));
+  int frame_size = align_to(fn->stack_size + ntmpreg * 8, 16);
+
+  // Prologue
+  println("  push %%rbp");
+  println("  mov %%rsp, %%rbp");
+  println("  sub $%d, %%rsp", frame_size);
+  for (int i = 0; i < ntmpreg; i++)
+    println("  mov %s, %d(%%rbp)", tmpreg64[i], -fn->stack_size - i * 8 - 8);
+
+  // Save passed-by-register arguments to the stack
+  int i = 0;
+  for (Obj *var = fn->params; var; var = var->next) {
+    store_gp(i++, var->offset, var->ty->size);
+  }
+
+  // Emit code
+  gen_stmt(fn->body);
+  assert(depth == 0);
+
+  // Epilogue
+  println(".L.return.%s:", fn->name);
+  for (int i = 0; i < ntmpreg; i++)
+    println("  mov %d(%%rbp), %s", -fn->stack_size - i * 8 - 8, tmpreg64[i]);
+  println("  mov %%rbp, %%rsp");
+  println("  pop %%rbp");
+  println("  ret");
+}
+
+// Emits the code of a given function definition. Labels are local
+// to the function, so functions can be generated in any order.
+static void emit_text(Obj *fn, int opt_level) {
+  println("  .globl %s", fn->name);
+  println("  .text");
+  println("%s:", fn->name);
+  current_fn = fn;
+  last_loc = 0;
+  label_id = 0;
+
+  if (opt_level == 0) {
+    assign_lvar_offsets(fn);
+    emit_function(fn);
+  } else {
+    Phase prev = stats_phase(PHASE_IR);
+    IrFunc *f = lower_to_ir(fn);
+    optimize_ir(f);
+    leave_ssa(f);
+    stats_phase(prev);
+    assign_lvar_offsets(fn);
+    emit_ir_function(f);
+  }
+  arena_reset(&ir_arena);
+}
+
+// Function definitions to be generated by a pool of threads. Each
+// function is written to its own buffer, and the buffers are written
+// out in source order once all threads are done.
+typedef struct {
+  Obj **fns;
+  char **bufs;
+  size_t *lens;
+  int nfns;
+  int opt_level;
+  int next;
+  pthread_mutex_t lock;
+} TextJobs;
+
+static void *text_worker(void *arg) {
+  TextJobs *jobs = arg;
+  stats_phase(PHASE_CODEGEN);
+
+  for (;;) {
+    pthread_mutex_lock(&jobs->lock);
+    int i = jobs->next++;
+    pthread_mutex_unlock(&jobs->lock);
+
+    if (i >= jobs->nfns) {
+      arena_free(&ir_arena);
+      stats_phase(PHASE_NONE);
+      stats_merge();
+      return NULL;
+    }
+
+    output_file = open_memstream(&jobs->bufs[i], &jobs->lens[i]);
+    emit_text(jobs->fns[i], jobs->opt_level);
+    flush_output();
+    fclose(output_file);
+  }
+}
+
+static void emit_text_parallel(Obj **fns, int nfns, int opt_level, int njobs) {
+  TextJobs jobs = {
+    .fns = fns,
+    .bufs = calloc(nfns, sizeof(char *)),
+    .lens = calloc(nfns, sizeof(size_t)),
+    .nfns = nfns,
+    .opt_level = opt_level,
+  };
+  pthread_mutex_init(&jobs.lock, NULL);
+
+  // The time this thread spends waiting is not accounted to any
+  // phase, as the workers account theirs.
+  Phase prev = stats_phase(PHASE_NONE);
+  int nthreads = MIN(njobs, nfns);
+  pthread_t *threads = calloc(nthreads, sizeof(pthread_t));
+  for (int i = 0; i < nthreads; i++)
+    if (pthread_create(&threads[i], NULL, text_worker, &jobs))
+      error("cannot create a thread");
+  for (int i = 0; i < nthreads; i++)
+    pthread_join(threads[i], NULL);
+  stats_phase(prev);
+
+  for (int i = 0; i < nfns; i++) {
+    out_bytes(jobs.bufs[i], jobs.lens[i]);
+    free(jobs.bufs[i]);
+  }
+
+  pthread_mutex_destroy(&jobs.lock);
+  free(threads);
+  free(jobs.bufs);
+  free(jobs.lens);
+}
+
+// Generates assembly for a given program. With `njobs` > 1, the
+// functions are compiled in parallel, and the output is the same as
+// with a single job.
+void codegen(Obj *prog, FILE *out, int opt_level, int njobs) {
+  output_file = out;
+  emit_data(prog);
+
+  int nfns = 0;
+  for (Obj *fn = prog; fn; fn = fn->next)
+    if (fn->is_function && fn->is_definition)
+      nfns++;
+
+  Obj **fns = calloc(nfns, sizeof(Obj *));
+  int i = 0;
+  for (Obj *fn = prog; fn; fn = fn->next)
+    if (fn->is_function && fn->is_definition)
+      fns[i++] = fn;
+
+  if (njobs > 1 && nfns > 1)
+    emit_text_parallel(fns, nfns, opt_level, njobs);
+  else
+    for (int i = 0; i < nfns; i++)
+      emit_text(fns[i], opt_level);
+
+  flush_output();
+  free(fns);
+}
+
+// For streaming mode: emits a single function as soon as it is
+// parsed, and the data of the whole program once it is done.
+void codegen_function(Obj *fn, FILE *out, int opt_level) {
   output_file = out;
+  emit_text(fn, opt_level);
+  flush_output();
+}
 
-  assign_lvar_offsets(prog);
+void codegen_data(Obj *prog, FILE *out) {
+  output_file = out;
   emit_data(prog);
-  emit_text(prog);
+  flush_output();
 }
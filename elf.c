@@ -0,0 +1,1200 @@
+// This file contains an assembler for the assembly that codegen.c
+// emits, and writes its result as an ELF relocatable object, so that
+// `-c` doesn't need an external assembler.
+//
+// It only knows the instructions and directives that codegen.c
+// actually uses. Branches are always encoded with 32-bit
+// displacements, so the code is a bit larger than what a general
+// purpose assembler would produce. References to local labels
+// (".L...") in the same section are resolved here. Other references
+// become relocations. Line numbers given by `.loc` are written as
+// DWARF line information.
+
+#include "chibicc.h"
+
+typedef struct {
+  char *data;
+  int64_t len;
+  int64_t cap;
+} Buf;
+
+typedef enum {
+  SEC_TEXT,
+  SEC_DATA,
+  SEC_BSS,
+  SEC_RODATA,
+  SEC_DEBUG_INFO,
+  SEC_DEBUG_ABBREV,
+  SEC_DEBUG_LINE,
+  NUM_SECTIONS,
+} SectionId;
+
+typedef struct Symbol Symbol;
+struct Symbol {
+  char *name;
+  int sec;         // Section of a defined symbol, or -1
+  int64_t offset;  // Offset in the section
+  bool is_global;
+  int elf_index;   // Index in .symtab
+  Symbol *next;
+};
+
+typedef struct {
+  int64_t offset;
+  Symbol *sym;     // Referenced symbol, or NULL for section `sec`
+  int sec;
+  int type;
+  int64_t addend;
+} Reloc;
+
+typedef struct {
+  char *name;
+  int type;
+  int flags;
+  int align;
+  Buf data;
+  int64_t bss_size;
+  Reloc *relocs;
+  int nrelocs;
+  int reloc_cap;
+  int elf_index;
+} Section;
+
+typedef struct {
+  int64_t addr;
+  int line;
+} LineEntry;
+
+static _Thread_local Section sections[NUM_SECTIONS];
+static _Thread_local Section *cur_sec;
+static _Thread_local HashMap symbols;
+static _Thread_local Symbol *symbol_list;
+static _Thread_local char *source_name;
+static _Thread_local LineEntry *lines;
+static _Thread_local int nlines;
+static _Thread_local int line_cap;
+
+// Input line being assembled, for error messages
+static _Thread_local char *cur_line;
+
+static void asm_error(char *msg) {
+  error("internal assembler: %s: %s", msg, cur_line);
+}
+
+//
+// Byte buffers
+//
+
+static void buf_reserve(Buf *buf, int64_t n) {
+  if (buf->len + n <= buf->cap)
+    return;
+  while (buf->len + n > buf->cap)
+    buf->cap = buf->cap ? buf->cap * 2 : 256;
+  buf->data = realloc(buf->data, buf->cap);
+}
+
+static void buf_add(Buf *buf, void *p, int64_t n) {
+  buf_reserve(buf, n);
+  memcpy(buf->data + buf->len, p, n);
+  buf->len += n;
+}
+
+static void buf_add_int(Buf *buf, uint64_t val, int size) {
+  buf_reserve(buf, size);
+  for (int i = 0; i < size; i++)
+    buf->data[buf->len++] = val >> (i * 8);
+}
+
+static void buf_add_uleb(Buf *buf, uint64_t val) {
+  do {
+    uint8_t b = val & 0x7f;
+    val >>= 7;
+    buf_add_int(buf, val ? (b | 0x80) : b, 1);
+  } while (val);
+}
+
+static void buf_add_sleb(Buf *buf, int64_t val) {
+  for (;;) {
+    uint8_t b = val & 0x7f;
+    val >>= 7;
+    if ((val == 0 && !(b & 0x40)) || (val == -1 && (b & 0x40))) {
+      buf_add_int(buf, b, 1);
+      return;
+    }
+    buf_add_int(buf, b | 0x80, 1);
+  }
+}
+
+static void buf_add_str(Buf *buf, char *s) {
+  buf_add(buf, s, strlen(s) + 1);
+}
+
+static void buf_align(Buf *buf, int align) {
+  while (buf->len % align)
+    buf_add_int(buf, 0, 1);
+}
+
+//
+// Sections and symbols
+//
+
+static void init_sections(void) {
+  static const struct {
+    char *name;
+    int type;
+    int flags;
+    int align;
+  } defs[] = {
+    [SEC_TEXT] = {".text", SHT_PROGBITS, SHF_ALLOC | SHF_EXECINSTR, 1},
+    [SEC_DATA] = {".data", SHT_PROGBITS, SHF_ALLOC | SHF_WRITE, 1},
+    [SEC_BSS] = {".bss", SHT_NOBITS, SHF_ALLOC | SHF_WRITE, 1},
+    [SEC_RODATA] = {".rodata", SHT_PROGBITS, SHF_ALLOC, 1},
+    [SEC_DEBUG_INFO] = {".debug_info", SHT_PROGBITS, 0, 1},
+    [SEC_DEBUG_ABBREV] = {".debug_abbrev", SHT_PROGBITS, 0, 1},
+    [SEC_DEBUG_LINE] = {".debug_line", SHT_PROGBITS, 0, 1},
+  };
+
+  for (int i = 0; i < NUM_SECTIONS; i++) {
+    free(sections[i].data.data);
+    free(sections[i].relocs);
+    sections[i] = (Section){defs[i].name, defs[i].type, defs[i].flags, defs[i].align};
+  }
+  cur_sec = &sections[SEC_TEXT];
+}
+
+static int64_t sec_offset(Section *sec) {
+  return (sec->type == SHT_NOBITS) ? sec->bss_size : sec->data.len;
+}
+
+static Symbol *get_symbol(char *name, int len) {
+  Symbol *sym = hashmap_get2(&symbols, name, len);
+  if (sym)
+    return sym;
+
+  sym = calloc(1, sizeof(Symbol));
+  sym->name = strndup(name, len);
+  sym->sec = -1;
+  sym->next = symbol_list;
+  symbol_list = sym;
+  hashmap_put2(&symbols, sym->name, len, sym);
+  return sym;
+}
+
+static bool is_local_label(Symbol *sym) {
+  return !strncmp(sym->name, ".L", 2);
+}
+
+static void add_reloc(Section *sec, int64_t offset, Symbol *sym, int type, int64_t addend) {
+  if (sec->nrelocs == sec->reloc_cap) {
+    sec->reloc_cap = sec->reloc_cap ? sec->reloc_cap * 2 : 64;
+    sec->relocs = realloc(sec->relocs, sizeof(Reloc) * sec->reloc_cap);
+  }
+  sec->relocs[sec->nrelocs++] = (Reloc){offset, sym, -1, type, addend};
+}
+
+// Adds a relocation against the beginning of a given section.
+static void add_sec_reloc(Section *sec, int64_t offset, int target, int type, int64_t addend) {
+  add_reloc(sec, offset, NULL, type, addend);
+  sec->relocs[sec->nrelocs - 1].sec = target;
+}
+
+//
+// Operands
+//
+
+typedef enum {
+  OP_REG,
+  OP_XMM,
+  OP_IMM,
+  OP_MEM,
+  OP_SYM,
+} OperandKind;
+
+#define REG_NONE -1
+#define REG_RIP 16
+
+typedef struct {
+  OperandKind kind;
+  int reg;     // Register number of OP_REG and OP_XMM
+  int size;    // Size of OP_REG in bytes
+  int64_t val; // Immediate of OP_IMM, or displacement of OP_MEM
+  Symbol *sym; // Symbol of OP_MEM or OP_SYM, or NULL
+  int base;    // Base register of OP_MEM
+  int index;   // Index register of OP_MEM
+  int scale;
+} Operand;
+
+static char *reg_names[4][16] = {
+  {"al", "cl", "dl", "bl", "spl", "bpl", "sil", "dil",
+   "r8b", "r9b", "r10b", "r11b", "r12b", "r13b", "r14b", "r15b"},
+  {"ax", "cx", "dx", "bx", "sp", "bp", "si", "di",
+   "r8w", "r9w", "r10w", "r11w", "r12w", "r13w", "r14w", "r15w"},
+  {"eax", "ecx", "edx", "ebx", "esp", "ebp", "esi", "edi",
+   "r8d", "r9d", "r10d", "r11d", "r12d", "r13d", "r14d", "r15d"},
+  {"rax", "rcx", "rdx", "rbx", "rsp", "rbp", "rsi", "rdi",
+   "r8", "r9", "r10", "r11", "r12", "r13", "r14", "r15"},
+};
+
+// Reads a register name after '%'. Returns its size in bytes, or 0
+// for an XMM register.
+static int read_reg(char **p, int *reg) {
+  char *s = *p;
+  int len = 0;
+  while (isalnum(s[len]))
+    len++;
+  *p = s + len;
+
+  if (len >= 4 && !strncmp(s, "xmm", 3)) {
+    *reg = atoi(s + 3);
+    return 0;
+  }
+  if (len == 3 && !strncmp(s, "rip", 3)) {
+    *reg = REG_RIP;
+    return 8;
+  }
+
+  for (int i = 0; i < 4; i++) {
+    for (int j = 0; j < 16; j++) {
+      if (strlen(reg_names[i][j]) == len && !strncmp(reg_names[i][j], s, len)) {
+        *reg = j;
+        return 1 << i;
+      }
+    }
+  }
+  asm_error("unknown register");
+}
+
+static bool is_symbol_char(char c) {
+  return isalnum(c) || c == '_' || c == '.' || c == '$';
+}
+
+static Operand parse_operand(char *s) {
+  Operand op = {.base = REG_NONE, .index = REG_NONE};
+
+  if (*s == '%') {
+    s++;
+    int size = read_reg(&s, &op.reg);
+    op.kind = size ? OP_REG : OP_XMM;
+    op.size = size;
+    return op;
+  }
+
+  if (*s == '$') {
+    op.kind = OP_IMM;
+    op.val = strtoll(s + 1, NULL, 10);
+    return op;
+  }
+
+  // A memory operand is "sym+disp(base,index,scale)", where each part
+  // is optional. An operand without parentheses is a branch target.
+  if (!isdigit(*s) && *s != '-' && *s != '(') {
+    char *start = s;
+    while (is_symbol_char(*s))
+      s++;
+    op.sym = get_symbol(start, s - start);
+    if (*s == '+')
+      s++;
+  }
+
+  if (isdigit(*s) || *s == '-')
+    op.val = strtoll(s, &s, 10);
+
+  if (*s != '(') {
+    op.kind = OP_SYM;
+    return op;
+  }
+
+  op.kind = OP_MEM;
+  s++;
+  if (*s == '%') {
+    s++;
+    read_reg(&s, &op.base);
+  }
+  if (*s == ',') {
+    s += 2;
+    read_reg(&s, &op.index);
+    op.scale = 1;
+    if (*s == ',')
+      op.scale = strtol(s + 1, &s, 10);
+  }
+  if (*s != ')')
+    asm_error("invalid operand");
+  return op;
+}
+
+// Splits operands at commas that are not in parentheses.
+static int parse_operands(char *s, Operand *ops) {
+  int n = 0;
+  while (*s) {
+    while (*s == ' ')
+      s++;
+    char *start = s;
+    int depth = 0;
+    while (*s && (depth || *s != ',')) {
+      if (*s == '(')
+        depth++;
+      else if (*s == ')')
+        depth--;
+      s++;
+    }
+    if (n == 3)
+      asm_error("too many operands");
+    ops[n++] = parse_operand(strndup(start, s - start));
+    if (*s == ',')
+      s++;
+  }
+  return n;
+}
+
+//
+// Instruction encoding
+//
+
+static void emit8(int val) {
+  buf_add_int(&cur_sec->data, val, 1);
+}
+
+static void emit32(int64_t val) {
+  buf_add_int(&cur_sec->data, val, 4);
+}
+
+static bool is_imm8(int64_t val) {
+  return val == (int8_t)val;
+}
+
+static bool is_imm32(int64_t val) {
+  return val == (int32_t)val;
+}
+
+// Rejects an immediate that doesn't fit in an operand of `size`
+// bytes, as gas does, instead of truncating it. A 64-bit operand takes
+// a sign-extended 32-bit immediate except in `mov $imm, %reg`.
+static void check_imm(int64_t val, int size) {
+  if (size == 8 ? !is_imm32(val)
+                : (val < -((int64_t)1 << (size * 8 - 1)) || val >= (int64_t)1 << (size * 8)))
+    asm_error("immediate out of range");
+}
+
+// SPL, BPL, SIL and DIL can only be encoded with a REX prefix.
+static bool needs_rex(Operand *op) {
+  return op->kind == OP_REG && op->size == 1 && op->reg >= 4 && op->reg < 8;
+}
+
+// Emits an instruction whose ModRM byte encodes `rm`, which is a
+// register or a memory operand, and `reg`, which is a register number
+// or an opcode extension. `immsize` is the size of the immediate that
+// follows, which a RIP-relative displacement has to take into account.
+static void emit_modrm(int prefix, bool rex_w, bool rex, int opcode, int reg,
+                       Operand *rm, int immsize) {
+  if (prefix)
+    emit8(prefix);
+
+  int base = (rm->kind == OP_MEM) ? rm->base : rm->reg;
+  int index = (rm->kind == OP_MEM) ? rm->index : REG_NONE;
+  int rex_bits = (rex_w << 3) | ((reg & 8) >> 1);
+  if (index != REG_NONE)
+    rex_bits |= (index & 8) >> 2;
+  if (base != REG_NONE && base != REG_RIP)
+    rex_bits |= (base & 8) >> 3;
+  if (rex_bits || rex || needs_rex(rm))
+    emit8(0x40 | rex_bits);
+
+  // Opcodes are given with their escape bytes, e.g. 0x0fb6.
+  if (opcode > 0xffff)
+    emit8(opcode >> 16);
+  if (opcode > 0xff)
+    emit8(opcode >> 8);
+  emit8(opcode);
+
+  reg &= 7;
+
+  if (rm->kind != OP_MEM) {
+    emit8(0xc0 | (reg << 3) | (rm->reg & 7));
+    return;
+  }
+
+  if (base == REG_RIP) {
+    emit8((reg << 3) | 5);
+    if (rm->sym)
+      add_reloc(cur_sec, cur_sec->data.len, rm->sym, R_X86_64_PC32, rm->val - 4 - immsize);
+    emit32(rm->sym ? 0 : rm->val);
+    return;
+  }
+
+  int64_t disp = rm->val;
+  int mod;
+  if (disp == 0 && (base & 7) != 5)
+    mod = 0;
+  else if (is_imm8(disp))
+    mod = 1;
+  else
+    mod = 2;
+
+  if (index != REG_NONE || (base & 7) == 4) {
+    int ss = (rm->scale == 8) ? 3 : (rm->scale == 4) ? 2 : (rm->scale == 2) ? 1 : 0;
+    emit8((mod << 6) | (reg << 3) | 4);
+    emit8((ss << 6) | (((index == REG_NONE) ? 4 : index) & 7) << 3 | (base & 7));
+  } else {
+    emit8((mod << 6) | (reg << 3) | (base & 7));
+  }
+
+  if (mod == 1)
+    emit8(disp);
+  else if (mod == 2)
+    emit32(disp);
+}
+
+static void emit_imm(int64_t val, int size) {
+  buf_add_int(&cur_sec->data, val, size);
+}
+
+// Emits a branch to a given symbol with a 32-bit displacement.
+static void emit_branch(char *opcode, int oplen, Operand *target, int type) {
+  if (target->kind != OP_SYM)
+    asm_error("invalid branch target");
+  buf_add(&cur_sec->data, opcode, oplen);
+  add_reloc(cur_sec, cur_sec->data.len, target->sym, type, -4);
+  emit32(0);
+}
+
+static int cond_code(char *cc) {
+  static char *names[] = {
+    "o", "no", "b", "ae", "e", "ne", "be", "a",
+    "s", "ns", "p", "np", "l", "ge", "le", "g",
+  };
+  for (int i = 0; i < 16; i++)
+    if (!strcmp(cc, names[i]))
+      return i;
+  if (!strcmp(cc, "z"))
+    return 4;
+  if (!strcmp(cc, "nz"))
+    return 5;
+  return -1;
+}
+
+// Returns the operand size of an instruction from its register
+// operands, or from its suffix if it has none.
+static int operand_size(char *mnemonic, char *base, Operand *ops, int nops) {
+  for (int i = nops - 1; i >= 0; i--)
+    if (ops[i].kind == OP_REG)
+      return ops[i].size;
+
+  char *suffix = mnemonic + strlen(base);
+  if (!strcmp(suffix, "b"))
+    return 1;
+  if (!strcmp(suffix, "w"))
+    return 2;
+  if (!strcmp(suffix, "l"))
+    return 4;
+  return 8;
+}
+
+static bool has_base(char *mnemonic, char *base) {
+  int len = strlen(base);
+  return !strncmp(mnemonic, base, len) &&
+         (!mnemonic[len] || (!mnemonic[len + 1] && strchr("bwlq", mnemonic[len])));
+}
+
+// Emits `op` with an operand of a given size. 8-bit operations use
+// `opcode - 1`, such as 0x88 for 0x89 (mov).
+static void emit_sized(int size, int opcode, int reg, Operand *rm, int immsize, bool rex) {
+  if (size == 1)
+    emit_modrm(0, false, rex, opcode - 1, reg, rm, immsize);
+  else
+    emit_modrm(size == 2 ? 0x66 : 0, size == 8, false, opcode, reg, rm, immsize);
+}
+
+static void assemble_mov(char *mnemonic, Operand *src, Operand *dst) {
+  int size = operand_size(mnemonic, "mov", (Operand[]){*src, *dst}, 2);
+
+  if (src->kind == OP_IMM && dst->kind == OP_REG) {
+    // mov $imm, %reg
+    if (size == 8 && is_imm32(src->val)) {
+      emit_modrm(0, true, false, 0xc7, 0, dst, 4);
+      emit_imm(src->val, 4);
+      return;
+    }
+    if (size < 8)
+      check_imm(src->val, size);
+    if (size == 2)
+      emit8(0x66);
+    if (size == 8 || dst->reg >= 8 || needs_rex(dst))
+      emit8(0x40 | ((size == 8) << 3) | (dst->reg >> 3));
+    emit8(((size == 1) ? 0xb0 : 0xb8) + (dst->reg & 7));
+    emit_imm(src->val, size);
+    return;
+  }
+
+  if (src->kind == OP_IMM) {
+    // mov $imm, mem
+    check_imm(src->val, size);
+    emit_sized(size, 0xc7, 0, dst, MIN(size, 4), false);
+    emit_imm(src->val, MIN(size, 4));
+    return;
+  }
+
+  if (src->kind == OP_REG)
+    emit_sized(size, 0x89, src->reg, dst, 0, needs_rex(src));
+  else
+    emit_sized(size, 0x8b, dst->reg, src, 0, needs_rex(dst));
+}
+
+// add, sub and cmp
+static void assemble_arith(char *mnemonic, char *base, int ext, int opcode,
+                           Operand *src, Operand *dst) {
+  int size = operand_size(mnemonic, base, (Operand[]){*src, *dst}, 2);
+
+  if (src->kind == OP_IMM) {
+    check_imm(src->val, size);
+    if (is_imm8(src->val)) {
+      emit_sized(size, 0x83, ext, dst, 1, false);
+      emit_imm(src->val, 1);
+    } else {
+      emit_sized(size, 0x81, ext, dst, 4, false);
+      emit_imm(src->val, 4);
+    }
+    return;
+  }
+
+  if (src->kind == OP_REG)
+    emit_sized(size, opcode, src->reg, dst, 0, needs_rex(src));
+  else
+    emit_sized(size, opcode + 2, dst->reg, src, 0, needs_rex(dst));
+}
+
+static void assemble_insn(char *mnemonic, char *args) {
+  Operand ops[3];
+  int nops = parse_operands(args, ops);
+  int cc;
+
+  if (!strcmp(mnemonic, "ret")) {
+    emit8(0xc3);
+    return;
+  }
+  if (!strcmp(mnemonic, "cqo")) {
+    emit8(0x48);
+    emit8(0x99);
+    return;
+  }
+  if (!strcmp(mnemonic, "rep")) {
+    if (strcmp(args, "movsb"))
+      asm_error("unknown instruction");
+    emit8(0xf3);
+    emit8(0xa4);
+    return;
+  }
+
+  if (!strcmp(mnemonic, "push") || !strcmp(mnemonic, "pop")) {
+    if (nops != 1 || ops[0].kind != OP_REG)
+      asm_error("invalid operand");
+    if (ops[0].reg >= 8)
+      emit8(0x41);
+    emit8((mnemonic[1] == 'u' ? 0x50 : 0x58) + (ops[0].reg & 7));
+    return;
+  }
+
+  if (!strcmp(mnemonic, "call")) {
+    emit_branch("\xe8", 1, &ops[0], R_X86_64_PLT32);
+    return;
+  }
+  if (!strcmp(mnemonic, "jmp")) {
+    emit_branch("\xe9", 1, &ops[0], R_X86_64_PLT32);
+    return;
+  }
+  if (mnemonic[0] == 'j' && (cc = cond_code(mnemonic + 1)) != -1) {
+    emit_branch((char[]){0x0f, 0x80 + cc}, 2, &ops[0], R_X86_64_PC32);
+    return;
+  }
+  if (!strncmp(mnemonic, "set", 3) && (cc = cond_code(mnemonic + 3)) != -1) {
+    emit_modrm(0, false, false, 0x0f90 + cc, 0, &ops[0], 0);
+    return;
+  }
+
+  if (has_base(mnemonic, "mov") && nops == 2) {
+    assemble_mov(mnemonic, &ops[0], &ops[1]);
+    return;
+  }
+  if (has_base(mnemonic, "add") && nops == 2) {
+    assemble_arith(mnemonic, "add", 0, 0x01, &ops[0], &ops[1]);
+    return;
+  }
+  if (has_base(mnemonic, "sub") && nops == 2) {
+    assemble_arith(mnemonic, "sub", 5, 0x29, &ops[0], &ops[1]);
+    return;
+  }
+  if (has_base(mnemonic, "cmp") && nops == 2) {
+    assemble_arith(mnemonic, "cmp", 7, 0x39, &ops[0], &ops[1]);
+    return;
+  }
+
+  if (!strcmp(mnemonic, "lea")) {
+    emit_modrm(0, true, false, 0x8d, ops[1].reg, &ops[0], 0);
+    return;
+  }
+
+  // Sign and zero extensions to 64 bits
+  if (!strcmp(mnemonic, "movsbq")) {
+    emit_modrm(0, true, false, 0x0fbe, ops[1].reg, &ops[0], 0);
+    return;
+  }
+  if (!strcmp(mnemonic, "movswq")) {
+    emit_modrm(0, true, false, 0x0fbf, ops[1].reg, &ops[0], 0);
+    return;
+  }
+  if (!strcmp(mnemonic, "movslq") || !strcmp(mnemonic, "movsxd")) {
+    emit_modrm(0, true, false, 0x63, ops[1].reg, &ops[0], 0);
+    return;
+  }
+  if (!strcmp(mnemonic, "movzb") || !strcmp(mnemonic, "movzbq")) {
+    emit_modrm(0, true, false, 0x0fb6, ops[1].reg, &ops[0], 0);
+    return;
+  }
+
+  if (!strcmp(mnemonic, "movdqu")) {
+    if (ops[1].kind == OP_XMM)
+      emit_modrm(0xf3, false, false, 0x0f6f, ops[1].reg, &ops[0], 0);
+    else
+      emit_modrm(0xf3, false, false, 0x0f7f, ops[0].reg, &ops[1], 0);
+    return;
+  }
+
+  if (!strcmp(mnemonic, "imul")) {
+    if (nops == 1) {
+      emit_sized(ops[0].size, 0xf7, 5, &ops[0], 0, false);
+      return;
+    }
+    if (nops == 2) {
+      emit_modrm(0, ops[1].size == 8, false, 0x0faf, ops[1].reg, &ops[0], 0);
+      return;
+    }
+
+    check_imm(ops[0].val, ops[2].size);
+    if (is_imm8(ops[0].val)) {
+      emit_modrm(0, ops[2].size == 8, false, 0x6b, ops[2].reg, &ops[1], 1);
+      emit_imm(ops[0].val, 1);
+    } else {
+      emit_modrm(0, ops[2].size == 8, false, 0x69, ops[2].reg, &ops[1], 4);
+      emit_imm(ops[0].val, 4);
+    }
+    return;
+  }
+
+  if (has_base(mnemonic, "idiv") || has_base(mnemonic, "neg")) {
+    int size = operand_size(mnemonic, mnemonic[0] == 'i' ? "idiv" : "neg", ops, nops);
+    emit_sized(size, 0xf7, mnemonic[0] == 'i' ? 7 : 3, &ops[0], 0, false);
+    return;
+  }
+
+  if (has_base(mnemonic, "shl") || has_base(mnemonic, "shr") || has_base(mnemonic, "sar")) {
+    int ext = (mnemonic[2] == 'l') ? 4 : (mnemonic[2] == 'r' && mnemonic[1] == 'h') ? 5 : 7;
+    char base[4] = {mnemonic[0], mnemonic[1], mnemonic[2], 0};
+    int size = operand_size(mnemonic, base, ops, nops);
+    emit_sized(size, 0xc1, ext, &ops[1], 1, false);
+    emit_imm(ops[0].val, 1);
+    return;
+  }
+
+  asm_error("unknown instruction");
+}
+
+//
+// Directives
+//
+
+// Reads a string literal in the format that quote_bytes() in
+// codegen.c writes.
+static void read_string(char *p, Buf *buf) {
+  if (*p++ != '"')
+    asm_error("expected a string");
+
+  while (*p != '"') {
+    if (*p != '\\') {
+      buf_add_int(buf, *p++, 1);
+      continue;
+    }
+
+    p++;
+    if ('0' <= *p && *p <= '7') {
+      int c = 0;
+      for (int i = 0; i < 3 && '0' <= *p && *p <= '7'; i++)
+        c = c * 8 + (*p++ - '0');
+      buf_add_int(buf, c, 1);
+      continue;
+    }
+
+    switch (*p) {
+    case 'n': buf_add_int(buf, '\n', 1); break;
+    case 't': buf_add_int(buf, '\t', 1); break;
+    default: buf_add_int(buf, *p, 1); break;
+    }
+    p++;
+  }
+}
+
+static void add_data(int64_t val, int size) {
+  if (cur_sec->type == SHT_NOBITS)
+    asm_error("initialized data in .bss");
+  buf_add_int(&cur_sec->data, val, size);
+}
+
+static void add_zeros(int64_t n) {
+  if (cur_sec->type == SHT_NOBITS) {
+    cur_sec->bss_size += n;
+    return;
+  }
+  buf_reserve(&cur_sec->data, n);
+  memset(cur_sec->data.data + cur_sec->data.len, 0, n);
+  cur_sec->data.len += n;
+}
+
+static void assemble_directive(char *name, char *args) {
+  if (!strcmp(name, ".text")) {
+    cur_sec = &sections[SEC_TEXT];
+  } else if (!strcmp(name, ".data")) {
+    cur_sec = &sections[SEC_DATA];
+  } else if (!strcmp(name, ".bss")) {
+    cur_sec = &sections[SEC_BSS];
+  } else if (!strcmp(name, ".section")) {
+    if (strcmp(args, ".rodata"))
+      asm_error("unknown section");
+    cur_sec = &sections[SEC_RODATA];
+  } else if (!strcmp(name, ".globl")) {
+    get_symbol(args, strlen(args))->is_global = true;
+  } else if (!strcmp(name, ".align")) {
+    int align = atoi(args);
+    cur_sec->align = MAX(cur_sec->align, align);
+    int64_t off = sec_offset(cur_sec);
+    add_zeros(align_to(off, align) - off);
+  } else if (!strcmp(name, ".zero")) {
+    add_zeros(atoll(args));
+  } else if (!strcmp(name, ".byte")) {
+    add_data(atoll(args), 1);
+  } else if (!strcmp(name, ".short")) {
+    add_data(atoll(args), 2);
+  } else if (!strcmp(name, ".long")) {
+    add_data(atoll(args), 4);
+  } else if (!strcmp(name, ".quad")) {
+    add_data(atoll(args), 8);
+  } else if (!strcmp(name, ".ascii") || !strcmp(name, ".string")) {
+    if (cur_sec->type == SHT_NOBITS)
+      asm_error("initialized data in .bss");
+    read_string(args, &cur_sec->data);
+    if (name[1] == 's')
+      buf_add_int(&cur_sec->data, 0, 1);
+  } else if (!strcmp(name, ".file")) {
+    // .file 1 "name"
+    char *p = strchr(args, '"');
+    if (p) {
+      Buf buf = {};
+      read_string(p, &buf);
+      buf_add_int(&buf, 0, 1);
+      source_name = buf.data;
+    }
+  } else if (!strcmp(name, ".loc")) {
+    // .loc 1 line
+    if (nlines == line_cap) {
+      line_cap = line_cap ? line_cap * 2 : 256;
+      lines = realloc(lines, sizeof(LineEntry) * line_cap);
+    }
+    lines[nlines++] = (LineEntry){sections[SEC_TEXT].data.len, atoi(strchr(args, ' ') + 1)};
+  } else {
+    asm_error("unknown directive");
+  }
+}
+
+static void assemble_line(char *line) {
+  cur_line = line;
+  while (*line == ' ' || *line == '\t')
+    line++;
+  if (!*line)
+    return;
+
+  int len = strlen(line);
+  if (line[len - 1] == ':' && !strchr(line, ' ')) {
+    Symbol *sym = get_symbol(line, len - 1);
+    if (sym->sec != -1)
+      asm_error("symbol already defined");
+    sym->sec = cur_sec - sections;
+    sym->offset = sec_offset(cur_sec);
+    return;
+  }
+
+  char *sp = strchr(line, ' ');
+  char *name = sp ? strndup(line, sp - line) : line;
+  char *args = sp ? sp + 1 : "";
+
+  if (line[0] == '.')
+    assemble_directive(name, args);
+  else
+    assemble_insn(name, args);
+
+  if (sp)
+    free(name);
+}
+
+// Resolves references to local labels in the same section, and turns
+// references to local labels in other sections into references to the
+// section.
+static void resolve_relocs(void) {
+  for (int i = 0; i < NUM_SECTIONS; i++) {
+    Section *sec = &sections[i];
+    int n = 0;
+
+    for (int j = 0; j < sec->nrelocs; j++) {
+      Reloc *rel = &sec->relocs[j];
+      Symbol *sym = rel->sym;
+
+      if (sym && is_local_label(sym)) {
+        if (sym->sec == -1)
+          error("internal assembler: undefined label: %s", sym->name);
+
+        if (sym->sec == i && rel->type != R_X86_64_64) {
+          int64_t val = sym->offset + rel->addend - rel->offset;
+          memcpy(sec->data.data + rel->offset, &(int32_t){val}, 4);
+          continue;
+        }
+
+        rel->sec = sym->sec;
+        rel->addend += sym->offset;
+        rel->sym = NULL;
+        if (rel->type == R_X86_64_PLT32)
+          rel->type = R_X86_64_PC32;
+      }
+      sec->relocs[n++] = *rel;
+    }
+    sec->nrelocs = n;
+  }
+}
+
+//
+// DWARF
+//
+
+// Writes a line number program for .loc directives, and a compile
+// unit that refers to it so that debuggers find it.
+static void emit_dwarf(void) {
+  char *name = source_name ? source_name : "-";
+
+  // .debug_abbrev
+  Buf *abbrev = &sections[SEC_DEBUG_ABBREV].data;
+  buf_add_uleb(abbrev, 1);
+  buf_add_uleb(abbrev, 0x11); // DW_TAG_compile_unit
+  buf_add_int(abbrev, 0, 1);  // DW_CHILDREN_no
+  static const int attrs[][2] = {
+    {0x03, 0x08}, // DW_AT_name, DW_FORM_string
+    {0x1b, 0x08}, // DW_AT_comp_dir, DW_FORM_string
+    {0x25, 0x08}, // DW_AT_producer, DW_FORM_string
+    {0x13, 0x0b}, // DW_AT_language, DW_FORM_data1
+    {0x10, 0x17}, // DW_AT_stmt_list, DW_FORM_sec_offset
+    {0x11, 0x01}, // DW_AT_low_pc, DW_FORM_addr
+    {0x12, 0x07}, // DW_AT_high_pc, DW_FORM_data8
+  };
+  for (int i = 0; i < sizeof(attrs) / sizeof(*attrs); i++) {
+    buf_add_uleb(abbrev, attrs[i][0]);
+    buf_add_uleb(abbrev, attrs[i][1]);
+  }
+  buf_add_int(abbrev, 0, 2);
+  buf_add_int(abbrev, 0, 1);
+
+  // .debug_info
+  Section *info_sec = &sections[SEC_DEBUG_INFO];
+  Buf *info = &info_sec->data;
+  char cwd[4096];
+  if (!getcwd(cwd, sizeof(cwd)))
+    cwd[0] = '\0';
+
+  buf_add_int(info, 0, 4); // unit_length, filled in below
+  buf_add_int(info, 4, 2); // version
+  add_sec_reloc(info_sec, info->len, SEC_DEBUG_ABBREV, R_X86_64_32, 0);
+  buf_add_int(info, 0, 4); // debug_abbrev_offset
+  buf_add_int(info, 8, 1); // address_size
+  buf_add_uleb(info, 1);
+  buf_add_str(info, name);
+  buf_add_str(info, cwd);
+  buf_add_str(info, "chibicc");
+  buf_add_int(info, 0x0c, 1); // DW_LANG_C99
+  add_sec_reloc(info_sec, info->len, SEC_DEBUG_LINE, R_X86_64_32, 0);
+  buf_add_int(info, 0, 4);
+  add_sec_reloc(info_sec, info->len, SEC_TEXT, R_X86_64_64, 0);
+  buf_add_int(info, 0, 8);
+  buf_add_int(info, sections[SEC_TEXT].data.len, 8);
+  memcpy(info->data, &(uint32_t){info->len - 4}, 4);
+
+  // .debug_line
+  Section *line_sec = &sections[SEC_DEBUG_LINE];
+  Buf *line = &line_sec->data;
+  const int line_base = -5, line_range = 14, opcode_base = 13;
+
+  buf_add_int(line, 0, 4); // unit_length
+  buf_add_int(line, 4, 2); // version
+  buf_add_int(line, 0, 4); // header_length
+  int64_t header_start = line->len;
+  buf_add_int(line, 1, 1); // minimum_instruction_length
+  buf_add_int(line, 1, 1); // maximum_operations_per_instruction
+  buf_add_int(line, 1, 1); // default_is_stmt
+  buf_add_int(line, (uint8_t)line_base, 1);
+  buf_add_int(line, line_range, 1);
+  buf_add_int(line, opcode_base, 1);
+  static const uint8_t std_opcode_lengths[] = {0, 1, 1, 1, 1, 0, 0, 0, 1, 0, 0, 1};
+  buf_add(line, (void *)std_opcode_lengths, sizeof(std_opcode_lengths));
+  buf_add_int(line, 0, 1); // include_directories
+  buf_add_str(line, name);
+  buf_add_uleb(line, 0); // directory
+  buf_add_uleb(line, 0); // mtime
+  buf_add_uleb(line, 0); // length
+  buf_add_int(line, 0, 1);
+  memcpy(line->data + 6, &(uint32_t){line->len - header_start}, 4);
+
+  // DW_LNE_set_address
+  buf_add_int(line, 0, 1);
+  buf_add_uleb(line, 9);
+  buf_add_int(line, 2, 1);
+  add_sec_reloc(line_sec, line->len, SEC_TEXT, R_X86_64_64, 0);
+  buf_add_int(line, 0, 8);
+
+  int64_t addr = 0;
+  int lineno = 1;
+  for (int i = 0; i < nlines; i++) {
+    int64_t addr_delta = lines[i].addr - addr;
+    int line_delta = lines[i].line - lineno;
+
+    int64_t op = (line_delta - line_base) + line_range * addr_delta + opcode_base;
+    if (line_base <= line_delta && line_delta < line_base + line_range && op <= 255) {
+      // A special opcode advances both and appends a row.
+      buf_add_int(line, op, 1);
+    } else {
+      buf_add_int(line, 2, 1); // DW_LNS_advance_pc
+      buf_add_uleb(line, addr_delta);
+      buf_add_int(line, 3, 1); // DW_LNS_advance_line
+      buf_add_sleb(line, line_delta);
+      buf_add_int(line, 1, 1); // DW_LNS_copy
+    }
+    addr = lines[i].addr;
+    lineno = lines[i].line;
+  }
+
+  buf_add_int(line, 2, 1); // DW_LNS_advance_pc
+  buf_add_uleb(line, sections[SEC_TEXT].data.len - addr);
+  buf_add_int(line, 0, 1); // DW_LNE_end_sequence
+  buf_add_uleb(line, 1);
+  buf_add_int(line, 1, 1);
+  memcpy(line->data, &(uint32_t){line->len - 4}, 4);
+}
+
+//
+// ELF writer
+//
+
+static void write_elf(FILE *out) {
+  Buf shstrtab = {}, strtab = {}, symtab = {};
+  buf_add_int(&shstrtab, 0, 1);
+  buf_add_int(&strtab, 0, 1);
+
+  // Section headers: null, sections with contents, .note.GNU-stack,
+  // .rela.* and then the symbol table and string tables.
+  Elf64_Shdr shdrs[NUM_SECTIONS * 2 + 5] = {};
+  int nshdrs = 1;
+
+  for (int i = 0; i < NUM_SECTIONS; i++) {
+    Section *sec = &sections[i];
+    if (i >= SEC_DEBUG_INFO && !nlines)
+      continue;
+    sec->elf_index = nshdrs;
+    Elf64_Shdr *sh = &shdrs[nshdrs++];
+    sh->sh_name = shstrtab.len;
+    buf_add_str(&shstrtab, sec->name);
+    sh->sh_type = sec->type;
+    sh->sh_flags = sec->flags;
+    sh->sh_addralign = sec->align;
+    sh->sh_size = sec_offset(sec);
+  }
+
+  // An empty .note.GNU-stack section marks the stack non-executable.
+  Elf64_Shdr *note = &shdrs[nshdrs++];
+  note->sh_name = shstrtab.len;
+  buf_add_str(&shstrtab, ".note.GNU-stack");
+  note->sh_type = SHT_PROGBITS;
+  note->sh_addralign = 1;
+
+  // Symbols: a section symbol for each section, then local symbols
+  // and then global ones.
+  Elf64_Sym null_sym = {};
+  buf_add(&symtab, &null_sym, sizeof(null_sym));
+  int nsyms = 1;
+
+  int sec_sym[NUM_SECTIONS];
+  for (int i = 0; i < NUM_SECTIONS; i++) {
+    if (!sections[i].elf_index)
+      continue;
+    Elf64_Sym sym = {
+      .st_info = ELF64_ST_INFO(STB_LOCAL, STT_SECTION),
+      .st_shndx = sections[i].elf_index,
+    };
+    buf_add(&symtab, &sym, sizeof(sym));
+    sec_sym[i] = nsyms++;
+  }
+
+  for (int pass = 0; pass < 2; pass++) {
+    if (pass == 1)
+      shdrs[0].sh_info = nsyms; // Temporarily holds the first global
+    for (Symbol *s = symbol_list; s; s = s->next) {
+      if (is_local_label(s))
+        continue;
+      bool is_global = s->is_global || s->sec == -1;
+      if (is_global != pass)
+        continue;
+
+      Elf64_Sym sym = {
+        .st_name = strtab.len,
+        .st_info = ELF64_ST_INFO(is_global ? STB_GLOBAL : STB_LOCAL, STT_NOTYPE),
+        .st_shndx = (s->sec == -1) ? SHN_UNDEF : sections[s->sec].elf_index,
+        .st_value = (s->sec == -1) ? 0 : s->offset,
+      };
+      buf_add_str(&strtab, s->name);
+      buf_add(&symtab, &sym, sizeof(sym));
+      s->elf_index = nsyms++;
+    }
+  }
+  int first_global = shdrs[0].sh_info;
+  shdrs[0].sh_info = 0;
+
+  int symtab_index = nshdrs;
+  for (int i = 0; i < NUM_SECTIONS; i++)
+    if (sections[i].nrelocs)
+      symtab_index++;
+
+  // .rela sections
+  Buf relas[NUM_SECTIONS] = {};
+  int rela_index[NUM_SECTIONS];
+  for (int i = 0; i < NUM_SECTIONS; i++) {
+    Section *sec = &sections[i];
+    if (!sec->nrelocs)
+      continue;
+
+    for (int j = 0; j < sec->nrelocs; j++) {
+      Reloc *rel = &sec->relocs[j];
+      int symidx = rel->sym ? rel->sym->elf_index : sec_sym[rel->sec];
+      Elf64_Rela r = {rel->offset, ELF64_R_INFO(symidx, rel->type), rel->addend};
+      buf_add(&relas[i], &r, sizeof(r));
+    }
+
+    rela_index[i] = nshdrs;
+    Elf64_Shdr *sh = &shdrs[nshdrs++];
+    sh->sh_name = shstrtab.len;
+    buf_add_str(&shstrtab, format(".rela%s", sec->name));
+    sh->sh_type = SHT_RELA;
+    sh->sh_flags = SHF_INFO_LINK;
+    sh->sh_link = symtab_index;
+    sh->sh_info = sec->elf_index;
+    sh->sh_addralign = 8;
+    sh->sh_entsize = sizeof(Elf64_Rela);
+    sh->sh_size = relas[i].len;
+  }
+
+  Elf64_Shdr *symtab_sh = &shdrs[nshdrs++];
+  symtab_sh->sh_name = shstrtab.len;
+  buf_add_str(&shstrtab, ".symtab");
+  symtab_sh->sh_type = SHT_SYMTAB;
+  symtab_sh->sh_link = nshdrs;
+  symtab_sh->sh_info = first_global;
+  symtab_sh->sh_addralign = 8;
+  symtab_sh->sh_entsize = sizeof(Elf64_Sym);
+  symtab_sh->sh_size = symtab.len;
+
+  Elf64_Shdr *strtab_sh = &shdrs[nshdrs++];
+  strtab_sh->sh_name = shstrtab.len;
+  buf_add_str(&shstrtab, ".strtab");
+  strtab_sh->sh_type = SHT_STRTAB;
+  strtab_sh->sh_addralign = 1;
+  strtab_sh->sh_size = strtab.len;
+
+  Elf64_Shdr *shstrtab_sh = &shdrs[nshdrs++];
+  shstrtab_sh->sh_name = shstrtab.len;
+  buf_add_str(&shstrtab, ".shstrtab");
+  shstrtab_sh->sh_type = SHT_STRTAB;
+  shstrtab_sh->sh_addralign = 1;
+  shstrtab_sh->sh_size = shstrtab.len;
+
+  // Lay out the file: the ELF header, section contents and then the
+  // section header table.
+  Buf file = {};
+  Elf64_Ehdr ehdr = {
+    .e_ident = {ELFMAG0, ELFMAG1, ELFMAG2, ELFMAG3, ELFCLASS64, ELFDATA2LSB, EV_CURRENT},
+    .e_type = ET_REL,
+    .e_machine = EM_X86_64,
+    .e_version = EV_CURRENT,
+    .e_ehsize = sizeof(Elf64_Ehdr),
+    .e_shentsize = sizeof(Elf64_Shdr),
+    .e_shnum = nshdrs,
+    .e_shstrndx = nshdrs - 1,
+  };
+  buf_add(&file, &ehdr, sizeof(ehdr));
+
+  for (int i = 1; i < nshdrs; i++) {
+    Elf64_Shdr *sh = &shdrs[i];
+    Buf *contents = NULL;
+
+    for (int j = 0; j < NUM_SECTIONS; j++) {
+      if (sections[j].elf_index == i && sections[j].type != SHT_NOBITS)
+        contents = &sections[j].data;
+      if (sections[j].nrelocs && rela_index[j] == i)
+        contents = &relas[j];
+    }
+    if (sh == symtab_sh)
+      contents = &symtab;
+    else if (sh == strtab_sh)
+      contents = &strtab;
+    else if (sh == shstrtab_sh)
+      contents = &shstrtab;
+
+    buf_align(&file, MAX(sh->sh_addralign, 1));
+    sh->sh_offset = file.len;
+    if (contents)
+      buf_add(&file, contents->data, contents->len);
+  }
+
+  buf_align(&file, 8);
+  ((Elf64_Ehdr *)file.data)->e_shoff = file.len;
+  buf_add(&file, shdrs, sizeof(Elf64_Shdr) * nshdrs);
+
+  fwrite(file.data, 1, file.len, out);
+
+  free(file.data);
+  free(shstrtab.data);
+  free(strtab.data);
+  free(symtab.data);
+  for (int i = 0; i < NUM_SECTIONS; i++)
+    free(relas[i].data);
+}
+
+// Assembles a given assembly text and writes an ELF relocatable
+// object to `out`.
+void assemble(char *text, FILE *out) {
+  init_sections();
+  free(symbols.buckets);
+  symbols = (HashMap){};
+  while (symbol_list) {
+    Symbol *next = symbol_list->next;
+    free(symbol_list->name);
+    free(symbol_list);
+    symbol_list = next;
+  }
+  free(source_name);
+  source_name = NULL;
+  nlines = 0;
+
+  for (char *p = text; *p;) {
+    char *end = strchr(p, '\n');
+    if (!end)
+      end = p + strlen(p);
+    char *line = strndup(p, end - p);
+    assemble_line(line);
+    free(line);
+    p = *end ? end + 1 : end;
+  }
+
+  resolve_relocs();
+  if (nlines)
+    emit_dwarf();
+  write_elf(out);
+}
@@ -0,0 +1,345 @@
+// This file lowers the AST of a function to the IR used by -O1.
+//
+// The lowering is deliberately naive: every local variable lives in
+// memory and is accessed with IR_LOAD and IR_STORE through its
+// address. iropt.c then promotes locals whose address is never taken
+// to SSA values, which is easier than producing SSA form directly.
+
+#include "chibicc.h"
+
+static _Thread_local IrFunc *cur_fn;
+static _Thread_local IrBlock *cur_bb;
+static _Thread_local IrBlock *last_bb;
+
+// Last instruction of the current block
+static _Thread_local IrInst *cur_inst;
+
+int new_value(IrFunc *f) {
+  return ++f->nvalues;
+}
+
+IrInst *new_inst(IrOp op, Token *tok) {
+  IrInst *inst = arena_alloc(&ir_arena, sizeof(IrInst));
+  inst->op = op;
+  inst->tok = tok;
+  return inst;
+}
+
+// Returns the last instruction of a given block.
+IrInst *terminator(IrBlock *bb) {
+  IrInst *inst = bb->insts;
+  while (inst && inst->next)
+    inst = inst->next;
+  return inst;
+}
+
+// Instructions read their operands from lhs, rhs and then args.
+// Unused operands are 0.
+int num_operands(IrInst *inst) {
+  return 2 + inst->nargs;
+}
+
+int *operand(IrInst *inst, int i) {
+  if (i == 0)
+    return &inst->lhs;
+  if (i == 1)
+    return &inst->rhs;
+  return &inst->args[i - 2];
+}
+
+// Stores the successors of a given block to `succs` and returns
+// their number.
+int successors(IrBlock *bb, IrBlock **succs) {
+  IrInst *inst = terminator(bb);
+  switch (inst->op) {
+  case IR_JMP:
+    succs[0] = inst->then;
+    return 1;
+  case IR_BR:
+    succs[0] = inst->then;
+    succs[1] = inst->els;
+    return 2;
+  }
+  return 0;
+}
+
+static IrBlock *new_block(void) {
+  IrBlock *bb = arena_alloc(&ir_arena, sizeof(IrBlock));
+  bb->id = cur_fn->nblocks++;
+  return bb;
+}
+
+// Appends a given block to the function and makes it current.
+static void start_block(IrBlock *bb) {
+  if (last_bb)
+    last_bb->next = bb;
+  else
+    cur_fn->blocks = bb;
+  last_bb = cur_bb = bb;
+  cur_inst = NULL;
+}
+
+static IrInst *emit(IrOp op, Token *tok) {
+  IrInst *inst = new_inst(op, tok);
+  if (cur_inst)
+    cur_inst->next = inst;
+  else
+    cur_bb->insts = inst;
+  cur_inst = inst;
+  return inst;
+}
+
+// Emits an instruction that defines a new value.
+static IrInst *emit_def(IrOp op, Token *tok) {
+  IrInst *inst = emit(op, tok);
+  inst->dst = new_value(cur_fn);
+  return inst;
+}
+
+static int emit_imm(int64_t val, Token *tok) {
+  IrInst *inst = emit_def(IR_IMM, tok);
+  inst->val = val;
+  return inst->dst;
+}
+
+static int emit_binary(IrOp op, int lhs, int rhs, Token *tok) {
+  IrInst *inst = emit_def(op, tok);
+  inst->lhs = lhs;
+  inst->rhs = rhs;
+  return inst->dst;
+}
+
+static void emit_jmp(IrBlock *then, Token *tok) {
+  emit(IR_JMP, tok)->then = then;
+}
+
+static int gen_expr(Node *node);
+static void gen_stmt(Node *node);
+
+// Computes the address of a given node.
+static int gen_addr(Node *node) {
+  switch (node->kind) {
+  case ND_VAR: {
+    IrInst *inst = emit_def(IR_ADDR, node->tok);
+    inst->var = node->var;
+    return inst->dst;
+  }
+  case ND_DEREF:
+    return gen_expr(node->lhs);
+  case ND_COMMA:
+    gen_expr(node->lhs);
+    return gen_addr(node->rhs);
+  case ND_MEMBER: {
+    int base = gen_addr(node->lhs);
+    int offset = node->member->offset;
+
+    // Fold the offset into the variable's address if possible.
+    if (cur_inst && cur_inst->op == IR_ADDR && cur_inst->dst == base) {
+      cur_inst->val += offset;
+      return base;
+    }
+    if (offset == 0)
+      return base;
+    return emit_binary(IR_ADD, base, emit_imm(offset, node->tok), node->tok);
+  }
+  }
+
+  error_tok(node->tok, "not an lvalue");
+}
+
+// Loads a value of a given type from an address. As in codegen.c,
+// an array or a struct evaluates to its address.
+static int load(int addr, Type *ty, Token *tok) {
+  if (ty->kind == TY_ARRAY || ty->kind == TY_STRUCT || ty->kind == TY_UNION)
+    return addr;
+
+  IrInst *inst = emit_def(IR_LOAD, tok);
+  inst->lhs = addr;
+  inst->ty = ty;
+  return inst->dst;
+}
+
+static IrOp binary_op(NodeKind kind) {
+  switch (kind) {
+  case ND_ADD: return IR_ADD;
+  case ND_SUB: return IR_SUB;
+  case ND_MUL: return IR_MUL;
+  case ND_DIV: return IR_DIV;
+  case ND_EQ: return IR_EQ;
+  case ND_NE: return IR_NE;
+  case ND_LT: return IR_LT;
+  case ND_LE: return IR_LE;
+  }
+  unreachable();
+}
+
+static int gen_expr(Node *node) {
+  switch (node->kind) {
+  case ND_NUM:
+    return emit_imm(node->val, node->tok);
+  case ND_NEG: {
+    int val = gen_expr(node->lhs);
+    IrInst *inst = emit_def(IR_NEG, node->tok);
+    inst->lhs = val;
+    return inst->dst;
+  }
+  case ND_VAR:
+  case ND_MEMBER:
+    return load(gen_addr(node), node->ty, node->tok);
+  case ND_DEREF:
+    return load(gen_expr(node->lhs), node->ty, node->tok);
+  case ND_ADDR:
+    return gen_addr(node->lhs);
+  case ND_ASSIGN: {
+    int addr = gen_addr(node->lhs);
+    int val = gen_expr(node->rhs);
+    Type *ty = node->ty;
+    IrInst *inst =
+      emit((ty->kind == TY_STRUCT || ty->kind == TY_UNION) ? IR_MEMCPY : IR_STORE,
+           node->tok);
+    inst->lhs = addr;
+    inst->rhs = val;
+    inst->ty = ty;
+    return val;
+  }
+  case ND_STMT_EXPR: {
+    Node *n = node->body;
+    for (; n->next; n = n->next)
+      gen_stmt(n);
+    return gen_expr(n->lhs);
+  }
+  case ND_COMMA:
+    gen_expr(node->lhs);
+    return gen_expr(node->rhs);
+  case ND_FUNCALL: {
+    int nargs = 0;
+    for (Node *arg = node->args; arg; arg = arg->next)
+      nargs++;
+
+    int *args = arena_alloc(&ir_arena, sizeof(int) * nargs);
+    int i = 0;
+    for (Node *arg = node->args; arg; arg = arg->next)
+      args[i++] = gen_expr(arg);
+
+    IrInst *inst = emit_def(IR_CALL, node->tok);
+    inst->funcname = node->funcname;
+    inst->args = args;
+    inst->nargs = nargs;
+    return inst->dst;
+  }
+  case ND_ADD:
+  case ND_SUB:
+  case ND_MUL:
+  case ND_DIV:
+  case ND_EQ:
+  case ND_NE:
+  case ND_LT:
+  case ND_LE: {
+    int lhs = gen_expr(node->lhs);
+    int rhs = gen_expr(node->rhs);
+    return emit_binary(binary_op(node->kind), lhs, rhs, node->tok);
+  }
+  }
+
+  error_tok(node->tok, "invalid expression");
+}
+
+static void gen_cond(Node *node, IrBlock *then, IrBlock *els) {
+  if (node->kind == ND_NUM) {
+    emit_jmp(node->val ? then : els, node->tok);
+    return;
+  }
+
+  int cond = gen_expr(node);
+  IrInst *inst = emit(IR_BR, node->tok);
+  inst->lhs = cond;
+  inst->then = then;
+  inst->els = els;
+}
+
+static void gen_stmt(Node *node) {
+  switch (node->kind) {
+  case ND_IF: {
+    IrBlock *then = new_block();
+    IrBlock *els = new_block();
+    IrBlock *end = new_block();
+
+    gen_cond(node->cond, then, els);
+    start_block(then);
+    gen_stmt(node->then);
+    emit_jmp(end, node->tok);
+    start_block(els);
+    if (node->els)
+      gen_stmt(node->els);
+    emit_jmp(end, node->tok);
+    start_block(end);
+    return;
+  }
+  case ND_FOR: {
+    IrBlock *begin = new_block();
+    IrBlock *body = new_block();
+    IrBlock *end = new_block();
+
+    if (node->init)
+      gen_stmt(node->init);
+    emit_jmp(begin, node->tok);
+    start_block(begin);
+    if (node->cond)
+      gen_cond(node->cond, body, end);
+    else
+      emit_jmp(body, node->tok);
+    start_block(body);
+    gen_stmt(node->then);
+    if (node->inc)
+      gen_expr(node->inc);
+    emit_jmp(begin, node->tok);
+    start_block(end);
+    return;
+  }
+  case ND_BLOCK:
+    for (Node *n = node->body; n; n = n->next)
+      gen_stmt(n);
+    return;
+  case ND_RETURN: {
+    int val = gen_expr(node->lhs);
+    emit(IR_RET, node->tok)->lhs = val;
+
+    // Code after a return statement goes to a block that is
+    // unreachable.
+    start_block(new_block());
+    return;
+  }
+  case ND_EXPR_STMT:
+    gen_expr(node->lhs);
+    return;
+  }
+
+  error_tok(node->tok, "invalid statement");
+}
+
+IrFunc *lower_to_ir(Obj *fn) {
+  cur_fn = arena_alloc(&ir_arena, sizeof(IrFunc));
+  cur_fn->fn = fn;
+  last_bb = NULL;
+  start_block(new_block());
+
+  // Parameters are stored to their variables, just like codegen.c
+  // does, and mem2reg then turns them into plain values.
+  int i = 0;
+  for (Obj *var = fn->params; var; var = var->next) {
+    IrInst *param = emit_def(IR_PARAM, fn->body->tok);
+    param->val = i++;
+
+    IrInst *addr = emit_def(IR_ADDR, fn->body->tok);
+    addr->var = var;
+
+    IrInst *store = emit(IR_STORE, fn->body->tok);
+    store->lhs = addr->dst;
+    store->rhs = param->dst;
+    store->ty = var->ty;
+  }
+
+  gen_stmt(fn->body);
+  emit(IR_RET, fn->body->tok);
+  return cur_fn;
+}
@@ -0,0 +1,941 @@
+// This file contains the -O1 pass pipeline over the IR.
+//
+//  1. Unreachable blocks are removed and the dominator tree is built.
+//  2. mem2reg promotes locals whose address is never taken to SSA
+//     values, inserting phi nodes at the iterated dominance frontier
+//     of their stores.
+//  3. Copies, trivial phis and constant expressions are simplified.
+//  4. Common subexpressions are eliminated along the dominator tree.
+//  5. Instructions whose values are never used are deleted.
+//
+// leave_ssa() replaces phis with copies for instruction selection.
+
+#include "chibicc.h"
+
+static _Thread_local IrFunc *cur_fn;
+
+// Reverse postorder of reachable blocks
+static _Thread_local IrBlock **order;
+static _Thread_local int norder;
+
+// Defining instruction of each value that existed when defs was
+// last built
+static _Thread_local IrInst **defs;
+static _Thread_local int ndefs;
+
+// A value that has been replaced by another one (e.g. the result of
+// a load that mem2reg removed) is mapped to its replacement.
+static _Thread_local int *repl;
+static _Thread_local int repl_cap;
+
+static int resolve(int v) {
+  if (!v || !repl[v])
+    return v;
+  return repl[v] = resolve(repl[v]);
+}
+
+static void resolve_operands(IrInst *inst) {
+  for (int i = 0; i < num_operands(inst); i++) {
+    int *p = operand(inst, i);
+    *p = resolve(*p);
+  }
+}
+
+static void build_defs(void) {
+  ndefs = cur_fn->nvalues;
+  defs = arena_alloc(&ir_arena, sizeof(IrInst *) * (ndefs + 1));
+  for (IrBlock *bb = cur_fn->blocks; bb; bb = bb->next)
+    for (IrInst *inst = bb->insts; inst; inst = inst->next)
+      if (inst->dst)
+        defs[inst->dst] = inst;
+}
+
+// Starts a pass with an empty repl[] for the values that exist.
+static void init_repl(void) {
+  repl_cap = cur_fn->nvalues + 1;
+  repl = arena_alloc(&ir_arena, sizeof(int) * repl_cap);
+}
+
+// Creates a value in a pass that uses repl[]. repl[] grows by doubling,
+// as mem2reg may create a value for every store.
+static int new_value_repl(void) {
+  int v = new_value(cur_fn);
+  if (v >= repl_cap) {
+    int *r = arena_alloc(&ir_arena, sizeof(int) * repl_cap * 2);
+    memcpy(r, repl, sizeof(int) * repl_cap);
+    repl = r;
+    repl_cap *= 2;
+  }
+  return v;
+}
+
+//
+// Control flow graph
+//
+
+static void dfs(IrBlock *bb, bool *visited, IrBlock **post, int *n) {
+  visited[bb->id] = true;
+
+  IrBlock *succs[2];
+  int nsuccs = successors(bb, succs);
+  for (int i = 0; i < nsuccs; i++)
+    if (!visited[succs[i]->id])
+      dfs(succs[i], visited, post, n);
+  post[(*n)++] = bb;
+}
+
+// Removes unreachable blocks and computes predecessors and the
+// reverse postorder. This must run before phis are inserted, because
+// removing a predecessor would invalidate their operands.
+static void build_cfg(void) {
+  int nblocks = cur_fn->nblocks;
+  bool *visited = arena_alloc(&ir_arena, nblocks);
+  IrBlock **post = arena_alloc(&ir_arena, sizeof(IrBlock *) * nblocks);
+  norder = 0;
+  dfs(cur_fn->blocks, visited, post, &norder);
+
+  order = arena_alloc(&ir_arena, sizeof(IrBlock *) * norder);
+  for (int i = 0; i < norder; i++) {
+    order[i] = post[norder - i - 1];
+    order[i]->rpo = i;
+  }
+
+  for (IrBlock **p = &cur_fn->blocks; *p;) {
+    if (visited[(*p)->id]) {
+      p = &(*p)->next;
+    } else {
+      *p = (*p)->next;
+    }
+  }
+
+  for (IrBlock *bb = cur_fn->blocks; bb; bb = bb->next) {
+    IrBlock *succs[2];
+    int nsuccs = successors(bb, succs);
+    for (int i = 0; i < nsuccs; i++)
+      succs[i]->npreds++;
+  }
+
+  for (IrBlock *bb = cur_fn->blocks; bb; bb = bb->next) {
+    bb->preds = arena_alloc(&ir_arena, sizeof(IrBlock *) * bb->npreds);
+    bb->npreds = 0;
+  }
+
+  for (IrBlock *bb = cur_fn->blocks; bb; bb = bb->next) {
+    IrBlock *succs[2];
+    int nsuccs = successors(bb, succs);
+    for (int i = 0; i < nsuccs; i++)
+      succs[i]->preds[succs[i]->npreds++] = bb;
+  }
+}
+
+static IrBlock *intersect(IrBlock *a, IrBlock *b) {
+  while (a != b) {
+    while (a->rpo > b->rpo)
+      a = a->idom;
+    while (b->rpo > a->rpo)
+      b = b->idom;
+  }
+  return a;
+}
+
+// Computes the dominator tree with the algorithm described in
+// Cooper, Harvey and Kennedy, "A Simple, Fast Dominance Algorithm".
+static void build_dominators(void) {
+  IrBlock *entry = order[0];
+  entry->idom = entry;
+
+  for (bool changed = true; changed;) {
+    changed = false;
+    for (int i = 1; i < norder; i++) {
+      IrBlock *bb = order[i];
+      IrBlock *idom = NULL;
+      for (int j = 0; j < bb->npreds; j++) {
+        IrBlock *pred = bb->preds[j];
+        if (!pred->idom)
+          continue;
+        idom = idom ? intersect(pred, idom) : pred;
+      }
+      if (bb->idom != idom) {
+        bb->idom = idom;
+        changed = true;
+      }
+    }
+  }
+
+  // Children are linked in reverse postorder.
+  for (int i = norder - 1; i > 0; i--) {
+    IrBlock *bb = order[i];
+    bb->dom_sibling = bb->idom->dom_child;
+    bb->idom->dom_child = bb;
+  }
+}
+
+//
+// mem2reg
+//
+
+// A list of blocks
+typedef struct {
+  IrBlock **blocks;
+  int len;
+} BlockList;
+
+// Returns the promoted variable whose address is a given value, or
+// NULL.
+static Obj *promoted_var(int v) {
+  IrInst *def = (v <= ndefs) ? defs[v] : NULL;
+  if (def && def->op == IR_ADDR && def->var->is_local && def->var->promoted_id)
+    return def->var;
+  return NULL;
+}
+
+static bool is_scalar(Type *ty) {
+  return is_integer(ty) || ty->kind == TY_PTR;
+}
+
+// Finds the locals that are only accessed by loads and stores of
+// their own type. All other locals stay in memory.
+static Obj **find_promotable(int *nvars) {
+  Obj *fn = cur_fn->fn;
+  int n = 0;
+  for (Obj *var = fn->locals; var; var = var->next)
+    var->promoted_id = is_scalar(var->ty) ? ++n : 0;
+
+  for (IrBlock *bb = cur_fn->blocks; bb; bb = bb->next) {
+    for (IrInst *inst = bb->insts; inst; inst = inst->next) {
+      if (inst->op == IR_ADDR && inst->val && inst->var->is_local)
+        inst->var->promoted_id = 0;
+
+      for (int i = 0; i < num_operands(inst); i++) {
+        int v = *operand(inst, i);
+        if (!v || !defs[v] || defs[v]->op != IR_ADDR)
+          continue;
+
+        // Globals are never promoted. Leave them untouched, as other
+        // threads may be compiling functions that refer to them.
+        Obj *var = defs[v]->var;
+        if (!var->is_local)
+          continue;
+
+        bool is_access = i == 0 && (inst->op == IR_LOAD || inst->op == IR_STORE);
+        if (!is_access || inst->ty->size != var->ty->size)
+          var->promoted_id = 0;
+      }
+    }
+  }
+
+  Obj **vars = arena_alloc(&ir_arena, sizeof(Obj *) * (n + 1));
+  n = 0;
+  for (Obj *var = fn->locals; var; var = var->next)
+    if (var->promoted_id)
+      vars[var->promoted_id = ++n] = var;
+  *nvars = n;
+  return vars;
+}
+
+// Computes the dominance frontier of each block, indexed by block
+// ID. A block joining several paths is added to the frontier of each
+// block from its predecessors up to its idom, so the work is
+// proportional to the size of the frontiers.
+static BlockList *dominance_frontiers(void) {
+  BlockList *df = arena_alloc(&ir_arena, sizeof(BlockList) * cur_fn->nblocks);
+
+  // Count first to allocate each list at once. The paths from two
+  // predecessors may meet below the idom, so a block is only added
+  // if it is not the last one added.
+  IrBlock **last = arena_alloc(&ir_arena, sizeof(IrBlock *) * cur_fn->nblocks);
+  for (int pass = 0; pass < 2; pass++) {
+    for (IrBlock *bb = cur_fn->blocks; bb; bb = bb->next) {
+      if (bb->npreds < 2)
+        continue;
+      for (int i = 0; i < bb->npreds; i++) {
+        for (IrBlock *p = bb->preds[i]; p != bb->idom; p = p->idom) {
+          if (last[p->id] == bb)
+            continue;
+          last[p->id] = bb;
+          if (pass)
+            df[p->id].blocks[df[p->id].len++] = bb;
+          else
+            df[p->id].len++;
+        }
+      }
+    }
+
+    if (pass)
+      break;
+    for (int i = 0; i < cur_fn->nblocks; i++) {
+      df[i].blocks = arena_alloc(&ir_arena, sizeof(IrBlock *) * df[i].len);
+      df[i].len = 0;
+      last[i] = NULL;
+    }
+  }
+  return df;
+}
+
+// Inserts phis for each variable at the iterated dominance frontier
+// of the blocks storing to it.
+static void insert_phis(Obj **vars, int nvars) {
+  BlockList *df = dominance_frontiers();
+  int nblocks = cur_fn->nblocks;
+
+  // Blocks storing to each variable, once per store. Duplicates are
+  // skipped when the worklist is filled.
+  BlockList *stores = arena_alloc(&ir_arena, sizeof(BlockList) * (nvars + 1));
+  for (int pass = 0; pass < 2; pass++) {
+    for (IrBlock *bb = cur_fn->blocks; bb; bb = bb->next) {
+      for (IrInst *inst = bb->insts; inst; inst = inst->next) {
+        Obj *var = (inst->op == IR_STORE) ? promoted_var(inst->lhs) : NULL;
+        if (!var)
+          continue;
+        BlockList *l = &stores[var->promoted_id];
+        if (pass)
+          l->blocks[l->len++] = bb;
+        else
+          l->len++;
+      }
+    }
+
+    if (pass)
+      break;
+    for (int id = 1; id <= nvars; id++) {
+      stores[id].blocks = arena_alloc(&ir_arena, sizeof(IrBlock *) * stores[id].len);
+      stores[id].len = 0;
+    }
+  }
+
+  // A block is in the worklist of a variable at most once, as `queued`
+  // records the last variable it was added for.
+  IrBlock **worklist = arena_alloc(&ir_arena, sizeof(IrBlock *) * nblocks);
+  int *has_phi = arena_alloc(&ir_arena, sizeof(int) * nblocks);
+  int *queued = arena_alloc(&ir_arena, sizeof(int) * nblocks);
+
+  for (int id = 1; id <= nvars; id++) {
+    int len = 0;
+    for (int i = 0; i < stores[id].len; i++) {
+      IrBlock *bb = stores[id].blocks[i];
+      if (queued[bb->id] != id) {
+        queued[bb->id] = id;
+        worklist[len++] = bb;
+      }
+    }
+
+    while (len) {
+      IrBlock *bb = worklist[--len];
+      for (int i = 0; i < df[bb->id].len; i++) {
+        IrBlock *d = df[bb->id].blocks[i];
+        if (has_phi[d->id] == id)
+          continue;
+
+        IrInst *phi = new_inst(IR_PHI, d->insts->tok);
+        phi->dst = new_value(cur_fn);
+        phi->var = vars[id];
+        phi->args = arena_alloc(&ir_arena, sizeof(int) * d->npreds);
+        phi->nargs = d->npreds;
+        phi->next = d->insts;
+        d->insts = phi;
+        has_phi[d->id] = id;
+
+        if (queued[d->id] != id) {
+          queued[d->id] = id;
+          worklist[len++] = d;
+        }
+      }
+    }
+  }
+}
+
+// Current value of each promoted variable during renaming, and a log
+// of overwritten values to restore when leaving a subtree.
+static _Thread_local int *cur_val;
+static _Thread_local int *undo_id;
+static _Thread_local int *undo_val;
+static _Thread_local int undo_len;
+static _Thread_local int undo_cap;
+
+// Reading a variable that has not been assigned yet is undefined
+// behavior, so any value will do.
+static _Thread_local int undef_val;
+
+static void set_cur_val(int id, int v) {
+  if (undo_len == undo_cap) {
+    undo_cap = undo_cap ? undo_cap * 2 : 64;
+    int *ids = arena_alloc(&ir_arena, sizeof(int) * undo_cap);
+    int *vals = arena_alloc(&ir_arena, sizeof(int) * undo_cap);
+    memcpy(ids, undo_id, sizeof(int) * undo_len);
+    memcpy(vals, undo_val, sizeof(int) * undo_len);
+    undo_id = ids;
+    undo_val = vals;
+  }
+  undo_id[undo_len] = id;
+  undo_val[undo_len++] = cur_val[id];
+  cur_val[id] = v;
+}
+
+static int get_cur_val(int id) {
+  return cur_val[id] ? cur_val[id] : undef_val;
+}
+
+static void rename_block(IrBlock *bb) {
+  int saved = undo_len;
+
+  for (IrInst **p = &bb->insts; *p;) {
+    IrInst *inst = *p;
+    resolve_operands(inst);
+
+    if (inst->op == IR_PHI && inst->var) {
+      set_cur_val(inst->var->promoted_id, inst->dst);
+    } else if (inst->op == IR_LOAD && promoted_var(inst->lhs)) {
+      repl[inst->dst] = get_cur_val(promoted_var(inst->lhs)->promoted_id);
+      *p = inst->next;
+      continue;
+    } else if (inst->op == IR_STORE && promoted_var(inst->lhs)) {
+      Obj *var = promoted_var(inst->lhs);
+
+      if (var->ty->size == 8) {
+        set_cur_val(var->promoted_id, inst->rhs);
+        *p = inst->next;
+        continue;
+      }
+
+      // A store truncates the value and a load sign-extends it.
+      inst->op = IR_SEXT;
+      inst->dst = new_value_repl();
+      inst->lhs = inst->rhs;
+      inst->rhs = 0;
+      inst->ty = var->ty;
+      set_cur_val(var->promoted_id, inst->dst);
+    }
+    p = &inst->next;
+  }
+
+  IrBlock *succs[2];
+  int nsuccs = successors(bb, succs);
+  for (int i = 0; i < nsuccs; i++) {
+    if (i == 1 && succs[1] == succs[0])
+      break;
+    IrBlock *succ = succs[i];
+    for (int j = 0; j < succ->npreds; j++) {
+      if (succ->preds[j] != bb)
+        continue;
+      for (IrInst *inst = succ->insts; inst && inst->op == IR_PHI; inst = inst->next)
+        if (inst->var)
+          inst->args[j] = get_cur_val(inst->var->promoted_id);
+    }
+  }
+
+  for (IrBlock *child = bb->dom_child; child; child = child->dom_sibling)
+    rename_block(child);
+
+  while (undo_len > saved) {
+    undo_len--;
+    cur_val[undo_id[undo_len]] = undo_val[undo_len];
+  }
+}
+
+static void mem2reg(void) {
+  int nvars;
+  Obj **vars = find_promotable(&nvars);
+  if (!nvars)
+    return;
+
+  insert_phis(vars, nvars);
+
+  init_repl();
+  cur_val = arena_alloc(&ir_arena, sizeof(int) * (nvars + 1));
+  undo_len = undo_cap = 0;
+
+  IrBlock *entry = cur_fn->blocks;
+  IrInst *undef = new_inst(IR_IMM, entry->insts->tok);
+  undef->dst = undef_val = new_value_repl();
+  undef->next = entry->insts;
+  entry->insts = undef;
+
+  rename_block(cur_fn->blocks);
+
+  for (IrBlock *bb = cur_fn->blocks; bb; bb = bb->next)
+    for (IrInst *inst = bb->insts; inst; inst = inst->next)
+      resolve_operands(inst);
+}
+
+//
+// Simplification
+//
+
+static bool is_imm(int v) {
+  return defs[v] && defs[v]->op == IR_IMM;
+}
+
+static int64_t sign_extend(int64_t val, int size) {
+  switch (size) {
+  case 1: return (int8_t)val;
+  case 2: return (int16_t)val;
+  case 4: return (int32_t)val;
+  }
+  return val;
+}
+
+// Phis that is_extended() is looking into. A phi reached again
+// through a loop is assumed to be extended, which holds if all the
+// other values flowing into the loop are.
+static _Thread_local bool *visiting;
+
+// Returns true if a given value is already sign-extended from `size`
+// bytes.
+static bool is_extended(int v, int size) {
+  IrInst *def = defs[v];
+  if (!def)
+    return false;
+
+  switch (def->op) {
+  case IR_PHI: {
+    if (visiting[v])
+      return true;
+    visiting[v] = true;
+    bool ok = true;
+    for (int i = 0; i < def->nargs && ok; i++)
+      ok = is_extended(resolve(def->args[i]), size);
+    visiting[v] = false;
+    return ok;
+  }
+  case IR_SEXT:
+  case IR_LOAD:
+    return def->ty->size <= size;
+  case IR_EQ:
+  case IR_NE:
+  case IR_LT:
+  case IR_LE:
+    return true;
+  case IR_IMM:
+    return sign_extend(def->val, size) == def->val;
+  }
+  return false;
+}
+
+static void to_imm(IrInst *inst, int64_t val) {
+  inst->op = IR_IMM;
+  inst->val = val;
+  inst->lhs = inst->rhs = 0;
+}
+
+// Evaluates a binary operator with constant operands in the same way
+// as optimize.c does.
+static bool eval_binary(IrInst *inst, int64_t *val) {
+  uint64_t x = defs[inst->lhs]->val;
+  uint64_t y = defs[inst->rhs]->val;
+
+  switch (inst->op) {
+  case IR_ADD: *val = x + y; return true;
+  case IR_SUB: *val = x - y; return true;
+  case IR_MUL: *val = x * y; return true;
+  case IR_DIV:
+    if (y == 0 || (x == INT64_MIN && y == -1))
+      return false;
+    *val = (int64_t)x / (int64_t)y;
+    return true;
+  case IR_EQ: *val = (int64_t)x == (int64_t)y; return true;
+  case IR_NE: *val = (int64_t)x != (int64_t)y; return true;
+  case IR_LT: *val = (int64_t)x < (int64_t)y; return true;
+  case IR_LE: *val = (int64_t)x <= (int64_t)y; return true;
+  }
+  return false;
+}
+
+static bool is_commutative(IrOp op) {
+  return op == IR_ADD || op == IR_MUL || op == IR_EQ || op == IR_NE;
+}
+
+// Returns the value an instruction is equivalent to, or 0 if it has
+// to stay. The instruction may also be rewritten in place.
+static int simplify_inst(IrInst *inst) {
+  switch (inst->op) {
+  case IR_COPY:
+    return inst->lhs;
+  case IR_PHI: {
+    // A phi whose operands are all the same value (or the phi
+    // itself) is that value.
+    int same = 0;
+    for (int i = 0; i < inst->nargs; i++) {
+      int v = inst->args[i];
+      if (v == inst->dst || v == same)
+        continue;
+      if (same)
+        return 0;
+      same = v;
+    }
+    return same;
+  }
+  case IR_SEXT:
+    if (is_imm(inst->lhs)) {
+      to_imm(inst, sign_extend(defs[inst->lhs]->val, inst->ty->size));
+      return 0;
+    }
+    if (is_extended(inst->lhs, inst->ty->size))
+      return inst->lhs;
+    return 0;
+  case IR_NEG:
+    if (is_imm(inst->lhs))
+      to_imm(inst, -(uint64_t)defs[inst->lhs]->val);
+    return 0;
+  case IR_ADD:
+  case IR_SUB:
+  case IR_MUL:
+  case IR_DIV:
+  case IR_EQ:
+  case IR_NE:
+  case IR_LT:
+  case IR_LE: {
+    int64_t val;
+    if (is_imm(inst->lhs) && is_imm(inst->rhs) && eval_binary(inst, &val)) {
+      to_imm(inst, val);
+      return 0;
+    }
+
+    // Constants go to the right-hand side, where codegen can encode
+    // them as immediates.
+    if (is_commutative(inst->op) && is_imm(inst->lhs)) {
+      int tmp = inst->lhs;
+      inst->lhs = inst->rhs;
+      inst->rhs = tmp;
+    }
+
+    if (!is_imm(inst->rhs))
+      return 0;
+
+    int64_t c = defs[inst->rhs]->val;
+
+    // &var + c
+    if (inst->op == IR_ADD && defs[inst->lhs] && defs[inst->lhs]->op == IR_ADDR) {
+      IrInst *addr = defs[inst->lhs];
+      inst->op = IR_ADDR;
+      inst->var = addr->var;
+      inst->val = addr->val + c;
+      inst->lhs = inst->rhs = 0;
+      return 0;
+    }
+
+    if ((inst->op == IR_ADD || inst->op == IR_SUB) && c == 0)
+      return inst->lhs;
+    if ((inst->op == IR_MUL || inst->op == IR_DIV) && c == 1)
+      return inst->lhs;
+    return 0;
+  }
+  }
+  return 0;
+}
+
+// Runs simplify_inst() over all instructions until nothing changes.
+// Since a replaced instruction is deleted, this also propagates
+// copies.
+static void simplify(void) {
+  init_repl();
+  build_defs();
+  visiting = arena_alloc(&ir_arena, cur_fn->nvalues + 1);
+
+  for (bool changed = true; changed;) {
+    changed = false;
+    for (int i = 0; i < norder; i++) {
+      for (IrInst **p = &order[i]->insts; *p;) {
+        IrInst *inst = *p;
+        resolve_operands(inst);
+
+        int v = simplify_inst(inst);
+        if (v) {
+          repl[inst->dst] = v;
+          *p = inst->next;
+          changed = true;
+          continue;
+        }
+        p = &inst->next;
+      }
+    }
+  }
+}
+
+//
+// Common subexpression elimination
+//
+
+// Instructions are looked up by the contents of this struct.
+typedef struct {
+  IrOp op;
+  int lhs;
+  int rhs;
+  int size;
+  int64_t val;
+  Obj *var;
+  int epoch;
+} CseKey;
+
+static _Thread_local HashMap cse_map;
+static _Thread_local int mem_epoch;
+
+static bool is_pure(IrOp op) {
+  switch (op) {
+  case IR_IMM:
+  case IR_ADDR:
+  case IR_SEXT:
+  case IR_NEG:
+  case IR_ADD:
+  case IR_SUB:
+  case IR_MUL:
+  case IR_DIV:
+  case IR_EQ:
+  case IR_NE:
+  case IR_LT:
+  case IR_LE:
+  case IR_LOAD:
+    return true;
+  }
+  return false;
+}
+
+// Visits a dominator subtree. An instruction is available in the
+// blocks its own block dominates. A load is reused only until the
+// next store or call, and only within a block, which is why its key
+// includes the memory epoch.
+static void cse_block(IrBlock *bb) {
+  // Keys entered in this block and the entries they shadowed,
+  // which are put back when leaving the subtree.
+  int nkeys = 0;
+  for (IrInst *inst = bb->insts; inst; inst = inst->next)
+    nkeys++;
+  CseKey **keys = arena_alloc(&ir_arena, sizeof(CseKey *) * nkeys);
+  IrInst **shadow = arena_alloc(&ir_arena, sizeof(IrInst *) * nkeys);
+  nkeys = 0;
+
+  mem_epoch++;
+
+  for (IrInst **p = &bb->insts; *p;) {
+    IrInst *inst = *p;
+    resolve_operands(inst);
+
+    if (inst->op == IR_STORE || inst->op == IR_MEMCPY || inst->op == IR_CALL)
+      mem_epoch++;
+
+    if (!is_pure(inst->op)) {
+      p = &inst->next;
+      continue;
+    }
+
+    CseKey *key = arena_alloc(&ir_arena, sizeof(CseKey));
+    key->op = inst->op;
+    key->lhs = inst->lhs;
+    key->rhs = inst->rhs;
+    key->size = inst->ty ? inst->ty->size : 0;
+    key->val = inst->val;
+    key->var = inst->var;
+    key->epoch = (inst->op == IR_LOAD) ? mem_epoch : 0;
+
+    if (is_commutative(key->op) && key->lhs > key->rhs) {
+      key->lhs = inst->rhs;
+      key->rhs = inst->lhs;
+    }
+
+    IrInst *prev = hashmap_get2(&cse_map, (char *)key, sizeof(CseKey));
+    if (prev) {
+      repl[inst->dst] = prev->dst;
+      *p = inst->next;
+      continue;
+    }
+
+    keys[nkeys] = key;
+    shadow[nkeys++] = prev;
+    hashmap_put2(&cse_map, (char *)key, sizeof(CseKey), inst);
+    p = &inst->next;
+  }
+
+  for (IrBlock *child = bb->dom_child; child; child = child->dom_sibling)
+    cse_block(child);
+
+  for (int i = 0; i < nkeys; i++)
+    hashmap_put2(&cse_map, (char *)keys[i], sizeof(CseKey), shadow[i]);
+}
+
+static void cse(void) {
+  init_repl();
+  cse_block(cur_fn->blocks);
+
+  // Phi operands may refer to values defined in blocks which are
+  // visited after the phi's block.
+  for (IrBlock *bb = cur_fn->blocks; bb; bb = bb->next)
+    for (IrInst *inst = bb->insts; inst; inst = inst->next)
+      resolve_operands(inst);
+
+  free(cse_map.buckets);
+  cse_map = (HashMap){};
+}
+
+//
+// Dead code elimination
+//
+
+static bool has_side_effect(IrOp op) {
+  return !is_pure(op) && op != IR_PARAM && op != IR_COPY && op != IR_PHI;
+}
+
+static void dce(void) {
+  build_defs();
+
+  int nvalues = cur_fn->nvalues;
+  bool *used = arena_alloc(&ir_arena, nvalues + 1);
+  int *worklist = arena_alloc(&ir_arena, sizeof(int) * (nvalues + 1));
+  int len = 0;
+
+  for (IrBlock *bb = cur_fn->blocks; bb; bb = bb->next) {
+    for (IrInst *inst = bb->insts; inst; inst = inst->next) {
+      if (!has_side_effect(inst->op))
+        continue;
+      for (int i = 0; i < num_operands(inst); i++) {
+        int v = *operand(inst, i);
+        if (v && !used[v]) {
+          used[v] = true;
+          worklist[len++] = v;
+        }
+      }
+    }
+  }
+
+  while (len) {
+    IrInst *inst = defs[worklist[--len]];
+    assert(inst);
+    for (int i = 0; i < num_operands(inst); i++) {
+      int v = *operand(inst, i);
+      if (v && !used[v]) {
+        used[v] = true;
+        worklist[len++] = v;
+      }
+    }
+  }
+
+  for (IrBlock *bb = cur_fn->blocks; bb; bb = bb->next) {
+    for (IrInst **p = &bb->insts; *p;) {
+      IrInst *inst = *p;
+      if (inst->dst && !used[inst->dst]) {
+        if (!has_side_effect(inst->op)) {
+          *p = inst->next;
+          continue;
+        }
+        inst->dst = 0;
+      }
+      p = &inst->next;
+    }
+  }
+}
+
+void optimize_ir(IrFunc *f) {
+  cur_fn = f;
+
+  build_cfg();
+  build_dominators();
+  build_defs();
+  mem2reg();
+  simplify();
+  cse();
+  simplify();
+  dce();
+}
+
+// Inserts an instruction right before the terminator of a block.
+static void insert_before_terminator(IrBlock *bb, IrInst *inst) {
+  IrInst **p = &bb->insts;
+  while ((*p)->next)
+    p = &(*p)->next;
+  inst->next = *p;
+  *p = inst;
+}
+
+static void emit_copy(IrBlock *bb, int dst, int src, Token *tok) {
+  IrInst *copy = new_inst(IR_COPY, tok);
+  copy->dst = dst;
+  copy->lhs = src;
+  insert_before_terminator(bb, copy);
+}
+
+// Returns the block where the copies for the edge from `pred` to `bb`
+// go. If `pred` ends with a conditional branch, the edge gets a block
+// of its own, so that the copies don't run on the path to the other
+// successor. Returns NULL if the edge has already been split.
+static IrBlock *edge_block(IrBlock *pred, IrBlock *bb) {
+  IrInst *br = terminator(pred);
+  if (br->op != IR_BR)
+    return pred;
+  if (br->then != bb && br->els != bb)
+    return NULL;
+
+  IrBlock *mid = arena_alloc(&ir_arena, sizeof(IrBlock));
+  mid->id = cur_fn->nblocks++;
+  mid->insts = new_inst(IR_JMP, br->tok);
+  mid->insts->then = bb;
+  mid->next = pred->next;
+  pred->next = mid;
+
+  if (br->then == bb)
+    br->then = mid;
+  if (br->els == bb)
+    br->els = mid;
+  return mid;
+}
+
+// Replaces phis with copies at the end of each predecessor. The
+// copies for one edge happen in parallel, so they are ordered such
+// that no copy overwrites a value that another one has yet to read.
+// A cycle of copies, as in a swap, is broken with a new value.
+void leave_ssa(IrFunc *f) {
+  cur_fn = f;
+
+  for (IrBlock *bb = f->blocks; bb; bb = bb->next) {
+    int nphis = 0;
+    for (IrInst *inst = bb->insts; inst->op == IR_PHI; inst = inst->next)
+      nphis++;
+    if (!nphis)
+      continue;
+
+    int *dst = arena_alloc(&ir_arena, sizeof(int) * nphis);
+    int *src = arena_alloc(&ir_arena, sizeof(int) * nphis);
+
+    for (int i = 0; i < bb->npreds; i++) {
+      IrBlock *pred = edge_block(bb->preds[i], bb);
+      if (!pred)
+        continue;
+
+      int n = 0;
+      for (IrInst *phi = bb->insts; phi->op == IR_PHI; phi = phi->next) {
+        if (phi->dst != phi->args[i]) {
+          dst[n] = phi->dst;
+          src[n++] = phi->args[i];
+        }
+      }
+
+      while (n > 0) {
+        int k = 0;
+        for (; k < n; k++) {
+          bool is_read = false;
+          for (int j = 0; j < n; j++)
+            if (src[j] == dst[k])
+              is_read = true;
+          if (!is_read)
+            break;
+        }
+
+        if (k == n) {
+          // Every destination is still to be read. Move one of them
+          // out of the way.
+          int tmp = new_value(f);
+          emit_copy(pred, tmp, dst[0], bb->insts->tok);
+          for (int j = 0; j < n; j++)
+            if (src[j] == dst[0])
+              src[j] = tmp;
+          continue;
+        }
+
+        emit_copy(pred, dst[k], src[k], bb->insts->tok);
+        dst[k] = dst[n - 1];
+        src[k] = src[n - 1];
+        n--;
+      }
+    }
+
+    while (bb->insts->op == IR_PHI)
+      bb->insts = bb->insts->next;
+  }
+}
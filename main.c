@@ -1,19 +1,97 @@
 #include "chibicc.h"
 
 static char *opt_o;
+static int opt_O;
+static int opt_j = 1;
+static bool opt_stream;
+static bool opt_c;
+static char *opt_cache_dir;
+static int64_t opt_cache_size = (int64_t)1 << 30;
+static bool opt_cache_stats;
+static bool opt_time_report;
+static char *opt_stats;
 
-static char *input_path;
+static char **input_paths;
+static char **output_paths;
+static int input_cnt;
 
 static void usage(int status) {
-  fprintf(stderr, "chibicc [ -o <path> ] <file>\n");
+  fprintf(stderr,
+          "chibicc [ -c ] [ -O<level> ] [ -j <jobs> ] [ --stream ] [ --cache-dir=<dir> ]\n"
+          "        [ --cache-size=<size> ] [ -ftime-report ] [ --stats=<path> ]\n"
+          "        [ -o <path> ] <file>...\n"
+          "chibicc --cache-dir=<dir> --cache-stats\n");
   exit(status);
 }
 
+static int parse_jobs(char *arg) {
+  char *end;
+  long n = strtol(arg, &end, 10);
+  if (*end || n < 1 || n > 1024)
+    error("invalid number of jobs: %s", arg);
+  return n;
+}
+
+// Parses a size in bytes with an optional K, M or G suffix.
+static int64_t parse_size(char *arg) {
+  char *end;
+  int64_t n = strtoll(arg, &end, 10);
+  if (end == arg || n < 0)
+    error("invalid size: %s", arg);
+
+  switch (*end) {
+  case 'K': n <<= 10; end++; break;
+  case 'M': n <<= 20; end++; break;
+  case 'G': n <<= 30; end++; break;
+  }
+  if (*end)
+    error("invalid size: %s", arg);
+  return n;
+}
+
 static void parse_args(int argc, char **argv) {
+  input_paths = calloc(argc, sizeof(char *));
+
   for (int i = 1; i < argc; i++) {
     if (!strcmp(argv[i], "--help"))
       usage(0);
 
+    if (!strcmp(argv[i], "--stream")) {
+      opt_stream = true;
+      continue;
+    }
+
+    if (!strncmp(argv[i], "--cache-dir=", 12)) {
+      opt_cache_dir = argv[i] + 12;
+      continue;
+    }
+
+    if (!strncmp(argv[i], "--cache-size=", 13)) {
+      opt_cache_size = parse_size(argv[i] + 13);
+      continue;
+    }
+
+    if (!strcmp(argv[i], "--cache-stats")) {
+      opt_cache_stats = true;
+      continue;
+    }
+
+    if (!strcmp(argv[i], "-ftime-report")) {
+      opt_time_report = true;
+      continue;
+    }
+
+    // Writes the same statistics as -ftime-report in JSON.
+    if (!strncmp(argv[i], "--stats=", 8)) {
+      opt_stats = argv[i] + 8;
+      continue;
+    }
+
+    if (!strcmp(argv[i], "-c")) {
+      opt_c = true;
+      continue;
+    }
+
     if (!strcmp(argv[i], "-o")) {
       if (!argv[++i])
         usage(1);
@@ -21,19 +99,57 @@ static void parse_args(int argc, char **argv) {
       continue;
     }
 
+    // -O0 disables optimizations on the IR, and -O, -O1 or any higher
+    // level enables them.
+    if (!strncmp(argv[i], "-O", 2) && (!argv[i][2] || isdigit(argv[i][2]))) {
+      opt_O = argv[i][2] ? (atoi(argv[i] + 2) > 0) : 1;
+      continue;
+    }
+
     if (!strncmp(argv[i], "-o", 2)) {
       opt_o = argv[i] + 2;
       continue;
     }
 
+    if (!strcmp(argv[i], "-j")) {
+      if (!argv[++i])
+        usage(1);
+      opt_j = parse_jobs(argv[i]);
+      continue;
+    }
+
+    if (!strncmp(argv[i], "-j", 2)) {
+      opt_j = parse_jobs(argv[i] + 2);
+      continue;
+    }
+
     if (argv[i][0] == '-' && argv[i][1] != '\0')
       error("unknown argument: %s", argv[i]);
 
-    input_path = argv[i];
+    input_paths[input_cnt++] = argv[i];
   }
 
-  if (!input_path)
+  if (opt_cache_stats && !opt_cache_dir)
+    error("--cache-stats requires --cache-dir");
+  if (input_cnt == 0 && !opt_cache_stats)
     error("no input files");
+  if (input_cnt > 1 && opt_o)
+    error("cannot specify -o with multiple files");
+}
+
+// Returns the default output path for a given input. As with `cc -S`
+// and `cc -c`, "dir/foo.c" is compiled to "foo.s" or "foo.o" in the
+// current directory.
+static char *replace_extn(char *path, char *extn) {
+  if (!strcmp(path, "-"))
+    return "-";
+
+  char *base = strrchr(path, '/');
+  base = base ? base + 1 : path;
+
+  char *dot = strrchr(base, '.');
+  int len = dot ? dot - base : strlen(base);
+  return format("%.*s%s", len, base, extn);
 }
 
 static FILE *open_file(char *path) {
@@ -46,16 +162,204 @@ static FILE *open_file(char *path) {
   return out;
 }
 
+// Output of the file being compiled in streaming mode
+static _Thread_local FILE *stream_out;
+
+static void emit_streamed(Obj *fn) {
+  Phase prev = stats_phase(PHASE_OPTIMIZE);
+  optimize_function(fn);
+  stats_phase(PHASE_CODEGEN);
+  codegen_function(fn, stream_out, opt_O);
+  stats_phase(prev);
+}
+
+static FILE *open_output(char *input_path, char *output_path) {
+  FILE *out = open_file(output_path);
+  fprintf(out, ".file 1 \"%s\"\n", input_path);
+  return out;
+}
+
+static void close_file(FILE *out) {
+  if (out != stdout)
+    fclose(out);
+}
+
+// Compiles a given input to `out`. If `out` is NULL, the output file
+// is opened after parsing, so that it isn't created if there's an
+// error in the input. Returns the stream written to.
+static FILE *compile_input(char *input_path, char *input, char *output_path,
+                           FILE *out, int njobs) {
+  stats_phase(PHASE_TOKENIZE);
+
+  if (opt_stream) {
+    // Emit each function as soon as it is parsed, so that only one
+    // function body is in memory at a time. Data follows the code.
+    Token *tok = tokenize_first(input_path, input);
+    stream_out = out ? out : open_output(input_path, output_path);
+    stats_phase(PHASE_PARSE);
+    Obj *prog = parse(tok, emit_streamed);
+    stats_phase(PHASE_CODEGEN);
+    codegen_data(prog, stream_out);
+    stats_phase(PHASE_NONE);
+    return stream_out;
+  }
+
+  Token *tok = tokenize(input_path, input);
+  stats_phase(PHASE_PARSE);
+  Obj *prog = parse(tok, NULL);
+  stats_phase(PHASE_OPTIMIZE);
+  optimize(prog, opt_O);
+
+  // Traverse the AST to emit assembly.
+  if (!out)
+    out = open_output(input_path, output_path);
+  stats_phase(PHASE_CODEGEN);
+  codegen(prog, out, opt_O, njobs);
+  stats_phase(PHASE_NONE);
+  return out;
+}
+
+// Writes the assembly of a given input to its output file. With -c,
+// the assembly is assembled to an object file instead.
+static void write_output(char *input_path, char *output_path, char *buf, size_t len) {
+  if (!opt_c) {
+    FILE *out = open_output(input_path, output_path);
+    fwrite(buf, 1, len, out);
+    close_file(out);
+    return;
+  }
+
+  char *text;
+  size_t textlen;
+  FILE *mem = open_memstream(&text, &textlen);
+  fprintf(mem, ".file 1 \"%s\"\n", input_path);
+  fwrite(buf, 1, len, mem);
+  fclose(mem);
+
+  FILE *out = open_file(output_path);
+  stats_phase(PHASE_ASSEMBLE);
+  assemble(text, out);
+  stats_phase(PHASE_NONE);
+  close_file(out);
+  free(text);
+}
+
+static void compile(char *input_path, char *output_path, int njobs) {
+  size_t mapped;
+  char *input = read_file(input_path, &mapped);
+
+  if (!cache_enabled() && !opt_c) {
+    close_file(compile_input(input_path, input, output_path, NULL, njobs));
+  } else {
+    // The .file directive is not part of the cached output, so that
+    // the same input under a different name hits the same entry.
+    // Entries hold assembly even with -c.
+    char *key = NULL;
+    size_t len;
+    char *buf = NULL;
+
+    if (cache_enabled()) {
+      char *flags = format("-O%d%s", opt_O, opt_stream ? " --stream" : "");
+      key = cache_key(input, flags);
+      buf = cache_get(key, &len);
+      free(flags);
+    }
+
+    if (!buf) {
+      FILE *mem = open_memstream(&buf, &len);
+      compile_input(input_path, input, output_path, mem, njobs);
+      fclose(mem);
+      if (key)
+        cache_put(key, buf, len);
+    }
+
+    write_output(input_path, output_path, buf, len);
+    free(buf);
+    free(key);
+  }
+
+  // Nothing of this file is referenced anymore. The state of the
+  // compiler itself is thread-local, so it is reset by the next call
+  // to tokenize() and parse() on this thread. Interned types live in
+  // type_arena, so they are forgotten with it. Identifiers are
+  // interned into a table of their own, which goes with the input.
+  free_file(input, mapped);
+  free_interned();
+  arena_free(&parse_arena);
+  arena_free(&func_arena);
+  arena_free(&type_arena);
+  arena_free(&ir_arena);
+  reset_types();
+}
+
+static int next_input;
+static pthread_mutex_t input_lock = PTHREAD_MUTEX_INITIALIZER;
+
+// Compiles input files until there are none left.
+static void *worker(void *arg) {
+  for (;;) {
+    pthread_mutex_lock(&input_lock);
+    int i = next_input++;
+    pthread_mutex_unlock(&input_lock);
+
+    if (i >= input_cnt) {
+      stats_merge();
+      return NULL;
+    }
+    compile(input_paths[i], output_paths[i], 1);
+  }
+}
+
+static void finish(void) {
+  cache_finish();
+  stats_merge();
+
+  if (opt_time_report)
+    stats_print(stderr);
+
+  if (opt_stats) {
+    FILE *out = open_file(opt_stats);
+    stats_print_json(out);
+    close_file(out);
+  }
+}
+
 int main(int argc, char **argv) {
   parse_args(argc, argv);
 
-  // Tokenize and parse.
-  Token *tok = tokenize_file(input_path);
-  Obj *prog = parse(tok);
+  if (opt_time_report || opt_stats)
+    stats_init();
 
-  // Traverse the AST to emit assembly.
-  FILE *out = open_file(opt_o);
-  fprintf(out, ".file 1 \"%s\"\n", input_path);
-  codegen(prog, out);
+  if (opt_cache_dir)
+    cache_init(opt_cache_dir, opt_cache_size);
+
+  if (opt_cache_stats) {
+    cache_print_stats(stdout);
+    return 0;
+  }
+
+  // With -j, the functions of a single file are compiled in parallel.
+  // Multiple files are compiled in parallel instead.
+  if (input_cnt == 1) {
+    char *output = opt_o;
+    if (!output && opt_c)
+      output = replace_extn(input_paths[0], ".o");
+    compile(input_paths[0], output, opt_j);
+    finish();
+    return 0;
+  }
+
+  output_paths = calloc(input_cnt, sizeof(char *));
+  for (int i = 0; i < input_cnt; i++)
+    output_paths[i] = replace_extn(input_paths[i], opt_c ? ".o" : ".s");
+
+  int nthreads = MIN(opt_j, input_cnt);
+  pthread_t *threads = calloc(nthreads, sizeof(pthread_t));
+  for (int i = 0; i < nthreads; i++)
+    if (pthread_create(&threads[i], NULL, worker, NULL))
+      error("cannot create a thread");
+  for (int i = 0; i < nthreads; i++)
+    pthread_join(threads[i], NULL);
+  finish();
   return 0;
 }
@@ -0,0 +1,450 @@
+// This file contains an optimization pass over the AST which runs
+// between parse() and codegen().
+//
+// The parser creates a node for every operator it reads, even if the
+// operands are all constants. That's common in particular for pointer
+// arithmetic: `p + 1` becomes `p + 1 * sizeof(*p)`. This pass folds
+// such constant subtrees and removes operations that don't change
+// their operand, such as `x * 1` or `x + 0`.
+//
+// Arithmetic is done in 64 bits as codegen does, so a folded
+// expression evaluates to the same value as the unfolded one.
+//
+// At -O1, calls to small functions of the same file are inlined
+// before folding, so that the inlined code is folded as well.
+
+#include "chibicc.h"
+
+static bool is_num(Node *node, int64_t val) {
+  return node->kind == ND_NUM && node->val == val;
+}
+
+// Turns a node into a numeric literal while keeping its type. Any
+// operator node is large enough to hold a literal.
+static void to_num(Node *node, int64_t val) {
+  node->kind = ND_NUM;
+  node->val = val;
+}
+
+// Replaces `node` with its operand `expr`.
+static Node *replace(Node *node, Node *expr) {
+  expr->next = node->next;
+  return expr;
+}
+
+// Evaluates a binary operator with constant operands. Returns false
+// if the result is not well-defined at compile time.
+static bool eval_binary(Node *node, int64_t *val) {
+  uint64_t x = node->lhs->val;
+  uint64_t y = node->rhs->val;
+
+  switch (node->kind) {
+  case ND_ADD: *val = x + y; return true;
+  case ND_SUB: *val = x - y; return true;
+  case ND_MUL: *val = x * y; return true;
+  case ND_DIV:
+    if (y == 0 || (x == INT64_MIN && y == -1))
+      return false;
+    *val = (int64_t)x / (int64_t)y;
+    return true;
+  case ND_EQ: *val = (int64_t)x == (int64_t)y; return true;
+  case ND_NE: *val = (int64_t)x != (int64_t)y; return true;
+  case ND_LT: *val = (int64_t)x < (int64_t)y; return true;
+  case ND_LE: *val = (int64_t)x <= (int64_t)y; return true;
+  }
+  return false;
+}
+
+static Node *fold(Node *node) {
+  if (!node)
+    return NULL;
+
+  switch (node->kind) {
+  case ND_NUM:
+  case ND_VAR:
+    return node;
+  case ND_IF:
+  case ND_FOR:
+    node->cond = fold(node->cond);
+    node->then = fold(node->then);
+    node->els = fold(node->els);
+    node->init = fold(node->init);
+    node->inc = fold(node->inc);
+    return node;
+  case ND_BLOCK:
+  case ND_STMT_EXPR:
+    for (Node **p = &node->body; *p; p = &(*p)->next)
+      *p = fold(*p);
+    return node;
+  case ND_FUNCALL:
+    for (Node **p = &node->args; *p; p = &(*p)->next)
+      *p = fold(*p);
+    return node;
+  case ND_MEMBER:
+    node->lhs = fold(node->lhs);
+    return node;
+  }
+
+  node->lhs = fold(node->lhs);
+  node->rhs = fold(node->rhs);
+
+  Node *lhs = node->lhs;
+  Node *rhs = node->rhs;
+
+  switch (node->kind) {
+  case ND_NEG:
+    if (lhs->kind == ND_NUM)
+      to_num(node, -(uint64_t)lhs->val);
+    return node;
+  case ND_ADD:
+  case ND_SUB:
+  case ND_MUL:
+  case ND_DIV:
+  case ND_EQ:
+  case ND_NE:
+  case ND_LT:
+  case ND_LE: {
+    int64_t val;
+    if (lhs->kind == ND_NUM && rhs->kind == ND_NUM && eval_binary(node, &val)) {
+      to_num(node, val);
+      return node;
+    }
+    break;
+  }
+  default:
+    return node;
+  }
+
+  switch (node->kind) {
+  case ND_ADD:
+    // x + 0 and 0 + x
+    if (is_num(rhs, 0))
+      return replace(node, lhs);
+    if (is_num(lhs, 0) && rhs->ty->kind == node->ty->kind)
+      return replace(node, rhs);
+
+    // (x + c1) + c2 => x + (c1 + c2)
+    if (lhs->kind == ND_ADD && lhs->rhs->kind == ND_NUM && rhs->kind == ND_NUM) {
+      rhs->val = (uint64_t)lhs->rhs->val + rhs->val;
+      node->lhs = lhs->lhs;
+    }
+    return node;
+  case ND_SUB:
+    // x - 0
+    if (is_num(rhs, 0) && lhs->ty->kind == node->ty->kind)
+      return replace(node, lhs);
+    return node;
+  case ND_MUL:
+    // x * 1 and 1 * x
+    if (is_num(rhs, 1))
+      return replace(node, lhs);
+    if (is_num(lhs, 1))
+      return replace(node, rhs);
+
+    // (x * c1) * c2 => x * (c1 * c2)
+    if (lhs->kind == ND_MUL && lhs->rhs->kind == ND_NUM && rhs->kind == ND_NUM) {
+      rhs->val = (uint64_t)lhs->rhs->val * rhs->val;
+      node->lhs = lhs->lhs;
+    }
+    return node;
+  case ND_DIV:
+    // x / 1
+    if (is_num(rhs, 1))
+      return replace(node, lhs);
+    return node;
+  }
+  return node;
+}
+
+//
+// Inlining
+//
+// A function whose body is `return E;` with a small E is inlined by
+// replacing a call `f(a, b)` with `(x' = a, y' = b, E')`, where x' and
+// y' are new locals of the caller standing for the parameters, and E'
+// is a copy of E that refers to them. Assigning the arguments keeps
+// their evaluation order and converts them to the parameter types as
+// the callee's prologue would.
+//
+
+// Max number of nodes in E
+#define INLINE_MAX_NODES 32
+
+// Max depth of calls inlined into inlined code, which also stops the
+// expansion of a recursive function.
+#define INLINE_MAX_DEPTH 4
+
+// Function definitions that may be inlined, keyed by name
+static _Thread_local HashMap candidates;
+
+// Function being optimized, which receives the new locals
+static _Thread_local Obj *current_fn;
+static _Thread_local int inline_cnt;
+
+// Parameters of an inlined function and the locals that replace them
+typedef struct {
+  Obj *params[6];
+  Obj *vars[6];
+  int len;
+} VarMap;
+
+static bool is_scalar(Type *ty) {
+  return is_integer(ty) || ty->kind == TY_PTR;
+}
+
+static bool is_param(Obj *fn, Obj *var) {
+  for (Obj *param = fn->params; param; param = param->next)
+    if (param == var)
+      return true;
+  return false;
+}
+
+// Returns true if an expression of `fn` can be copied into another
+// function, adding its size to `*cost`. It can't if it refers to a
+// local other than a parameter, which needs the callee's frame, or if
+// it contains a `return`, which would leave the caller.
+static bool can_copy(Obj *fn, Node *node, int *cost) {
+  if (!node)
+    return true;
+  if (++*cost > INLINE_MAX_NODES)
+    return false;
+
+  switch (node->kind) {
+  case ND_NUM:
+    return true;
+  case ND_VAR:
+    return !node->var->is_local || is_param(fn, node->var);
+  case ND_RETURN:
+    return false;
+  case ND_IF:
+  case ND_FOR:
+    return can_copy(fn, node->cond, cost) && can_copy(fn, node->then, cost) &&
+           can_copy(fn, node->els, cost) && can_copy(fn, node->init, cost) &&
+           can_copy(fn, node->inc, cost);
+  case ND_BLOCK:
+  case ND_STMT_EXPR:
+    for (Node *n = node->body; n; n = n->next)
+      if (!can_copy(fn, n, cost))
+        return false;
+    return true;
+  case ND_FUNCALL:
+    for (Node *n = node->args; n; n = n->next)
+      if (!can_copy(fn, n, cost))
+        return false;
+    return true;
+  case ND_MEMBER:
+    return can_copy(fn, node->lhs, cost);
+  }
+  return can_copy(fn, node->lhs, cost) && can_copy(fn, node->rhs, cost);
+}
+
+static Node *copy_expr(Node *node, VarMap *map);
+
+static Node *copy_list(Node *node, VarMap *map) {
+  Node head = {};
+  Node *cur = &head;
+  for (; node; node = node->next)
+    cur = cur->next = copy_expr(node, map);
+  return head.next;
+}
+
+// Copies an expression that passed can_copy().
+static Node *copy_expr(Node *node, VarMap *map) {
+  if (!node)
+    return NULL;
+
+  node = copy_node(node);
+  node->next = NULL;
+
+  switch (node->kind) {
+  case ND_NUM:
+    return node;
+  case ND_VAR:
+    for (int i = 0; i < map->len; i++)
+      if (node->var == map->params[i])
+        node->var = map->vars[i];
+    return node;
+  case ND_IF:
+  case ND_FOR:
+    node->cond = copy_expr(node->cond, map);
+    node->then = copy_expr(node->then, map);
+    node->els = copy_expr(node->els, map);
+    node->init = copy_expr(node->init, map);
+    node->inc = copy_expr(node->inc, map);
+    return node;
+  case ND_BLOCK:
+  case ND_STMT_EXPR:
+    node->body = copy_list(node->body, map);
+    return node;
+  case ND_FUNCALL:
+    node->args = copy_list(node->args, map);
+    return node;
+  case ND_MEMBER:
+    node->lhs = copy_expr(node->lhs, map);
+    return node;
+  }
+
+  node->lhs = copy_expr(node->lhs, map);
+  node->rhs = copy_expr(node->rhs, map);
+  return node;
+}
+
+// Returns the expression returned by `fn` if it may be inlined.
+static Node *inline_body(Obj *fn) {
+  Node *stmt = fn->body ? fn->body->body : NULL;
+  if (!stmt || stmt->next || stmt->kind != ND_RETURN || !is_scalar(stmt->lhs->ty))
+    return NULL;
+
+  int nparams = 0;
+  for (Obj *param = fn->params; param; param = param->next, nparams++)
+    if (!is_scalar(param->ty))
+      return NULL;
+  if (nparams > 6)
+    return NULL;
+  return stmt->lhs;
+}
+
+// Creates a local of the current function for a parameter of an
+// inlined function. It may share no stack slot with other locals, as
+// it is live wherever the call is.
+static Obj *new_inline_var(Obj *fn, Obj *param) {
+  Obj *var = arena_alloc(&parse_arena, sizeof(Obj));
+  stats.nobjs++;
+  var->name = format("%s.%s.%d", fn->name, param->name, inline_cnt);
+  var->ty = param->ty;
+  var->is_local = true;
+  var->live_begin = 0;
+  var->live_end = INT32_MAX;
+  var->next = current_fn->locals;
+  current_fn->locals = var;
+  return var;
+}
+
+static Node *new_var_node(Obj *var, Token *tok) {
+  Node *node = new_node(ND_VAR, tok);
+  node->var = var;
+  node->ty = var->ty;
+  return node;
+}
+
+static Node *new_binary(NodeKind kind, Node *lhs, Node *rhs, Type *ty, Token *tok) {
+  Node *node = new_node(kind, tok);
+  node->lhs = lhs;
+  node->rhs = rhs;
+  node->ty = ty;
+  return node;
+}
+
+static Node *inline_calls(Node *node, int depth);
+
+static Node *inline_call(Node *node, int depth) {
+  if (depth >= INLINE_MAX_DEPTH)
+    return node;
+
+  Obj *fn = hashmap_get(&candidates, node->funcname);
+  if (!fn)
+    return node;
+
+  // The body may have changed by inlining into it, so check it at
+  // each call.
+  Node *ret = fn->body->body->lhs;
+  int cost = 0;
+  if (!can_copy(fn, ret, &cost))
+    return node;
+
+  VarMap map = {};
+  Node *arg = node->args;
+  for (Obj *param = fn->params; param; param = param->next, arg = arg->next) {
+    if (!arg)
+      return node;
+    map.params[map.len++] = param;
+  }
+  if (arg)
+    return node;
+
+  inline_cnt++;
+  for (int i = 0; i < map.len; i++)
+    map.vars[i] = new_inline_var(fn, map.params[i]);
+
+  Node *expr = inline_calls(copy_expr(ret, &map), depth + 1);
+
+  // Prepend the argument assignments in reverse so that the first
+  // argument is evaluated first.
+  Node *args[6];
+  arg = node->args;
+  for (int i = 0; i < map.len; i++, arg = arg->next)
+    args[i] = arg;
+
+  for (int i = map.len - 1; i >= 0; i--) {
+    Node *lhs = new_var_node(map.vars[i], node->tok);
+    Node *assign = new_binary(ND_ASSIGN, lhs, args[i], lhs->ty, node->tok);
+    args[i]->next = NULL;
+    expr = new_binary(ND_COMMA, assign, expr, expr->ty, node->tok);
+  }
+  return replace(node, expr);
+}
+
+// Inlines calls in a given tree, of which the outermost `depth` levels
+// were inlined already.
+static Node *inline_calls(Node *node, int depth) {
+  if (!node)
+    return NULL;
+
+  switch (node->kind) {
+  case ND_NUM:
+  case ND_VAR:
+    return node;
+  case ND_IF:
+  case ND_FOR:
+    node->cond = inline_calls(node->cond, depth);
+    node->then = inline_calls(node->then, depth);
+    node->els = inline_calls(node->els, depth);
+    node->init = inline_calls(node->init, depth);
+    node->inc = inline_calls(node->inc, depth);
+    return node;
+  case ND_BLOCK:
+  case ND_STMT_EXPR:
+    for (Node **p = &node->body; *p; p = &(*p)->next)
+      *p = inline_calls(*p, depth);
+    return node;
+  case ND_FUNCALL:
+    for (Node **p = &node->args; *p; p = &(*p)->next)
+      *p = inline_calls(*p, depth);
+    return inline_call(node, depth);
+  case ND_MEMBER:
+    node->lhs = inline_calls(node->lhs, depth);
+    return node;
+  }
+
+  node->lhs = inline_calls(node->lhs, depth);
+  node->rhs = inline_calls(node->rhs, depth);
+  return node;
+}
+
+void optimize_function(Obj *fn) {
+  fn->body = fold(fn->body);
+}
+
+// If `inline_fns` is true, also inlines calls between functions of the
+// program. That needs all function bodies, so it isn't done in
+// streaming mode, which calls optimize_function() as soon as a
+// function is parsed.
+void optimize(Obj *prog, bool inline_fns) {
+  if (inline_fns) {
+    free(candidates.buckets);
+    candidates = (HashMap){};
+    for (Obj *fn = prog; fn; fn = fn->next)
+      if (fn->is_function && fn->is_definition && inline_body(fn))
+        hashmap_put(&candidates, fn->name, fn);
+  }
+
+  for (Obj *fn = prog; fn; fn = fn->next) {
+    if (!fn->is_function || !fn->is_definition)
+      continue;
+    if (inline_fns) {
+      current_fn = fn;
+      fn->body = inline_calls(fn->body, 0);
+    }
+    optimize_function(fn);
+  }
+}
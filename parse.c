@@ -24,6 +24,7 @@ struct VarScope {
   VarScope *next;
   char *name;
   Obj *var;
+  VarScope *shadow; // Outer declaration hidden by this one
 };
 
 // Scope for struct tags;
@@ -32,6 +33,7 @@ struct TagScope {
   TagScope *next;
   char *name;
   Type *ty;
+  TagScope *shadow; // Outer declaration hidden by this one
 };
 
 // Represents a block scope.
@@ -42,34 +44,58 @@ struct Scope {
   // for struct tags.
   VarScope *vars;
   TagScope *tags;
+
+  // Head of `locals` when this scope was entered. Variables between
+  // it and the current head were declared in this scope.
+  Obj *locals;
 };
 
 // All local variable instances created during parsing are
 // accumulated to this list.
-static Obj *locals;
-static Obj *globals;
+static _Thread_local Obj *locals;
+static _Thread_local Obj *globals;
+
+static _Thread_local Scope *scope;
+
+// Nodes, locals and scope records are allocated from this arena. In
+// streaming mode, it is func_arena while a function body is parsed, so
+// that they are released as soon as the function is compiled.
+static _Thread_local Arena *local_arena;
 
-static Scope *scope = &(Scope){};
+// Called with each function definition in streaming mode
+static _Thread_local void (*emit_fn)(Obj *fn);
+
+// Incremented whenever a local is declared or a scope is left, so
+// that [live_begin, live_end] of locals form properly nested intervals.
+static _Thread_local int tick;
+
+// Innermost visible declaration of each variable and tag name.
+// A declaration in an inner scope replaces the entry for its name
+// until leave_scope() puts back the declaration it shadowed, so a
+// lookup is a single hash probe regardless of the scope depth.
+static _Thread_local HashMap var_map;
+static _Thread_local HashMap tag_map;
 
 static Type *find_tag(Token *tok){
-    for(Scope *sc = scope; sc; sc = sc->next)
-        for(TagScope *ts = sc->tags; ts; ts = ts->next){
-            if(equal(tok, ts->name))
-                return ts->ty;
-        }
-    return NULL;
+    int64_t nprobes = hashmap_nprobes;
+    TagScope *sc = hashmap_get2(&tag_map, tok_name(tok), tok->len);
+    stats.tag_lookups++;
+    stats.tag_probes += hashmap_nprobes - nprobes;
+    return sc ? sc->ty : NULL;
 }
 
 static void push_tag_scope(Token *tok, Type *ty){
-    TagScope *sc = calloc(1, sizeof(TagScope));
-    sc->name = strndup(tok->loc, tok->len);
+    TagScope *sc = arena_alloc(local_arena, sizeof(TagScope));
+    sc->name = tok_name(tok);
     sc->ty = ty;
+    sc->shadow = hashmap_get2(&tag_map, tok_name(tok), tok->len);
     sc->next = scope->tags;
     scope->tags = sc;
+    hashmap_put2(&tag_map, tok_name(tok), tok->len, sc);
 }
 
 static Type *declspec(Token **rest, Token *tok);
-static Type *declarator(Token **rest, Token *tok, Type *ty);
+static Type *declarator(Token **rest, Token *tok, Type *ty, Token **name);
 static Node *declaration(Token **rest, Token *tok);
 static Node *compound_stmt(Token **rest, Token *tok);
 static Node *stmt(Token **rest, Token *tok);
@@ -87,31 +113,65 @@ static Node *unary(Token **rest, Token *tok);
 static Node *primary(Token **rest, Token *tok);
 
 static void enter_scope(void) {
-  Scope *sc = calloc(1, sizeof(Scope));
+  Scope *sc = arena_alloc(local_arena, sizeof(Scope));
   sc->next = scope;
+  sc->locals = locals;
   scope = sc;
 }
 
 static void leave_scope(void) {
+  tick++;
+  for (Obj *var = locals; var != scope->locals; var = var->next)
+    if (!var->live_end)
+      var->live_end = tick;
+
+  for (VarScope *sc = scope->vars; sc; sc = sc->next)
+    hashmap_put(&var_map, sc->name, sc->shadow);
+  for (TagScope *sc = scope->tags; sc; sc = sc->next)
+    hashmap_put(&tag_map, sc->name, sc->shadow);
   scope = scope->next;
 }
 
 // Find a variable by name.
 static Obj *find_var(Token *tok) {
-  for (Scope *sc = scope; sc; sc = sc->next)
-    for (VarScope *sc2 = sc->vars; sc2; sc2 = sc2->next)
-      if (equal(tok, sc2->name))
-        return sc2->var;
-  return NULL;
+  int64_t nprobes = hashmap_nprobes;
+  VarScope *sc = hashmap_get2(&var_map, tok_name(tok), tok->len);
+  stats.var_lookups++;
+  stats.var_probes += hashmap_nprobes - nprobes;
+  return sc ? sc->var : NULL;
 }
 
-static Node *new_node(NodeKind kind, Token *tok) {
-  Node *node = calloc(1, sizeof(Node));
+// Returns the number of bytes that a node of a given kind uses.
+static int node_size(NodeKind kind) {
+  switch (kind) {
+  case ND_IF:
+  case ND_FOR:
+    return sizeof(Node);
+  case ND_NUM:
+  case ND_VAR:
+  case ND_BLOCK:
+  case ND_STMT_EXPR:
+    return offsetof(Node, val) + sizeof(int64_t);
+  default:
+    return offsetof(Node, rhs) + sizeof(Node *);
+  }
+}
+
+Node *new_node(NodeKind kind, Token *tok) {
+  Node *node = arena_alloc(local_arena, node_size(kind));
+  stats.nnodes++;
   node->kind = kind;
   node->tok = tok;
   return node;
 }
 
+// Returns a shallow copy of a node.
+Node *copy_node(Node *node) {
+  Node *copy = new_node(node->kind, node->tok);
+  memcpy(copy, node, node_size(node->kind));
+  return copy;
+}
+
 static Node *new_binary(NodeKind kind, Node *lhs, Node *rhs, Token *tok) {
   Node *node = new_node(kind, tok);
   node->lhs = lhs;
@@ -138,16 +198,19 @@ static Node *new_var_node(Obj *var, Token *tok) {
 }
 
 static VarScope *push_scope(char *name, Obj *var) {
-  VarScope *sc = calloc(1, sizeof(VarScope));
+  VarScope *sc = arena_alloc(local_arena, sizeof(VarScope));
   sc->name = name;
   sc->var = var;
+  sc->shadow = hashmap_get(&var_map, name);
   sc->next = scope->vars;
   scope->vars = sc;
+  hashmap_put(&var_map, name, sc);
   return sc;
 }
 
-static Obj *new_var(char *name, Type *ty) {
-  Obj *var = calloc(1, sizeof(Obj));
+static Obj *new_var(Arena *arena, char *name, Type *ty) {
+  Obj *var = arena_alloc(arena, sizeof(Obj));
+  stats.nobjs++;
   var->name = name;
   var->ty = ty;
   push_scope(name, var);
@@ -155,74 +218,85 @@ static Obj *new_var(char *name, Type *ty) {
 }
 
 static Obj *new_lvar(char *name, Type *ty) {
-  Obj *var = new_var(name, ty);
+  Obj *var = new_var(local_arena, name, ty);
   var->is_local = true;
+  var->live_begin = ++tick;
   var->next = locals;
   locals = var;
   return var;
 }
 
 static Obj *new_gvar(char *name, Type *ty) {
-  Obj *var = new_var(name, ty);
+  Obj *var = new_var(&parse_arena, name, ty);
   var->next = globals;
   globals = var;
   return var;
 }
 
+static _Thread_local int unique_id;
+
 static char *new_unique_name(void) {
-  static int id = 0;
-  return format(".L..%d", id++);
+  return format(".L..%d", unique_id++);
 }
 
 static Obj *new_anon_gvar(Type *ty) {
   return new_gvar(new_unique_name(), ty);
 }
 
+// String literals with the same contents share a single object.
+static _Thread_local HashMap string_literals;
+
 static Obj *new_string_literal(char *p, Type *ty) {
-  Obj *var = new_anon_gvar(ty);
+  Obj *var = hashmap_get2(&string_literals, p, ty->size);
+  if (var)
+    return var;
+
+  var = new_anon_gvar(ty);
   var->init_data = p;
+  var->is_readonly = true;
+  hashmap_put2(&string_literals, p, ty->size, var);
   return var;
 }
 
 static char *get_ident(Token *tok) {
   if (tok->kind != TK_IDENT)
     error_tok(tok, "expected an identifier");
-  return strndup(tok->loc, tok->len);
+  return tok_name(tok);
 }
 
 static int get_number(Token *tok) {
   if (tok->kind != TK_NUM)
     error_tok(tok, "expected a number");
-  return tok->val;
+  return tok_val(tok);
 }
 
 // declspec = "void" | "char" | "short" | "int" | "long" | struct-decl | union-decl
 static Type *declspec(Token **rest, Token *tok) {
-  if (equal(tok, "void")) {
-    *rest = tok->next;
+  if (is_keyword(tok, KW_VOID)) {
+    *rest = tok + 1;
     return ty_void;
   }
-  if (equal(tok, "char")) {
-    *rest = tok->next;
+  if (is_keyword(tok, KW_CHAR)) {
+    *rest = tok + 1;
     return ty_char;
   }
-  if (equal(tok, "short")) {
-    *rest = tok->next;
+  if (is_keyword(tok, KW_SHORT)) {
+    *rest = tok + 1;
     return ty_short;
   }
-  if (equal(tok, "int")) {
-    *rest = tok->next;
+  if (is_keyword(tok, KW_INT)) {
+    *rest = tok + 1;
     return ty_int;
   }
-  if (equal(tok, "long")) {
-    *rest = tok->next;
+  if (is_keyword(tok, KW_LONG)) {
+    *rest = tok + 1;
     return ty_long;
   }
-  if (equal(tok, "struct"))
-    return struct_decl(rest, tok->next);
+  if (is_keyword(tok, KW_STRUCT))
+    return struct_decl(rest, tok + 1);
 
-  if (equal(tok, "union"))
-    return union_decl(rest, tok->next);
+  if (is_keyword(tok, KW_UNION))
+    return union_decl(rest, tok + 1);
 
   error_tok(tok, "typename expected");
 }
@@ -230,20 +304,23 @@ static Type *declspec(Token **rest, Token *tok) {
 // func-params = (param ("," param)*)? ")"
 // param       = declspec declarator
 static Type *func_params(Token **rest, Token *tok, Type *ty) {
-  Type head = {};
-  Type *cur = &head;
+  Param head = {};
+  Param *cur = &head;
 
-  while (!equal(tok, ")")) {
+  while (!is_punct(tok, ')')) {
     if (cur != &head)
-      tok = skip(tok, ",");
+      tok = skip_punct(tok, ',');
     Type *basety = declspec(&tok, tok);
-    Type *ty = declarator(&tok, tok, basety);
-    cur = cur->next = copy_type(ty);
+    Param *param = arena_alloc(&type_arena, sizeof(Param));
+    Token *name;
+    param->ty = declarator(&tok, tok, basety, &name);
+    param->name = tok_name(name);
+    cur = cur->next = param;
   }
 
   ty = func_type(ty);
   ty->params = head.next;
-  *rest = tok->next;
+  *rest = tok + 1;
   return ty;
 }
 
@@ -251,12 +328,12 @@ static Type *func_params(Token **rest, Token *tok, Type *ty) {
 //             | "[" num "]" type-suffix
 //             | ε
 static Type *type_suffix(Token **rest, Token *tok, Type *ty) {
-  if (equal(tok, "("))
-    return func_params(rest, tok->next, ty);
+  if (is_punct(tok, '('))
+    return func_params(rest, tok + 1, ty);
 
-  if (equal(tok, "[")) {
-    int sz = get_number(tok->next);
-    tok = skip(tok->next->next, "]");
+  if (is_punct(tok, '[')) {
+    int sz = get_number(tok + 1);
+    tok = skip_punct(tok + 2, ']');
     ty = type_suffix(rest, tok, ty);
     return array_of(ty, sz);
   }
@@ -266,24 +343,25 @@ static Type *type_suffix(Token **rest, Token *tok, Type *ty) {
 }
 
 // declarator = "*"* ("(" ident ")" | "(" declarator ")" | ident) type-suffix
-static Type *declarator(Token **rest, Token *tok, Type *ty) {
-  while (consume(&tok, tok, "*"))
+//
+// The declared identifier is returned in `name`.
+static Type *declarator(Token **rest, Token *tok, Type *ty, Token **name) {
+  while (consume_punct(&tok, tok, '*'))
     ty = pointer_to(ty);
   
-  if(equal(tok, "(")){
+  if(is_punct(tok, '(')){
     Token *start = tok;
     Type dummy = {};
-    declarator(&tok, start->next, &dummy);
-    tok = skip(tok, ")");
+    declarator(&tok, start + 1, &dummy, name);
+    tok = skip_punct(tok, ')');
     ty = type_suffix(rest, tok, ty);
-    return declarator(&tok, start->next, ty);
+    return declarator(&tok, start + 1, ty, name);
   }
 
   if (tok->kind != TK_IDENT)
     error_tok(tok, "expected a variable name");
-  ty = type_suffix(rest, tok->next, ty);
-  ty->name = tok;
-  return ty;
+  *name = tok;
+  return type_suffix(rest, tok + 1, ty);
 }
 
 // declaration = declspec (declarator ("=" expr)? ("," declarator ("=" expr)?)*)? ";"
@@ -294,39 +372,46 @@ static Node *declaration(Token **rest, Token *tok) {
   Node *cur = &head;
   int i = 0;
 
-  while (!equal(tok, ";")) {
+  while (!is_punct(tok, ';')) {
     if (i++ > 0)
-      tok = skip(tok, ",");
+      tok = skip_punct(tok, ',');
 
-    Type *ty = declarator(&tok, tok, basety);
+    Token *name;
+    Type *ty = declarator(&tok, tok, basety, &name);
     if(ty->kind == TY_VOID)
       error_tok(tok, "variable declared void");
-    Obj *var = new_lvar(get_ident(ty->name), ty);
+    Obj *var = new_lvar(get_ident(name), ty);
 
-    if (!equal(tok, "="))
+    if (!is_punct(tok, '='))
       continue;
 
-    Node *lhs = new_var_node(var, ty->name);
-    Node *rhs = assign(&tok, tok->next);
+    Node *lhs = new_var_node(var, name);
+    Node *rhs = assign(&tok, tok + 1);
     Node *node = new_binary(ND_ASSIGN, lhs, rhs, tok);
     cur = cur->next = new_unary(ND_EXPR_STMT, node, tok);
   }
 
   Node *node = new_node(ND_BLOCK, tok);
   node->body = head.next;
-  *rest = tok->next;
+  *rest = tok + 1;
   return node;
 }
 
 // Returns true if a given token represents a type.
 static bool is_typename(Token *tok) {
-  static char *kw[] = {
-    "void", "char", "short", "int", "long", "struct", "union",
-  };
+  if (tok->kind != TK_KEYWORD)
+    return false;
 
-  for (int i = 0; i < sizeof(kw) / sizeof(*kw); i++)
-    if (equal(tok, kw[i]))
-      return true;
+  switch (tok->id) {
+  case KW_VOID:
+  case KW_CHAR:
+  case KW_SHORT:
+  case KW_INT:
+  case KW_LONG:
+  case KW_STRUCT:
+  case KW_UNION:
+    return true;
+  }
   return false;
 }
 
@@ -337,54 +422,54 @@ static bool is_typename(Token *tok) {
 //      | "{" compound-stmt
 //      | expr-stmt
 static Node *stmt(Token **rest, Token *tok) {
-  if (equal(tok, "return")) {
+  if (is_keyword(tok, KW_RETURN)) {
     Node *node = new_node(ND_RETURN, tok);
-    node->lhs = expr(&tok, tok->next);
-    *rest = skip(tok, ";");
+    node->lhs = expr(&tok, tok + 1);
+    *rest = skip_punct(tok, ';');
     return node;
   }
 
-  if (equal(tok, "if")) {
+  if (is_keyword(tok, KW_IF)) {
     Node *node = new_node(ND_IF, tok);
-    tok = skip(tok->next, "(");
+    tok = skip_punct(tok + 1, '(');
     node->cond = expr(&tok, tok);
-    tok = skip(tok, ")");
+    tok = skip_punct(tok, ')');
     node->then = stmt(&tok, tok);
-    if (equal(tok, "else"))
-      node->els = stmt(&tok, tok->next);
+    if (is_keyword(tok, KW_ELSE))
+      node->els = stmt(&tok, tok + 1);
     *rest = tok;
     return node;
   }
 
-  if (equal(tok, "for")) {
+  if (is_keyword(tok, KW_FOR)) {
     Node *node = new_node(ND_FOR, tok);
-    tok = skip(tok->next, "(");
+    tok = skip_punct(tok + 1, '(');
 
     node->init = expr_stmt(&tok, tok);
 
-    if (!equal(tok, ";"))
+    if (!is_punct(tok, ';'))
       node->cond = expr(&tok, tok);
-    tok = skip(tok, ";");
+    tok = skip_punct(tok, ';');
 
-    if (!equal(tok, ")"))
+    if (!is_punct(tok, ')'))
       node->inc = expr(&tok, tok);
-    tok = skip(tok, ")");
+    tok = skip_punct(tok, ')');
 
     node->then = stmt(rest, tok);
     return node;
   }
 
-  if (equal(tok, "while")) {
+  if (is_keyword(tok, KW_WHILE)) {
     Node *node = new_node(ND_FOR, tok);
-    tok = skip(tok->next, "(");
+    tok = skip_punct(tok + 1, '(');
     node->cond = expr(&tok, tok);
-    tok = skip(tok, ")");
+    tok = skip_punct(tok, ')');
     node->then = stmt(rest, tok);
     return node;
   }
 
-  if (equal(tok, "{"))
-    return compound_stmt(rest, tok->next);
+  if (is_punct(tok, '{'))
+    return compound_stmt(rest, tok + 1);
 
   return expr_stmt(rest, tok);
 }
@@ -397,7 +482,7 @@ static Node *compound_stmt(Token **rest, Token *tok) {
 
   enter_scope();
 
-  while (!equal(tok, "}")) {
+  while (!is_punct(tok, '}')) {
     if (is_typename(tok))
       cur = cur->next = declaration(&tok, tok);
     else
@@ -408,20 +493,20 @@ static Node *compound_stmt(Token **rest, Token *tok) {
   leave_scope();
 
   node->body = head.next;
-  *rest = tok->next;
+  *rest = tok + 1;
   return node;
 }
 
 // expr-stmt = expr? ";"
 static Node *expr_stmt(Token **rest, Token *tok) {
-  if (equal(tok, ";")) {
-    *rest = tok->next;
+  if (is_punct(tok, ';')) {
+    *rest = tok + 1;
     return new_node(ND_BLOCK, tok);
   }
 
   Node *node = new_node(ND_EXPR_STMT, tok);
   node->lhs = expr(&tok, tok);
-  *rest = skip(tok, ";");
+  *rest = skip_punct(tok, ';');
   return node;
 }
 
@@ -429,8 +514,8 @@ static Node *expr_stmt(Token **rest, Token *tok) {
 static Node *expr(Token **rest, Token *tok) {
   Node *node = assign(&tok, tok);
 
-  if (equal(tok, ","))
-    return new_binary(ND_COMMA, node, expr(rest, tok->next), tok);
+  if (is_punct(tok, ','))
+    return new_binary(ND_COMMA, node, expr(rest, tok + 1), tok);
 
   *rest = tok;
   return node;
@@ -440,8 +525,8 @@ static Node *expr(Token **rest, Token *tok) {
 static Node *assign(Token **rest, Token *tok) {
   Node *node = equality(&tok, tok);
 
-  if (equal(tok, "="))
-    return new_binary(ND_ASSIGN, node, assign(rest, tok->next), tok);
+  if (is_punct(tok, '='))
+    return new_binary(ND_ASSIGN, node, assign(rest, tok + 1), tok);
 
   *rest = tok;
   return node;
@@ -454,13 +539,13 @@ static Node *equality(Token **rest, Token *tok) {
   for (;;) {
     Token *start = tok;
 
-    if (equal(tok, "==")) {
-      node = new_binary(ND_EQ, node, relational(&tok, tok->next), start);
+    if (is_punct(tok, PUNCT_EQ)) {
+      node = new_binary(ND_EQ, node, relational(&tok, tok + 1), start);
       continue;
     }
 
-    if (equal(tok, "!=")) {
-      node = new_binary(ND_NE, node, relational(&tok, tok->next), start);
+    if (is_punct(tok, PUNCT_NE)) {
+      node = new_binary(ND_NE, node, relational(&tok, tok + 1), start);
       continue;
     }
 
@@ -476,23 +561,23 @@ static Node *relational(Token **rest, Token *tok) {
   for (;;) {
     Token *start = tok;
 
-    if (equal(tok, "<")) {
-      node = new_binary(ND_LT, node, add(&tok, tok->next), start);
+    if (is_punct(tok, '<')) {
+      node = new_binary(ND_LT, node, add(&tok, tok + 1), start);
       continue;
     }
 
-    if (equal(tok, "<=")) {
-      node = new_binary(ND_LE, node, add(&tok, tok->next), start);
+    if (is_punct(tok, PUNCT_LE)) {
+      node = new_binary(ND_LE, node, add(&tok, tok + 1), start);
       continue;
     }
 
-    if (equal(tok, ">")) {
-      node = new_binary(ND_LT, add(&tok, tok->next), node, start);
+    if (is_punct(tok, '>')) {
+      node = new_binary(ND_LT, add(&tok, tok + 1), node, start);
       continue;
     }
 
-    if (equal(tok, ">=")) {
-      node = new_binary(ND_LE, add(&tok, tok->next), node, start);
+    if (is_punct(tok, PUNCT_GE)) {
+      node = new_binary(ND_LE, add(&tok, tok + 1), node, start);
       continue;
     }
 
@@ -564,13 +649,13 @@ static Node *add(Token **rest, Token *tok) {
   for (;;) {
     Token *start = tok;
 
-    if (equal(tok, "+")) {
-      node = new_add(node, mul(&tok, tok->next), start);
+    if (is_punct(tok, '+')) {
+      node = new_add(node, mul(&tok, tok + 1), start);
       continue;
     }
 
-    if (equal(tok, "-")) {
-      node = new_sub(node, mul(&tok, tok->next), start);
+    if (is_punct(tok, '-')) {
+      node = new_sub(node, mul(&tok, tok + 1), start);
       continue;
     }
 
@@ -586,13 +671,13 @@ static Node *mul(Token **rest, Token *tok) {
   for (;;) {
     Token *start = tok;
 
-    if (equal(tok, "*")) {
-      node = new_binary(ND_MUL, node, unary(&tok, tok->next), start);
+    if (is_punct(tok, '*')) {
+      node = new_binary(ND_MUL, node, unary(&tok, tok + 1), start);
       continue;
     }
 
-    if (equal(tok, "/")) {
-      node = new_binary(ND_DIV, node, unary(&tok, tok->next), start);
+    if (is_punct(tok, '/')) {
+      node = new_binary(ND_DIV, node, unary(&tok, tok + 1), start);
       continue;
     }
 
@@ -604,17 +689,17 @@ static Node *mul(Token **rest, Token *tok) {
 // unary = ("+" | "-" | "*" | "&") unary
 //       | postfix
 static Node *unary(Token **rest, Token *tok) {
-  if (equal(tok, "+"))
-    return unary(rest, tok->next);
+  if (is_punct(tok, '+'))
+    return unary(rest, tok + 1);
 
-  if (equal(tok, "-"))
-    return new_unary(ND_NEG, unary(rest, tok->next), tok);
+  if (is_punct(tok, '-'))
+    return new_unary(ND_NEG, unary(rest, tok + 1), tok);
 
-  if (equal(tok, "&"))
-    return new_unary(ND_ADDR, unary(rest, tok->next), tok);
+  if (is_punct(tok, '&'))
+    return new_unary(ND_ADDR, unary(rest, tok + 1), tok);
 
-  if (equal(tok, "*"))
-    return new_unary(ND_DEREF, unary(rest, tok->next), tok);
+  if (is_punct(tok, '*'))
+    return new_unary(ND_DEREF, unary(rest, tok + 1), tok);
 
   return postfix(rest, tok);
 }
@@ -624,23 +709,31 @@ static void struct_members(Token **rest, Token *tok, Type *ty) {
   Member head = {};
   Member *cur = &head;
 
-  while (!equal(tok, "}")) {
+  while (!is_punct(tok, '}')) {
     Type *basety = declspec(&tok, tok);
     int i = 0;
 
-    while (!consume(&tok, tok, ";")) {
+    while (!consume_punct(&tok, tok, ';')) {
       if (i++)
-        tok = skip(tok, ",");
+        tok = skip_punct(tok, ',');
 
-      Member *mem = calloc(1, sizeof(Member));
-      mem->ty = declarator(&tok, tok, basety);
-      mem->name = mem->ty->name;
+      Member *mem = arena_alloc(&parse_arena, sizeof(Member));
+      Token *name;
+      mem->ty = declarator(&tok, tok, basety, &name);
+      mem->name = tok_name(name);
       cur = cur->next = mem;
     }
   }
 
-  *rest = tok->next;
+  *rest = tok + 1;
   ty->members = head.next;
+
+  // Index members by name so that member accesses need not walk
+  // the member list. The first declaration wins on duplicates.
+  ty->member_map = arena_alloc(&parse_arena, sizeof(HashMap));
+  for (Member *mem = ty->members; mem; mem = mem->next)
+    if (!hashmap_get(ty->member_map, mem->name))
+      hashmap_put(ty->member_map, mem->name, mem);
 }
 
 
@@ -650,9 +743,9 @@ static Type *struct_union_decl(Token **rest, Token *tok) {
     Token *tag = NULL;
     if(tok->kind == TK_IDENT){
         tag = tok;
-        tok = tok->next;
+        tok++;
     }
-    if(tag && !equal(tok, "{")){
+    if(tag && !is_punct(tok, '{')){
         Type *ty = find_tag(tag);
         if(!ty)
             error_tok(tok, "unknown struct type");
@@ -661,8 +754,9 @@ static Type *struct_union_decl(Token **rest, Token *tok) {
     }
 
   // Construct a struct object.
-  Type *ty = calloc(1, sizeof(Type));
-  struct_members(rest, tok->next, ty);
+  Type *ty = arena_alloc(&type_arena, sizeof(Type));
+  stats.ntypes++;
+  struct_members(rest, tok + 1, ty);
   ty->align = 1;
 
   // Register the struct type if a name was given.
@@ -706,10 +800,11 @@ static Type *union_decl(Token **rest, Token *tok){
     return ty;
 }
 static Member *get_struct_member(Type *ty, Token *tok) {
-  for (Member *mem = ty->members; mem; mem = mem->next)
-    if (mem->name->len == tok->len &&
-        !strncmp(mem->name->loc, tok->loc, tok->len))
+  if (tok->kind == TK_IDENT) {
+    Member *mem = hashmap_get2(ty->member_map, tok_name(tok), tok->len);
+    if (mem)
       return mem;
+  }
   error_tok(tok, "no such member");
 }
 
@@ -728,26 +823,26 @@ static Node *postfix(Token **rest, Token *tok) {
   Node *node = primary(&tok, tok);
 
   for (;;) {
-    if (equal(tok, "[")) {
+    if (is_punct(tok, '[')) {
       // x[y] is short for *(x+y)
       Token *start = tok;
-      Node *idx = expr(&tok, tok->next);
-      tok = skip(tok, "]");
+      Node *idx = expr(&tok, tok + 1);
+      tok = skip_punct(tok, ']');
       node = new_unary(ND_DEREF, new_add(node, idx, start), start);
       continue;
     }
 
-    if (equal(tok, ".")) {
-      node = struct_ref(node, tok->next);
-      tok = tok->next->next;
+    if (is_punct(tok, '.')) {
+      node = struct_ref(node, tok + 1);
+      tok = tok + 2;
       continue;
     }
 
-    if(equal(tok, "->")){
+    if(is_punct(tok, PUNCT_ARROW)){
         // x->y is short for (*x).y
         node = new_unary(ND_DEREF, node, tok);
-        node = struct_ref(node, tok->next);
-        tok = tok->next->next;
+        node = struct_ref(node, tok + 1);
+        tok = tok + 2;
         continue;
     }
 
@@ -759,21 +854,21 @@ static Node *postfix(Token **rest, Token *tok) {
 // funcall = ident "(" (assign ("," assign)*)? ")"
 static Node *funcall(Token **rest, Token *tok) {
   Token *start = tok;
-  tok = tok->next->next;
+  tok = tok + 2;
 
   Node head = {};
   Node *cur = &head;
 
-  while (!equal(tok, ")")) {
+  while (!is_punct(tok, ')')) {
     if (cur != &head)
-      tok = skip(tok, ",");
+      tok = skip_punct(tok, ',');
     cur = cur->next = assign(&tok, tok);
   }
 
-  *rest = skip(tok, ")");
+  *rest = skip_punct(tok, ')');
 
   Node *node = new_node(ND_FUNCALL, start);
-  node->funcname = strndup(start->loc, start->len);
+  node->funcname = tok_name(start);
   node->args = head.next;
   return node;
 }
@@ -785,123 +880,158 @@ static Node *funcall(Token **rest, Token *tok) {
 //         | str
 //         | num
 static Node *primary(Token **rest, Token *tok) {
-  if (equal(tok, "(") && equal(tok->next, "{")) {
+  if (is_punct(tok, '(') && is_punct(tok + 1, '{')) {
     // This is a GNU statement expresssion.
     Node *node = new_node(ND_STMT_EXPR, tok);
-    node->body = compound_stmt(&tok, tok->next->next)->body;
-    *rest = skip(tok, ")");
+    Obj *outer = locals;
+    node->body = compound_stmt(&tok, tok + 2)->body;
+
+    // A struct or union value is the address of a local, which must
+    // stay alive after the statement expression, so extend the
+    // lifetimes of its locals to the enclosing scope.
+    add_type(node);
+    if (node->ty->kind == TY_STRUCT || node->ty->kind == TY_UNION)
+      for (Obj *var = locals; var != outer; var = var->next)
+        var->live_end = 0;
+    *rest = skip_punct(tok, ')');
     return node;
   }
 
-  if (equal(tok, "(")) {
-    Node *node = expr(&tok, tok->next);
-    *rest = skip(tok, ")");
+  if (is_punct(tok, '(')) {
+    Node *node = expr(&tok, tok + 1);
+    *rest = skip_punct(tok, ')');
     return node;
   }
 
-  if (equal(tok, "sizeof")) {
-    Node *node = unary(rest, tok->next);
+  if (is_keyword(tok, KW_SIZEOF)) {
+    Node *node = unary(rest, tok + 1);
     add_type(node);
     return new_num(node->ty->size, tok);
   }
 
   if (tok->kind == TK_IDENT) {
     // Function call
-    if (equal(tok->next, "("))
+    if (is_punct(tok + 1, '('))
       return funcall(rest, tok);
 
     // Variable
     Obj *var = find_var(tok);
     if (!var)
       error_tok(tok, "undefined variable");
-    *rest = tok->next;
+    *rest = tok + 1;
     return new_var_node(var, tok);
   }
 
   if (tok->kind == TK_STR) {
-    Obj *var = new_string_literal(tok->str, tok->ty);
-    *rest = tok->next;
+    Obj *var = new_string_literal(tok_str(tok), tok_type(tok));
+    *rest = tok + 1;
     return new_var_node(var, tok);
   }
 
   if (tok->kind == TK_NUM) {
-    Node *node = new_num(tok->val, tok);
-    *rest = tok->next;
+    Node *node = new_num(tok_val(tok), tok);
+    *rest = tok + 1;
     return node;
   }
 
   error_tok(tok, "expected an expression");
 }
 
-static void create_param_lvars(Type *param) {
+static void create_param_lvars(Param *param) {
   if (param) {
     create_param_lvars(param->next);
-    new_lvar(get_ident(param->name), param);
+    new_lvar(param->name, param->ty);
   }
 }
 
-static Token *function(Token *tok, Type *basety) {
-  Type *ty = declarator(&tok, tok, basety);
-
-  Obj *fn = new_gvar(get_ident(ty->name), ty);
+static Token *function(Token *tok, Type *ty, Token *name) {
+  Obj *fn = new_gvar(get_ident(name), ty);
   fn->is_function = true;
-  fn->is_definition = !consume(&tok, tok, ";");
+  fn->is_definition = !consume_punct(&tok, tok, ';');
 
   if(!fn->is_definition) return tok;
 
+  if (emit_fn)
+    local_arena = &func_arena;
+
   locals = NULL;
   enter_scope();
   create_param_lvars(ty->params);
   fn->params = locals;
 
-  tok = skip(tok, "{");
+  tok = skip_punct(tok, '{');
   fn->body = compound_stmt(&tok, tok);
   fn->locals = locals;
   leave_scope();
-  return tok;
-}
-
-static Token *global_variable(Token *tok, Type *basety) {
-  bool first = true;
 
-  while (!consume(&tok, tok, ";")) {
-    if (!first)
-      tok = skip(tok, ",");
-    first = false;
-
-    Type *ty = declarator(&tok, tok, basety);
-    new_gvar(get_ident(ty->name), ty);
+  if (emit_fn) {
+    emit_fn(fn);
+    fn->body = NULL;
+    fn->params = fn->locals = locals = NULL;
+    arena_reset(&func_arena);
+    local_arena = &parse_arena;
   }
   return tok;
 }
 
-// Lookahead tokens and returns true if a given token is a start
-// of a function definition or declaration.
-static bool is_function(Token *tok) {
-  if (equal(tok, ";"))
-    return false;
-
-  Type dummy = {};
-  Type *ty = declarator(&tok, tok, &dummy);
-  return ty->kind == TY_FUNC;
+// Reads the rest of a global variable declaration, whose first
+// declarator has been read.
+static Token *global_variable(Token *tok, Type *basety, Type *ty, Token *name) {
+  for (;;) {
+    new_gvar(get_ident(name), ty);
+    if (consume_punct(&tok, tok, ';'))
+      return tok;
+    tok = skip_punct(tok, ',');
+    ty = declarator(&tok, tok, basety, &name);
+  }
 }
 
 // program = (function-definition | global-variable)*
-Obj *parse(Token *tok) {
+//
+// If `emit` is given, each function definition is passed to it as
+// soon as it is parsed, and its body and locals are freed afterwards.
+// Only global variables and types are kept for the whole file. `tok`
+// is then from tokenize_first(), and the tokens of each declaration
+// are released once it has been parsed.
+Obj *parse(Token *tok, void (*emit)(Obj *fn)) {
+  // Start from a clean state, as the same thread may have compiled
+  // another file before.
   globals = NULL;
+  emit_fn = emit;
+  local_arena = &parse_arena;
+  scope = arena_alloc(&parse_arena, sizeof(Scope));
+  tick = 0;
+  unique_id = 0;
+  free(var_map.buckets);
+  free(tag_map.buckets);
+  free(string_literals.buckets);
+  var_map = tag_map = string_literals = (HashMap){};
+
+  for (;;) {
+    if (tok->kind == TK_EOF) {
+      tok = emit ? tokenize_next() : NULL;
+      if (!tok)
+        break;
+    }
 
-  while (tok->kind != TK_EOF) {
     Type *basety = declspec(&tok, tok);
+    if (consume_punct(&tok, tok, ';'))
+      continue;
+
+    // The first declarator tells a function from a global variable.
+    // It is read only once, as the types of a function's parameters
+    // are kept for the whole file.
+    Token *name;
+    Type *ty = declarator(&tok, tok, basety, &name);
 
     // Function
-    if (is_function(tok)) {
-      tok = function(tok, basety);
+    if (ty->kind == TY_FUNC) {
+      tok = function(tok, ty, name);
       continue;
     }
 
     // Global variable
-    tok = global_variable(tok, basety);
-
+    tok = global_variable(tok, basety, ty, name);
   }
   return globals;
 }
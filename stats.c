@@ -0,0 +1,165 @@
+// This file collects statistics of the compiler itself for
+// -ftime-report and --stats, so that a slowdown can be attributed to
+// a phase.
+//
+// Counters are thread-local, so counting is as cheap as an increment.
+// Each thread adds its counters to the totals of the process with
+// stats_merge() once it's done. Times are measured only if statistics
+// are enabled, and are summed over threads, so with -j the phases may
+// add up to more than the total wall time.
+
+#include "chibicc.h"
+
+_Thread_local Stats stats;
+
+static bool enabled;
+static int64_t start_ns;
+
+// The phase the current thread is in, and when it entered it
+static _Thread_local Phase cur_phase = PHASE_NONE;
+static _Thread_local int64_t phase_wall;
+static _Thread_local int64_t phase_cpu;
+
+// Max RSS of the process at the end of each phase. RSS only grows,
+// so the increase from one phase to the next is what it allocated.
+static _Thread_local long phase_rss[NUM_PHASES];
+
+#define NUM_ARENAS 4
+
+static Stats total;
+static long total_rss[NUM_PHASES];
+static int64_t arena_bytes[NUM_ARENAS];
+static pthread_mutex_t stats_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static char *phase_names[] = {
+  "tokenize", "parse", "optimize", "ir", "codegen", "assemble",
+};
+
+static char *arena_names[] = {"parse", "func", "type", "ir"};
+
+static long max_rss_kb(void) {
+  struct rusage ru;
+  getrusage(RUSAGE_SELF, &ru);
+  return ru.ru_maxrss;
+}
+
+static int64_t now(clockid_t clock) {
+  struct timespec ts;
+  clock_gettime(clock, &ts);
+  return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+void stats_init(void) {
+  enabled = true;
+  start_ns = now(CLOCK_MONOTONIC);
+}
+
+// Accounts the time from now on to a given phase. Returns the phase
+// that the current thread was in, so that a nested phase can restore
+// it.
+Phase stats_phase(Phase phase) {
+  Phase prev = cur_phase;
+  if (!enabled)
+    return prev;
+
+  int64_t wall = now(CLOCK_MONOTONIC);
+  int64_t cpu = now(CLOCK_THREAD_CPUTIME_ID);
+  if (cur_phase != PHASE_NONE) {
+    stats.wall_ns[cur_phase] += wall - phase_wall;
+    stats.cpu_ns[cur_phase] += cpu - phase_cpu;
+    phase_rss[cur_phase] = MAX(phase_rss[cur_phase], max_rss_kb());
+  }
+
+  cur_phase = phase;
+  phase_wall = wall;
+  phase_cpu = cpu;
+  return prev;
+}
+
+// Adds the counters of the current thread to the totals and resets
+// them.
+void stats_merge(void) {
+  stats_phase(cur_phase);
+
+  Arena *arenas[] = {&parse_arena, &func_arena, &type_arena, &ir_arena};
+
+  pthread_mutex_lock(&stats_lock);
+  int64_t *dst = (int64_t *)&total;
+  int64_t *src = (int64_t *)&stats;
+  for (int i = 0; i < sizeof(Stats) / sizeof(int64_t); i++)
+    dst[i] += src[i];
+  for (int i = 0; i < NUM_PHASES; i++)
+    total_rss[i] = MAX(total_rss[i], phase_rss[i]);
+  for (int i = 0; i < NUM_ARENAS; i++)
+    arena_bytes[i] += arenas[i]->allocated;
+  pthread_mutex_unlock(&stats_lock);
+
+  stats = (Stats){};
+  for (int i = 0; i < NUM_ARENAS; i++)
+    arenas[i]->allocated = 0;
+}
+
+static double sec(int64_t ns) {
+  return ns / 1e9;
+}
+
+void stats_print(FILE *out) {
+  int64_t wall = 0, cpu = 0;
+  for (int i = 0; i < NUM_PHASES; i++) {
+    wall += total.wall_ns[i];
+    cpu += total.cpu_ns[i];
+  }
+
+  fprintf(out, "%-12s %10s %10s %6s %10s\n", "phase", "wall (s)", "cpu (s)", "wall%",
+          "rss (KiB)");
+  for (int i = 0; i < NUM_PHASES; i++)
+    fprintf(out, "%-12s %10.6f %10.6f %5.1f%% %10ld\n", phase_names[i],
+            sec(total.wall_ns[i]), sec(total.cpu_ns[i]),
+            wall ? total.wall_ns[i] * 100.0 / wall : 0.0, total_rss[i]);
+  fprintf(out, "%-12s %10.6f %10.6f\n", "sum", sec(wall), sec(cpu));
+  fprintf(out, "%-12s %10.6f\n\n", "elapsed", sec(now(CLOCK_MONOTONIC) - start_ns));
+
+  fprintf(out, "tokens:       %ld\n", (long)total.ntokens);
+  fprintf(out, "nodes:        %ld\n", (long)total.nnodes);
+  fprintf(out, "types:        %ld\n", (long)total.ntypes);
+  fprintf(out, "objs:         %ld\n", (long)total.nobjs);
+  fprintf(out, "instructions: %ld\n", (long)total.ninsns);
+  fprintf(out, "find_var:     %ld lookups, %ld probes\n", (long)total.var_lookups,
+          (long)total.var_probes);
+  fprintf(out, "find_tag:     %ld lookups, %ld probes\n\n", (long)total.tag_lookups,
+          (long)total.tag_probes);
+
+  fprintf(out, "token arrays: %ld bytes\n", (long)total.token_bytes);
+  for (int i = 0; i < NUM_ARENAS; i++)
+    fprintf(out, "%-5s arena:  %ld bytes\n", arena_names[i], (long)arena_bytes[i]);
+  fprintf(out, "max rss:      %ld KiB\n", max_rss_kb());
+}
+
+void stats_print_json(FILE *out) {
+  fprintf(out, "{\n  \"phases\": {\n");
+  for (int i = 0; i < NUM_PHASES; i++)
+    fprintf(out, "    \"%s\": {\"wall\": %.6f, \"cpu\": %.6f, \"max_rss_kb\": %ld}%s\n",
+            phase_names[i], sec(total.wall_ns[i]), sec(total.cpu_ns[i]), total_rss[i],
+            (i < NUM_PHASES - 1) ? "," : "");
+  fprintf(out, "  },\n");
+  fprintf(out, "  \"elapsed\": %.6f,\n", sec(now(CLOCK_MONOTONIC) - start_ns));
+
+  fprintf(out, "  \"counts\": {\"tokens\": %ld, \"nodes\": %ld, \"types\": %ld, "
+          "\"objs\": %ld, \"instructions\": %ld},\n",
+          (long)total.ntokens, (long)total.nnodes, (long)total.ntypes, (long)total.nobjs,
+          (long)total.ninsns);
+  fprintf(out, "  \"lookups\": {\n");
+  fprintf(out, "    \"find_var\": {\"lookups\": %ld, \"probes\": %ld},\n",
+          (long)total.var_lookups, (long)total.var_probes);
+  fprintf(out, "    \"find_tag\": {\"lookups\": %ld, \"probes\": %ld}\n",
+          (long)total.tag_lookups, (long)total.tag_probes);
+  fprintf(out, "  },\n");
+
+  fprintf(out, "  \"token_bytes\": %ld,\n", (long)total.token_bytes);
+  fprintf(out, "  \"arena_bytes\": {");
+  for (int i = 0; i < NUM_ARENAS; i++)
+    fprintf(out, "\"%s\": %ld%s", arena_names[i], (long)arena_bytes[i],
+            (i < NUM_ARENAS - 1) ? ", " : "");
+  fprintf(out, "},\n");
+  fprintf(out, "  \"max_rss_kb\": %ld\n}\n", max_rss_kb());
+}
@@ -13,3 +13,43 @@ char *format(char *fmt, ...) {
   fclose(out);
   return buf;
 }
+
+// Like format(), but allocates the string from a given arena, so that
+// it is released together with the arena.
+char *arena_format(Arena *arena, char *fmt, ...) {
+  va_list ap;
+  va_start(ap, fmt);
+  int len = vsnprintf(NULL, 0, fmt, ap);
+  va_end(ap);
+
+  char *buf = arena_alloc(arena, len + 1);
+  va_start(ap, fmt);
+  vsnprintf(buf, len + 1, fmt, ap);
+  va_end(ap);
+  return buf;
+}
+
+static _Thread_local HashMap interned;
+static _Thread_local Arena intern_arena;
+
+// Returns the unique copy of a given string. Equal strings are always
+// interned to the same pointer, so interned strings can be compared
+// with `==`.
+char *intern(char *s, int len) {
+  char *str = hashmap_get2(&interned, s, len);
+  if (str)
+    return str;
+
+  str = arena_alloc(&intern_arena, len + 1);
+  memcpy(str, s, len);
+  hashmap_put2(&interned, str, len, str);
+  return str;
+}
+
+// Forgets all interned strings of this thread. Called when nothing
+// that refers to them is left.
+void free_interned(void) {
+  free(interned.buckets);
+  interned = (HashMap){};
+  arena_free(&intern_arena);
+}
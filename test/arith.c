@@ -1,5 +1,7 @@
 #include "test.h"
 
+long lx;
+
 int main() {
   ASSERT(0, 0);
   ASSERT(42, 42);
@@ -31,6 +33,56 @@ int main() {
   ASSERT(1, 1>=1);
   ASSERT(0, 1>=2);
 
+  ASSERT(21, ({ int x=5; x+20-4; }));
+  ASSERT(47, ({ int x=6; 5+x*7; }));
+  ASSERT(4, ({ int x=3; (x+5)/2; }));
+  ASSERT(10, ({ int x=10; - -x; }));
+  ASSERT(1, ({ int x=42; x==42; }));
+  ASSERT(0, ({ int x=1; x<1; }));
+  ASSERT(1, ({ int x=1; x<=1; }));
+
+  ASSERT(7, ({ int x=7; x*1; }));
+  ASSERT(7, ({ int x=7; 1*x; }));
+  ASSERT(7, ({ int x=7; x+0; }));
+  ASSERT(7, ({ int x=7; 0+x; }));
+  ASSERT(7, ({ int x=7; x-0; }));
+  ASSERT(7, ({ int x=7; x/1; }));
+  ASSERT(10, ({ int x=7; x+1+2; }));
+  ASSERT(42, ({ int x=7; x*2*3; }));
+  ASSERT(-7, ({ int x=7; 0-x; }));
+
+  ASSERT(56, ({ int x=7; x*8; }));
+  ASSERT(-56, ({ int x=7; x*-8; }));
+  ASSERT(21, ({ int x=7; x*3; }));
+  ASSERT(35, ({ int x=7; 5*x; }));
+  ASSERT(63, ({ int x=7; x*9; }));
+  ASSERT(77, ({ int x=7; x*11; }));
+  ASSERT(-7, ({ int x=7; x*-1; }));
+  ASSERT(3, ({ int x=7; x/2; }));
+  ASSERT(-3, ({ int x=-7; x/2; }));
+  ASSERT(-3, ({ int x=7; x/-2; }));
+  ASSERT(1, ({ int x=-7; x/-4; }));
+  ASSERT(2, ({ int x=7; x/3; }));
+  ASSERT(-2, ({ int x=-7; x/3; }));
+  ASSERT(-2, ({ int x=7; x/-3; }));
+  ASSERT(14, ({ int x=100; x/7; }));
+  ASSERT(-14, ({ int x=-100; x/7; }));
+  ASSERT(-7, ({ int x=7; x/-1; }));
+  ASSERT(1, ({ int x=7; x-6; }));
+  ASSERT(1, ({ int x=7; x==7; }));
+  ASSERT(1, ({ int x=7; 7==x; }));
+  ASSERT(1, ({ int x=7; x!=6; }));
+  ASSERT(1, ({ int x=7; 6<x; }));
+  ASSERT(0, ({ int x=7; 7<x; }));
+  ASSERT(1, ({ int x=7; 7<=x; }));
+  ASSERT(0, ({ int x=7; 8<=x; }));
+  ASSERT(1, ({ int x=7; x<8; }));
+  ASSERT(0, ({ int x=7; x<=6; }));
+
+  ASSERT(1, ({ lx=3; lx*4294967296*3 == 38654705664; }));
+  ASSERT(1, ({ long m=0-9223372036854775807-1; lx=3; lx*m == m; }));
+  ASSERT(1, ({ lx=5; lx*(0-1099511627776) == 0-5497558138880; }));
+
   printf("OK\n");
   return 0;
 }
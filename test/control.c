@@ -9,10 +9,22 @@ int main() {
   ASSERT(3, ({ int x; if (1-1) x=2; else x=3; x; }));
   ASSERT(2, ({ int x; if (1) x=2; else x=3; x; }));
   ASSERT(2, ({ int x; if (2-1) x=2; else x=3; x; }));
+  ASSERT(2, ({ int x=5; if (x) x=2; else x=3; x; }));
+  ASSERT(3, ({ int x=0; if (x) x=2; else x=3; x; }));
+  ASSERT(2, ({ int x=5; if (x==5) x=2; else x=3; x; }));
+  ASSERT(3, ({ int x=5; if (x!=5) x=2; else x=3; x; }));
+  ASSERT(2, ({ int x=5; if (4<x) x=2; else x=3; x; }));
+  ASSERT(3, ({ int x=5; if (5<x) x=2; else x=3; x; }));
+  ASSERT(2, ({ int x=5; if (5<=x) x=2; else x=3; x; }));
+  ASSERT(2, ({ int x=5, y=6; if (x<y) x=2; else x=3; x; }));
+  ASSERT(3, ({ int x=5, y=6; if (y<=x) x=2; else x=3; x; }));
 
   ASSERT(55, ({ int i=0; int j=0; for (i=0; i<=10; i=i+1) j=i+j; j; }));
 
   ASSERT(10, ({ int i=0; while(i<10) i=i+1; i; }));
+  ASSERT(10, ({ int i=0; while(10>i) i=i+1; i; }));
+  ASSERT(0, ({ int i=10; while(i) i=i-1; i; }));
+  ASSERT(11, ({ int i=0, n=10; while(i<=n) i=i+1; i; }));
 
   ASSERT(3, ({ 1; {2;} 3; }));
   ASSERT(5, ({ ;;; 5; }));
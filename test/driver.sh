@@ -22,4 +22,104 @@ check -o
 ./chibicc --help 2>&1 | grep -q chibicc
 check --help
 
+# -O
+echo 'int main() { int x=3; return x; }' > $tmp/opt.c
+./chibicc -O1 -o $tmp/opt.s $tmp/opt.c
+gcc -o $tmp/opt $tmp/opt.s 2>/dev/null
+$tmp/opt
+[ $? -eq 3 ]
+check -O1
+
+echo 'int main() { int x=3; return x; }' | ./chibicc -O0 -o $tmp/out - 2>/dev/null
+check -O0
+
+# Constants stored to narrow variables are truncated, so that the
+# assembler doesn't have to shorten them.
+echo 'char g; short h; int main() { g=300; h=70000; return g+h; }' > $tmp/narrow.c
+./chibicc -O1 -o $tmp/narrow.s $tmp/narrow.c
+grep -q 'movb \$44,' $tmp/narrow.s && grep -q 'movw \$4464,' $tmp/narrow.s
+check 'narrow constant stores'
+
+# A block storing to promoted locals in turn
+echo 'int main() { int a; int b; a=0; b=0; a=1; b=1; a=2; b=2; a=3; b=3; a=4; b=4; a=5; b=5; a=6; b=6; a=7; b=7; a=8; b=8; a=9; b=9; a=10; b=10; if (a) b=b+1; return a+b; }' > $tmp/stores.c
+./chibicc -O1 -o $tmp/stores.s $tmp/stores.c
+gcc -o $tmp/stores $tmp/stores.s 2>/dev/null
+$tmp/stores
+[ $? -eq 21 ]
+check 'interleaved stores at -O1'
+
+# --stream
+echo 'int x; int f() { return x; } int main() { x=7; return f(); }' > $tmp/stream.c
+./chibicc --stream -O1 -o $tmp/stream.s $tmp/stream.c
+gcc -o $tmp/stream $tmp/stream.s 2>/dev/null
+$tmp/stream
+[ $? -eq 7 ]
+check --stream
+
+# In streaming mode, the tokens of each declaration are released once
+# it is parsed. Struct members and string literals outlive them.
+echo 'struct P { int x; int y; }; struct P p; char *s; int f(struct P *q) { s="abc"; return q->y; } int main() { p.y=5; return f(&p) + s[2] - 99; }' > $tmp/stream2.c
+./chibicc --stream -o $tmp/stream2.s $tmp/stream2.c
+gcc -o $tmp/stream2 $tmp/stream2.s 2>/dev/null
+$tmp/stream2
+[ $? -eq 5 ]
+check '--stream across declarations'
+
+# -c
+rm -f $tmp/opt.o
+(cd $tmp && $OLDPWD/chibicc -c opt.c)
+gcc -o $tmp/opt $tmp/opt.o 2>/dev/null
+$tmp/opt
+[ $? -eq 3 ]
+check -c
+
+# A constant that doesn't fit in 32 bits must not be truncated by the
+# internal assembler.
+echo 'long x; int main() { x=3; return x*4294967296*3 / 4294967296; }' > $tmp/imm64.c
+./chibicc -O1 -c -o $tmp/imm64.o $tmp/imm64.c
+gcc -o $tmp/imm64 $tmp/imm64.o 2>/dev/null
+$tmp/imm64
+[ $? -eq 9 ]
+check '-c with 64-bit constants'
+
+gcc -E -P -C test/function.c > $tmp/func.c
+./chibicc -O1 -o $tmp/func1.s $tmp/func.c
+
+# --cache-dir
+./chibicc --cache-dir=$tmp/cache -O1 -o $tmp/cache1.s $tmp/func.c
+./chibicc --cache-dir=$tmp/cache -O1 -o $tmp/cache2.s $tmp/func.c
+cmp -s $tmp/cache1.s $tmp/func1.s && cmp -s $tmp/cache2.s $tmp/func1.s
+check --cache-dir
+
+./chibicc --cache-dir=$tmp/cache --cache-stats | grep -q 'hits: 1'
+check --cache-stats
+
+./chibicc --cache-dir=$tmp/cache --cache-size=0 -o $tmp/out $tmp/opt.c
+[ -z "$(ls $tmp/cache/*.s 2> /dev/null)" ]
+check --cache-size
+
+# -ftime-report
+./chibicc -ftime-report -o $tmp/out $tmp/opt.c 2>&1 | grep -q '^parse '
+check -ftime-report
+
+./chibicc --stats=$tmp/stats.json -o $tmp/out $tmp/opt.c
+grep -q '"tokens": 15,' $tmp/stats.json
+check --stats
+
+# -j
+echo 'int main() { return 3; }' > $tmp/foo.c
+echo 'int main() { return 5; }' > $tmp/bar.c
+rm -f $tmp/foo.s $tmp/bar.s
+(cd $tmp && $OLDPWD/chibicc -j2 foo.c bar.c)
+[ -f $tmp/foo.s ] && [ -f $tmp/bar.s ]
+check -j
+
+./chibicc -O1 -j4 -o $tmp/func4.s $tmp/func.c
+cmp -s $tmp/func1.s $tmp/func4.s
+check 'parallel codegen'
+
+./chibicc -o $tmp/out $tmp/foo.c $tmp/bar.c 2> /dev/null
+[ $? -ne 0 ]
+check 'multiple files with -o'
+
 echo OK
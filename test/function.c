@@ -39,6 +39,18 @@ int sub_short(short a, short b, short c) {
   return a - b - c;
 }
 
+int ret_char(char c) {
+  return c;
+}
+
+int twice(int x) {
+  return add2(x, x);
+}
+
+int forever(int x) {
+  return forever(x + 1);
+}
+
 int main() {
   ASSERT(3, ret3());
   ASSERT(8, add2(3, 5));
@@ -55,6 +67,11 @@ int main() {
 
   ASSERT(1, sub_long(7, 3, 3));
   ASSERT(1, sub_short(7, 3, 3));
+  ASSERT(44, ret_char(300));
+  ASSERT(42, twice(21));
+  ASSERT(-9, ({ int i=0; sub2(i=i+1, i=i*10); }));
+  ASSERT(1, ({ int i=0; twice(i=i+1); i; }));
+  ASSERT(2, ({ int i=0; twice(i=i+1); }));
 
   printf("OK\n");
   return 0;
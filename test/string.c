@@ -35,6 +35,13 @@ int main() {
   ASSERT(0, "\x00"[0]);
   ASSERT(119, "\x77"[0]);
 
+  ASSERT(1, ({ char *p="abc"; char *q="abc"; p==q; }));
+  ASSERT(0, ({ char *p="abc"; char *q="abd"; p==q; }));
+  ASSERT(0, ({ char *p="a\0b"; char *q="a\0c"; p==q; }));
+  ASSERT(99, ({ char *p="a\0b"; char *q="a\0c"; q[2]; }));
+  ASSERT(34, "\"\\"[0]);
+  ASSERT(92, "\"\\"[1]);
+
   printf("OK\n");
   return 0;
 }
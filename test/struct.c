@@ -41,6 +41,11 @@ int main() {
   ASSERT(7, ({ struct t {int a,b;}; struct t x; x.a=7; struct t y; struct t *z=&y; *z=x; y.a; }));
   ASSERT(7, ({ struct t {int a,b;}; struct t x; x.a=7; struct t y, *p=&x, *q=&y; *q=*p; y.a; }));
   ASSERT(5, ({ struct t {char a, b;} x, y; x.a=5; y=x; y.a; }));
+  ASSERT(7, ({ struct t {char a[7];} x, y; x.a[6]=7; y=x; y.a[6]; }));
+  ASSERT(3, ({ struct t {int a; char b[27];} x, y; x.a=1; x.b[0]=2; x.b[26]=3; y=x; y.b[26]; }));
+  ASSERT(5, ({ struct t {long a[16];} x, y; x.a[0]=4; x.a[15]=5; y=x; y.a[0]+y.a[15]-4; }));
+  ASSERT(9, ({ struct t {char a[300];} x, y; x.a[0]=4; x.a[299]=5; y=x; y.a[0]+y.a[299]; }));
+  ASSERT(8, ({ struct t {char a[300];} x, y, z; x.a[150]=8; z=y=x; z.a[150]; }));
 
   ASSERT(3, ({ struct {int a,b;} x,y; x.a=3; y=x; y.a; }));
   ASSERT(7, ({ struct t {int a,b;}; struct t x; x.a=7; struct t y; struct t *z=&y; *z=x; y.a; }));
@@ -1,9 +1,14 @@
 #include "test.h"
 
 int g1, g2[4];
+char g3;
+short g4;
 
 int main() {
   ASSERT(3, ({ int a; a=3; a; }));
+  ASSERT(44, ({ g3=300; g3; }));
+  ASSERT(4464, ({ g4=70000; g4; }));
+  ASSERT(44, ({ char x; char *p=&x; x=300; *p; }));
   ASSERT(3, ({ int a=3; a; }));
   ASSERT(8, ({ int a=3; int z=5; a+z; }));
 
@@ -47,8 +52,16 @@ int main() {
   ASSERT(2, ({ int x=2; { int x=3; } int y=4; x; }));
   ASSERT(3, ({ int x=2; { x=3; } x; }));
 
-  ASSERT(7, ({ int x; int y; char z; char *a=&y; char *b=&z; b-a; }));
-  ASSERT(1, ({ int x; char y; int z; char *a=&y; char *b=&z; b-a; }));
+#ifndef __OPTIMIZE__
+  // These depend on the stack layout of unoptimized code.
+  ASSERT(-5, ({ int x; int y; char z; char *a=&y; char *b=&z; b-a; }));
+  ASSERT(5, ({ int x; char y; int z; char *a=&y; char *b=&z; b-a; }));
+#endif
+
+  ASSERT(1, ({ int *p; int *q; { int a; p=&a; } { int b; q=&b; } p==q; }));
+  ASSERT(0, ({ int *p; int *q; { int a; p=&a; { int b; q=&b; } } p==q; }));
+  ASSERT(6, ({ int a=1; int s=0; { int b=2; { int c=3; s=a+b+c; } } s; }));
+  ASSERT(5, ({ int s=0; { int a=2; s=s+a; } { int b=3; s=s+b; } s; }));
 
   ASSERT(8, ({ long x; sizeof(x); }));
   ASSERT(2, ({ short x; sizeof(x); }));
@@ -59,6 +72,10 @@ int main() {
   ASSERT(3, ({ char (x)[3]; sizeof(x); }));
   ASSERT(12, ({ char (x[3])[4]; sizeof(x); }));
   ASSERT(4, ({ char (x[3])[4]; sizeof(x[0]); }));
+  ASSERT(12, ({ int x[3]; int y[2][3]; sizeof(x) + sizeof(y[1]) - sizeof(x); }));
+  ASSERT(5, ({ int x[3]; int y[3]; x[2]=2; y[2]=3; x[2]+y[2]; }));
+  ASSERT(8, ({ struct {int a;} x; struct {char a; long b;} *p; sizeof(p->b); }));
+  ASSERT(7, ({ int x; int *p=&x; int **q=&p; **q=7; x; }));
   ASSERT(3, ({ char *x[3]; char y; x[0]=&y; y=3; x[0][0]; }));
   ASSERT(4, ({ char x[3]; char (*y)[3]=x; y[0][0]=4; y[0][0]; }));
 
@@ -1,13 +1,44 @@
 #include "chibicc.h"
 
 // Input filename
-static char *current_filename;
+static _Thread_local char *current_filename;
 
 // Input string
-static char *current_input;
+static _Thread_local char *current_input;
+
+// Offsets of the beginning of each line in the input. The lexer
+// appends to this table as it goes, so the line of any location it
+// has already passed can be found by binary search.
+static _Thread_local int *line_offsets;
+static _Thread_local int line_cnt;
+static _Thread_local int line_cap;
+
+// Tokens of the input, and side tables for the values of the tokens
+// that have one. They are reused for the next input of the thread,
+// or for the next declaration in streaming mode.
+typedef struct {
+  Type *ty;
+  char *str;
+} StrLiteral;
+
+static _Thread_local Token *tokens;
+static _Thread_local int ntokens;
+static _Thread_local int tokens_cap;
+static _Thread_local char **names;
+static _Thread_local int nnames;
+static _Thread_local int names_cap;
+static _Thread_local int64_t *vals;
+static _Thread_local int nvals;
+static _Thread_local int vals_cap;
+static _Thread_local StrLiteral *strs;
+static _Thread_local int nstrs;
+static _Thread_local int strs_cap;
 
 // Reports an error and exit.
 void error(char *fmt, ...) {
+  // Keep the message in one piece if other threads report errors
+  // at the same time. The lock is held until the process exits.
+  flockfile(stderr);
   va_list ap;
   va_start(ap, fmt);
   vfprintf(stderr, fmt, ap);
@@ -20,10 +51,10 @@ void error(char *fmt, ...) {
 // foo.c:10: x = y + 1;
 //               ^ <error message here>
 static void verror_at(int line_no, char *loc, char *fmt, va_list ap) {
+  flockfile(stderr);
+
   // Find a line containing `loc`.
-  char *line = loc;
-  while (current_input < line && line[-1] != '\n')
-    line--;
+  char *line = current_input + line_offsets[line_no - 1];
 
   char *end = loc;
   while (*end != '\n')
@@ -43,53 +74,137 @@ static void verror_at(int line_no, char *loc, char *fmt, va_list ap) {
   exit(1);
 }
 
-void error_at(char *loc, char *fmt, ...) {
-  int line_no = 1;
-  for (char *p = current_input; p < loc; p++)
-    if (*p == '\n')
-      line_no++;
+// Returns the line number of a given location.
+static int find_line(char *loc) {
+  int off = loc - current_input;
+  int lo = 0;
+  int hi = line_cnt - 1;
+
+  while (lo < hi) {
+    int mid = (lo + hi + 1) / 2;
+    if (line_offsets[mid] <= off)
+      lo = mid;
+    else
+      hi = mid - 1;
+  }
+  return lo + 1;
+}
 
+void error_at(char *loc, char *fmt, ...) {
   va_list ap;
   va_start(ap, fmt);
-  verror_at(line_no, loc, fmt, ap);
+  verror_at(find_line(loc), loc, fmt, ap);
 }
 
 void error_tok(Token *tok, char *fmt, ...) {
   va_list ap;
   va_start(ap, fmt);
-  verror_at(tok->line_no, tok->loc, fmt, ap);
+  verror_at(tok->line_no, tok_loc(tok), fmt, ap);
+}
+
+char *tok_loc(Token *tok) {
+  return current_input + tok->offset;
+}
+
+// Returns the interned name of an identifier.
+char *tok_name(Token *tok) {
+  assert(tok->kind == TK_IDENT);
+  return names[tok->id];
+}
+
+int64_t tok_val(Token *tok) {
+  assert(tok->kind == TK_NUM);
+  return vals[tok->id];
+}
+
+// Returns the contents of a string literal including the
+// terminating '\0'.
+char *tok_str(Token *tok) {
+  assert(tok->kind == TK_STR);
+  return strs[tok->id].str;
 }
 
-// Consumes the current token if it matches `op`.
-bool equal(Token *tok, char *op) {
-  return memcmp(tok->loc, op, tok->len) == 0 && op[tok->len] == '\0';
+Type *tok_type(Token *tok) {
+  assert(tok->kind == TK_STR);
+  return strs[tok->id].ty;
 }
 
-// Ensure that the current token is `op`.
-Token *skip(Token *tok, char *op) {
-  if (!equal(tok, op))
-    error_tok(tok, "expected '%s'", op);
-  return tok->next;
+bool is_keyword(Token *tok, int keyword) {
+  return tok->kind == TK_KEYWORD && tok->id == keyword;
 }
 
-bool consume(Token **rest, Token *tok, char *str) {
-  if (equal(tok, str)) {
-    *rest = tok->next;
+// Multi-character punctuators. Single-character ones are all the
+// characters for which ispunct() returns true.
+static struct {
+  char *str;
+  int id;
+} punct_table[] = {
+  {"==", PUNCT_EQ}, {"!=", PUNCT_NE}, {"<=", PUNCT_LE}, {">=", PUNCT_GE},
+  {"->", PUNCT_ARROW},
+};
+
+static char *punct_name(int punct) {
+  for (int i = 0; i < sizeof(punct_table) / sizeof(*punct_table); i++)
+    if (punct_table[i].id == punct)
+      return punct_table[i].str;
+  return format("%c", punct);
+}
+
+bool is_punct(Token *tok, int punct) {
+  return tok->kind == TK_PUNCT && tok->id == punct;
+}
+
+// Ensure that the current token is a given punctuator.
+Token *skip_punct(Token *tok, int punct) {
+  if (!is_punct(tok, punct))
+    error_tok(tok, "expected '%s'", punct_name(punct));
+  return tok + 1;
+}
+
+bool consume_punct(Token **rest, Token *tok, int punct) {
+  if (is_punct(tok, punct)) {
+    *rest = tok + 1;
     return true;
   }
   *rest = tok;
   return false;
 }
 
-// Create a new token.
-static Token *new_token(TokenKind kind, char *start, char *end) {
-  Token *tok = calloc(1, sizeof(Token));
-  tok->kind = kind;
-  tok->loc = start;
-  tok->len = end - start;
+// Makes room for one more element in an array of `size`-byte
+// elements that has `len` elements and room for `*cap`.
+static void *grow(void *arr, int len, int *cap, int size) {
+  if (len < *cap)
+    return arr;
+  *cap = *cap ? *cap * 2 : 1024;
+  arr = realloc(arr, (size_t)*cap * size);
+  if (!arr)
+    error("out of memory");
+  stats.token_bytes += (int64_t)(*cap - len) * size;
+  return arr;
+}
+
+// Appends a new token. The pointer is valid only until the next call,
+// as the array may move when it grows.
+static Token *new_token(TokenKind kind, int id, char *start, char *end) {
+  if (end - current_input > INT32_MAX)
+    error("%s: input is too large", current_filename);
+
+  tokens = grow(tokens, ntokens, &tokens_cap, sizeof(Token));
+  Token *tok = &tokens[ntokens++];
+  stats.ntokens++;
+  *tok = (Token){kind, id, start - current_input, end - start, line_cnt};
   return tok;
 }
 
+// Records that a new line starts at p.
+static void add_line(char *p) {
+  if (line_cnt == line_cap) {
+    line_cap = line_cap ? line_cap * 2 : 1024;
+    line_offsets = realloc(line_offsets, sizeof(int) * line_cap);
+  }
+  line_offsets[line_cnt++] = p - current_input;
+}
+
 static bool startswith(char *p, char *q) {
   return strncmp(p, q, strlen(q)) == 0;
 }
@@ -112,25 +227,321 @@ static int from_hex(char c) {
   return c - 'A' + 10;
 }
 
+// The lexer spends most of its time skipping whitespace and comments
+// and scanning identifiers. The following functions do that a block
+// of bytes at a time with SIMD instructions where available.
+//
+// Blocks are always loaded from aligned addresses, so a load never
+// crosses a page boundary and never faults even though it may read
+// past the terminating '\0' of the input. Each *_mask function returns
+// a bitmask in which bit i corresponds to byte i of the block.
+#if defined(__AVX2__)
+#include <immintrin.h>
+#define BLOCK 32
+
+static __m256i load_block(char *p) {
+  return _mm256_load_si256((__m256i *)p);
+}
+
+static uint64_t eq_mask(char *p, char c) {
+  __m256i v = _mm256_cmpeq_epi8(load_block(p), _mm256_set1_epi8(c));
+  return (uint32_t)_mm256_movemask_epi8(v);
+}
+
+// Matches a byte in [lo, hi]. Bytes >= 0x80 are negative and never match.
+static __m256i in_range(__m256i v, char lo, char hi) {
+  return _mm256_and_si256(_mm256_cmpgt_epi8(v, _mm256_set1_epi8(lo - 1)),
+                          _mm256_cmpgt_epi8(_mm256_set1_epi8(hi + 1), v));
+}
+
+static uint64_t space_mask(char *p) {
+  __m256i v = load_block(p);
+  __m256i m = _mm256_or_si256(_mm256_cmpeq_epi8(v, _mm256_set1_epi8(' ')),
+                              in_range(v, '\t', '\r'));
+  return (uint32_t)_mm256_movemask_epi8(m);
+}
+
+static uint64_t ident_mask(char *p) {
+  __m256i v = load_block(p);
+  __m256i lower = _mm256_or_si256(v, _mm256_set1_epi8(0x20));
+  __m256i m = _mm256_or_si256(in_range(lower, 'a', 'z'), in_range(v, '0', '9'));
+  m = _mm256_or_si256(m, _mm256_cmpeq_epi8(v, _mm256_set1_epi8('_')));
+  return (uint32_t)_mm256_movemask_epi8(m);
+}
+
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#define BLOCK 16
+
+static __m128i load_block(char *p) {
+  return _mm_load_si128((__m128i *)p);
+}
+
+static uint64_t eq_mask(char *p, char c) {
+  return _mm_movemask_epi8(_mm_cmpeq_epi8(load_block(p), _mm_set1_epi8(c)));
+}
+
+// Matches a byte in [lo, hi]. Bytes >= 0x80 are negative and never match.
+static __m128i in_range(__m128i v, char lo, char hi) {
+  return _mm_and_si128(_mm_cmpgt_epi8(v, _mm_set1_epi8(lo - 1)),
+                       _mm_cmplt_epi8(v, _mm_set1_epi8(hi + 1)));
+}
+
+static uint64_t space_mask(char *p) {
+  __m128i v = load_block(p);
+  __m128i m = _mm_or_si128(_mm_cmpeq_epi8(v, _mm_set1_epi8(' ')),
+                           in_range(v, '\t', '\r'));
+  return _mm_movemask_epi8(m);
+}
+
+static uint64_t ident_mask(char *p) {
+  __m128i v = load_block(p);
+  __m128i lower = _mm_or_si128(v, _mm_set1_epi8(0x20));
+  __m128i m = _mm_or_si128(in_range(lower, 'a', 'z'), in_range(v, '0', '9'));
+  m = _mm_or_si128(m, _mm_cmpeq_epi8(v, _mm_set1_epi8('_')));
+  return _mm_movemask_epi8(m);
+}
+
+#elif defined(__ARM_NEON) && defined(__aarch64__)
+#include <arm_neon.h>
+#define BLOCK 16
+
+// NEON has no movemask instruction. We emulate it by giving each
+// byte lane its own bit and summing each half of the vector.
+static uint64_t to_mask(uint8x16_t v) {
+  static const uint8_t bits[16] = {1, 2, 4, 8, 16, 32, 64, 128,
+                                   1, 2, 4, 8, 16, 32, 64, 128};
+  uint8x16_t m = vandq_u8(v, vld1q_u8(bits));
+  return vaddv_u8(vget_low_u8(m)) | (vaddv_u8(vget_high_u8(m)) << 8);
+}
+
+static uint8x16_t load_block(char *p) {
+  return vld1q_u8((uint8_t *)p);
+}
+
+static uint64_t eq_mask(char *p, char c) {
+  return to_mask(vceqq_u8(load_block(p), vdupq_n_u8(c)));
+}
+
+static uint8x16_t in_range(uint8x16_t v, char lo, char hi) {
+  return vcleq_u8(vsubq_u8(v, vdupq_n_u8(lo)), vdupq_n_u8(hi - lo));
+}
+
+static uint64_t space_mask(char *p) {
+  uint8x16_t v = load_block(p);
+  return to_mask(vorrq_u8(vceqq_u8(v, vdupq_n_u8(' ')), in_range(v, '\t', '\r')));
+}
+
+static uint64_t ident_mask(char *p) {
+  uint8x16_t v = load_block(p);
+  uint8x16_t lower = vorrq_u8(v, vdupq_n_u8(0x20));
+  uint8x16_t m = vorrq_u8(in_range(lower, 'a', 'z'), in_range(v, '0', '9'));
+  return to_mask(vorrq_u8(m, vceqq_u8(v, vdupq_n_u8('_'))));
+}
+
+#else
+// Scalar fallback, which looks at one byte at a time.
+#define BLOCK 1
+
+static uint64_t eq_mask(char *p, char c) {
+  return *p == c;
+}
+
+static uint64_t space_mask(char *p) {
+  return isspace(*p) != 0;
+}
+
+static uint64_t ident_mask(char *p) {
+  return is_ident2(*p);
+}
+#endif
+
+#define FULL_MASK (BLOCK == 64 ? ~(uint64_t)0 : ((uint64_t)1 << BLOCK) - 1)
+
+// Returns the aligned block containing p and sets *valid to the
+// mask of bytes at or after p within the block.
+static char *block_of(char *p, uint64_t *valid) {
+  int off = (uintptr_t)p % BLOCK;
+  *valid = (FULL_MASK << off) & FULL_MASK;
+  return p - off;
+}
+
+// Returns the first non-whitespace character at or after p,
+// recording the start of each line on the way.
+static char *skip_space(char *p) {
+  uint64_t valid;
+  char *blk = block_of(p, &valid);
+
+  for (;; blk += BLOCK, valid = FULL_MASK) {
+    uint64_t end = ~space_mask(blk) & valid;
+    uint64_t nl = eq_mask(blk, '\n') & valid;
+    if (end)
+      nl &= (end & -end) - 1;
+
+    for (; nl; nl &= nl - 1)
+      add_line(blk + __builtin_ctzll(nl) + 1);
+
+    if (end)
+      return blk + __builtin_ctzll(end);
+  }
+}
+
+// Returns the first character at or after p that cannot be
+// part of an identifier.
+static char *skip_ident(char *p) {
+  uint64_t valid;
+  char *blk = block_of(p, &valid);
+
+  for (;; blk += BLOCK, valid = FULL_MASK) {
+    uint64_t end = ~ident_mask(blk) & valid;
+    if (end)
+      return blk + __builtin_ctzll(end);
+  }
+}
+
+// Returns the newline that terminates a line comment.
+static char *skip_line_comment(char *p) {
+  uint64_t valid;
+  char *blk = block_of(p, &valid);
+
+  for (;; blk += BLOCK, valid = FULL_MASK) {
+    uint64_t end = eq_mask(blk, '\n') & valid;
+    if (end)
+      return blk + __builtin_ctzll(end);
+  }
+}
+
+// Returns the position just after the "*/" that closes a block
+// comment, or NULL if the comment is not closed. Lines inside the
+// comment are recorded on the way.
+static char *skip_block_comment(char *p) {
+  uint64_t valid;
+  char *blk = block_of(p, &valid);
+
+  for (;; blk += BLOCK, valid = FULL_MASK) {
+    uint64_t m = (eq_mask(blk, '*') | eq_mask(blk, '\n') | eq_mask(blk, '\0')) & valid;
+
+    for (; m; m &= m - 1) {
+      char *q = blk + __builtin_ctzll(m);
+      if (*q == '\n')
+        add_line(q + 1);
+      else if (*q == '\0')
+        return NULL;
+      else if (q[1] == '/')
+        return q + 2;
+    }
+  }
+}
+
+// Punctuators are recognized by a trie. The first byte selects a root
+// node through a 256-entry table, and the following bytes are matched
+// against the children of the current node for the longest match.
+typedef struct {
+  char c;      // Last character of the path to this node
+  int id;      // Punctuator ID if the path is a punctuator, or 0
+  int child;   // Index of the first child, or 0
+  int sibling; // Index of the next sibling, or 0
+} PunctNode;
+
+static PunctNode punct_trie[64];
+static int punct_trie_len = 1; // Node 0 is a null node
+static int punct_root[256];
+
+static int new_punct_node(char c) {
+  assert(punct_trie_len < sizeof(punct_trie) / sizeof(*punct_trie));
+  punct_trie[punct_trie_len].c = c;
+  return punct_trie_len++;
+}
+
+static void init_punct_trie(void) {
+  for (int c = 0; c < 256; c++)
+    if (ispunct(c))
+      punct_trie[punct_root[c] = new_punct_node(c)].id = c;
+
+  for (int i = 0; i < sizeof(punct_table) / sizeof(*punct_table); i++) {
+    char *p = punct_table[i].str;
+    int node = punct_root[(unsigned char)*p];
+
+    while (*++p) {
+      int n = punct_trie[node].child;
+      while (n && punct_trie[n].c != *p)
+        n = punct_trie[n].sibling;
+
+      if (!n) {
+        n = new_punct_node(*p);
+        punct_trie[n].sibling = punct_trie[node].child;
+        punct_trie[node].child = n;
+      }
+      node = n;
+    }
+    punct_trie[node].id = punct_table[i].id;
+  }
+}
+
 // Read a punctuator token from p and returns its length.
-static int read_punct(char *p) {
-    static char *kw[] = {"==", "!=", "<=", ">=", "->"};
-    for (int i = 0; i < sizeof(kw)/ sizeof(*kw); i++)
-        if(startswith(p, kw[i]))
-            return strlen(kw[i]);
-  return ispunct(*p) ? 1 : 0;
-}
-
-static bool is_keyword(Token *tok) {
-  static char *kw[] = {
-    "return", "if", "else", "for", "while", "int", "sizeof", "char",
-    "struct", "union", "long", "void",
-  };
-
-  for (int i = 0; i < sizeof(kw) / sizeof(*kw); i++)
-    if (equal(tok, kw[i]))
-      return true;
-  return false;
+// Its ID is returned via `id`.
+static int read_punct(char *p, int *id) {
+  int node = punct_root[(unsigned char)*p];
+  if (!node)
+    return 0;
+
+  int len = 1;
+  *id = punct_trie[node].id;
+
+  for (int i = 1;; i++) {
+    int n = punct_trie[node].child;
+    while (n && punct_trie[n].c != p[i])
+      n = punct_trie[n].sibling;
+    if (!n)
+      return len;
+
+    node = n;
+    if (punct_trie[n].id) {
+      len = i + 1;
+      *id = punct_trie[n].id;
+    }
+  }
+}
+
+// Returns the KeywordKind of [p, p+len), or 0 if it is not a keyword.
+// Candidates are selected by length and then by the first character,
+// so most identifiers are rejected without a single string comparison.
+static int keyword_kind(char *p, int len) {
+#define KW(s, kw) if (!memcmp(p, s, sizeof(s) - 1)) return kw
+  switch (len) {
+  case 2:
+    KW("if", KW_IF);
+    return 0;
+  case 3:
+    switch (*p) {
+    case 'f': KW("for", KW_FOR); return 0;
+    case 'i': KW("int", KW_INT); return 0;
+    }
+    return 0;
+  case 4:
+    switch (*p) {
+    case 'c': KW("char", KW_CHAR); return 0;
+    case 'e': KW("else", KW_ELSE); return 0;
+    case 'l': KW("long", KW_LONG); return 0;
+    case 'v': KW("void", KW_VOID); return 0;
+    }
+    return 0;
+  case 5:
+    switch (*p) {
+    case 's': KW("short", KW_SHORT); return 0;
+    case 'u': KW("union", KW_UNION); return 0;
+    case 'w': KW("while", KW_WHILE); return 0;
+    }
+    return 0;
+  case 6:
+    switch (*p) {
+    case 'r': KW("return", KW_RETURN); return 0;
+    case 's': KW("sizeof", KW_SIZEOF); KW("struct", KW_STRUCT); return 0;
+    }
+    return 0;
+  }
+  return 0;
+#undef KW
 }
 
 static int read_escaped_char(char **new_pos, char *p) {
@@ -200,7 +611,7 @@ static char *string_literal_end(char *p) {
 
 static Token *read_string_literal(char *start) {
   char *end = string_literal_end(start + 1);
-  char *buf = calloc(1, end - start);
+  char *buf = arena_alloc(&parse_arena, end - start);
   int len = 0;
 
   for (char *p = start + 1; p < end;) {
@@ -210,145 +621,234 @@ static Token *read_string_literal(char *start) {
       buf[len++] = *p++;
   }
 
-  Token *tok = new_token(TK_STR, start, end + 1);
-  tok->ty = array_of(ty_char, len + 1);
-  tok->str = buf;
-  return tok;
+  strs = grow(strs, nstrs, &strs_cap, sizeof(StrLiteral));
+  strs[nstrs] = (StrLiteral){array_of(ty_char, len + 1), buf};
+  return new_token(TK_STR, nstrs++, start, end + 1);
 }
 
-static void convert_keywords(Token *tok) {
-  for (Token *t = tok; t->kind != TK_EOF; t = t->next)
-    if (is_keyword(t))
-      t->kind = TK_KEYWORD;
-}
+// Where tokenize_next() resumes reading the input
+static _Thread_local char *next_decl;
 
-// Initialize line info for all tokens.
-static void add_line_numbers(Token *tok) {
-  char *p = current_input;
-  int n = 1;
+// Replaces the tokens in the arrays with the tokens read from `p` up
+// to the end of the input, or up to the end of the first top-level
+// declaration if `one_decl` is true, followed by a TK_EOF token.
+// Returns where it stopped.
+static char *read_tokens(char *p, bool one_decl) {
+  ntokens = nnames = nvals = nstrs = 0;
 
-  do {
-    if (p == tok->loc) {
-      tok->line_no = n;
-      tok = tok->next;
-    }
-    if (*p == '\n')
-      n++;
-  } while (*p++);
-}
-
-// Tokenize a given string and returns new tokens.
-static Token *tokenize(char *filename, char *p) {
-  current_filename = filename;
-  current_input = p;
-  Token head = {};
-  Token *cur = &head;
+  // Nesting depth of (), [] and {}, and whether the outermost {} is
+  // a function body rather than a struct or union.
+  int depth = 0;
+  bool body = false;
 
   while (*p) {
     // Skip line comments.
-    if (startswith(p, "//")) {
-      p += 2;
-      while (*p != '\n')
-        p++;
+    if (p[0] == '/' && p[1] == '/') {
+      p = skip_line_comment(p + 2);
       continue;
     }
 
     // Skip block comments.
-    if (startswith(p, "/*")) {
-      char *q = strstr(p + 2, "*/");
+    if (p[0] == '/' && p[1] == '*') {
+      char *q = skip_block_comment(p + 2);
       if (!q)
         error_at(p, "unclosed block comment");
-      p = q + 2;
+      p = q;
       continue;
     }
 
     // Skip whitespace characters.
     if (isspace(*p)) {
-      p++;
+      p = skip_space(p);
       continue;
     }
 
     // Numeric literal
     if (isdigit(*p)) {
-      cur = cur->next = new_token(TK_NUM, p, p);
-      char *q = p;
-      cur->val = strtoul(p, &p, 10);
-      cur->len = p - q;
+      char *start = p;
+      vals = grow(vals, nvals, &vals_cap, sizeof(int64_t));
+      vals[nvals] = strtoul(p, &p, 10);
+      new_token(TK_NUM, nvals++, start, p);
       continue;
     }
 
     // String literal
     if (*p == '"') {
-      cur = cur->next = read_string_literal(p);
-      p += cur->len;
+      p += read_string_literal(p)->len;
       continue;
     }
 
     // Identifier or keyword
     if (is_ident1(*p)) {
       char *start = p;
-      do {
-        p++;
-      } while (is_ident2(*p));
-      cur = cur->next = new_token(TK_IDENT, start, p);
+      p = skip_ident(p + 1);
+      int kw = keyword_kind(start, p - start);
+      if (kw) {
+        new_token(TK_KEYWORD, kw, start, p);
+        continue;
+      }
+      names = grow(names, nnames, &names_cap, sizeof(char *));
+      names[nnames] = intern(start, p - start);
+      new_token(TK_IDENT, nnames++, start, p);
       continue;
     }
 
     // Punctuators
-    int punct_len = read_punct(p);
+    int punct;
+    int punct_len = read_punct(p, &punct);
     if (punct_len) {
-      cur = cur->next = new_token(TK_PUNCT, p, p + punct_len);
-      p += cur->len;
+      new_token(TK_PUNCT, punct, p, p + punct_len);
+      p += punct_len;
+      if (!one_decl)
+        continue;
+
+      // A top-level declaration ends with a ";" or the "}" of a
+      // function body, which follows the ")" of the parameters.
+      if (punct == '{' && depth == 0)
+        body = ntokens > 1 && is_punct(&tokens[ntokens - 2], ')');
+      if (punct == '(' || punct == '[' || punct == '{')
+        depth++;
+      if (punct == ')' || punct == ']' || punct == '}')
+        depth--;
+      if (depth == 0 && (punct == ';' || (punct == '}' && body)))
+        break;
       continue;
     }
 
     error_at(p, "invalid token");
   }
 
-  cur = cur->next = new_token(TK_EOF, p, p);
-  add_line_numbers(head.next);
-  convert_keywords(head.next);
-  return head.next;
+  new_token(TK_EOF, 0, p, p);
+  return p;
 }
 
-// Returns the contents of a given file.
-static char *read_file(char *path) {
-  FILE *fp;
+static void start_input(char *filename, char *p) {
+  current_filename = filename;
+  current_input = p;
+  line_cnt = 0;
 
-  if (strcmp(path, "-") == 0) {
-    // By convention, read from stdin if a given filename is "-".
-    fp = stdin;
-  } else {
-    fp = fopen(path, "r");
-    if (!fp)
-      error("cannot open %s: %s", path, strerror(errno));
-  }
+  // The trie is shared by all threads and never changes once built.
+  static pthread_once_t once = PTHREAD_ONCE_INIT;
+  pthread_once(&once, init_punct_trie);
+  add_line(p);
+}
 
-  char *buf;
-  size_t buflen;
-  FILE *out = open_memstream(&buf, &buflen);
+// Tokenize a given string and returns new tokens.
+Token *tokenize(char *filename, char *p) {
+  start_input(filename, p);
+  read_tokens(p, false);
+  return tokens;
+}
+
+// Like tokenize(), but returns only the tokens of the first top-level
+// declaration. The following ones are returned by tokenize_next(), so
+// that only one declaration's worth of tokens is in memory at a time.
+Token *tokenize_first(char *filename, char *p) {
+  start_input(filename, p);
+  next_decl = read_tokens(p, true);
+  return tokens;
+}
+
+// Returns the tokens of the next top-level declaration, or NULL at the
+// end of the input. The tokens returned before are released.
+Token *tokenize_next(void) {
+  next_decl = read_tokens(next_decl, true);
+  return ntokens > 1 ? tokens : NULL;
+}
+
+// Reads the rest of a given file into a buffer that has room for
+// `cap` bytes in the first place and is doubled whenever it fills up.
+static char *read_fd(int fd, char *path, size_t cap) {
+  char *buf = malloc(cap);
+  size_t len = 0;
 
-  // Read the entire file.
   for (;;) {
-    char buf2[4096];
-    int n = fread(buf2, 1, sizeof(buf2), fp);
+    // Keep two bytes for the trailing "\n\0".
+    if (cap - len <= 2) {
+      cap *= 2;
+      buf = realloc(buf, cap);
+    }
+
+    ssize_t n = read(fd, buf + len, cap - len - 2);
     if (n == 0)
       break;
-    fwrite(buf2, 1, n, out);
+    if (n == -1) {
+      if (errno == EINTR)
+        continue;
+      error("cannot read %s: %s", path, strerror(errno));
+    }
+    len += n;
   }
 
-  if (fp != stdin)
-    fclose(fp);
-
   // Make sure that the last line is properly terminated with '\n'.
-  fflush(out);
-  if (buflen == 0 || buf[buflen - 1] != '\n')
-    fputc('\n', out);
-  fputc('\0', out);
-  fclose(out);
+  if (len == 0 || buf[len - 1] != '\n')
+    buf[len++] = '\n';
+  buf[len] = '\0';
+  return buf;
+}
+
+// Maps a regular file into memory. Returns NULL if it can't.
+//
+// The lexer needs the input to end with "\n\0". Those two bytes come
+// for free from the zero-filled tail of the last page, unless the file
+// ends at (or one byte before) a page boundary.
+static char *map_file(int fd, size_t size) {
+  size_t pagesize = sysconf(_SC_PAGESIZE);
+  if (size % pagesize == 0 || size % pagesize > pagesize - 2)
+    return NULL;
+
+  char *buf = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+  if (buf == MAP_FAILED)
+    return NULL;
+
+  if (buf[size - 1] != '\n')
+    buf[size] = '\n';
   return buf;
 }
 
+// Returns the contents of a given file. `*mapped` is set to the length
+// of the mapping if the file is mapped into memory, or to 0 otherwise.
+char *read_file(char *path, size_t *mapped) {
+  int fd;
+
+  if (strcmp(path, "-") == 0) {
+    // By convention, read from stdin if a given filename is "-".
+    fd = STDIN_FILENO;
+  } else {
+    fd = open(path, O_RDONLY);
+    if (fd == -1)
+      error("cannot open %s: %s", path, strerror(errno));
+  }
+
+  // A regular file is mapped into memory if possible, or is read with
+  // a single buffer of the exact size. Pipes are read until EOF.
+  char *buf = NULL;
+  struct stat st;
+  *mapped = 0;
+  if (fstat(fd, &st) == 0 && S_ISREG(st.st_mode)) {
+    buf = map_file(fd, st.st_size);
+    if (buf)
+      *mapped = st.st_size;
+    else
+      buf = read_fd(fd, path, st.st_size + 3);
+  } else {
+    buf = read_fd(fd, path, 4096);
+  }
+
+  if (fd != STDIN_FILENO)
+    close(fd);
+  return buf;
+}
+
+// Releases the contents returned by read_file().
+void free_file(char *buf, size_t mapped) {
+  if (mapped)
+    munmap(buf, mapped);
+  else
+    free(buf);
+}
+
 Token *tokenize_file(char *path) {
-  return tokenize(path, read_file(path));
+  size_t mapped;
+  return tokenize(path, read_file(path, &mapped));
 }
@@ -6,8 +6,23 @@ Type *ty_short = &(Type){TY_SHORT, 2, 2};
 Type *ty_int = &(Type){TY_INT, 4, 4};
 Type *ty_long = &(Type){TY_LONG, 8, 8};
 
+// Derived types are interned, so that there is only one `pointer to T`
+// and one `array of T` of each length. A pointer type is cached on its
+// base type, except that the builtin types above are shared by all
+// threads, so their pointer types are kept per thread by kind.
+static _Thread_local Type *builtin_pointers[TY_LONG + 1];
+
+// Array types keyed by their ArrayKey
+static _Thread_local HashMap array_types;
+
+typedef struct {
+  Type *base;
+  int64_t len;
+} ArrayKey;
+
 static Type *new_type(TypeKind kind, int size, int align){
-  Type *ty = calloc(1, sizeof(Type));
+  Type *ty = arena_alloc(&type_arena, sizeof(Type));
+  stats.ntypes++;
   ty->kind = kind;
   ty->size = size;
   ty->align = align;
@@ -19,29 +34,52 @@ bool is_integer(Type *ty) {
       || ty->kind == TY_LONG || ty->kind == TY_SHORT;
 }
 
-Type *copy_type(Type *ty) {
-  Type *ret = calloc(1, sizeof(Type));
-  *ret = *ty;
-  return ret;
+// Forgets the interned types. Called when type_arena is freed.
+void reset_types(void) {
+  memset(builtin_pointers, 0, sizeof(builtin_pointers));
+  free(array_types.buckets);
+  array_types = (HashMap){};
+}
+
+static bool is_builtin(Type *ty) {
+  return ty == ty_void || ty == ty_char || ty == ty_short || ty == ty_int ||
+         ty == ty_long;
 }
 
 Type *pointer_to(Type *base) {
+  Type **cache = is_builtin(base) ? &builtin_pointers[base->kind] : &base->pointer;
+  if (*cache)
+    return *cache;
+
   Type *ty = new_type(TY_PTR, 8, 8);
   ty->base = base;
+  *cache = ty;
   return ty;
 }
 
+// Function types are not interned, as each carries the names of its
+// parameters.
+
 Type *func_type(Type *return_ty) {
-  Type *ty = calloc(1, sizeof(Type));
-  ty->kind = TY_FUNC;
+  Type *ty = new_type(TY_FUNC, 0, 0);
   ty->return_ty = return_ty;
   return ty;
 }
 
 Type *array_of(Type *base, int len) {
-  Type *ty = new_type(TY_ARRAY, base->size*len, base->align);
+  ArrayKey key = {base, len};
+  Type *ty = hashmap_get2(&array_types, (char *)&key, sizeof(key));
+  if (ty)
+    return ty;
+
+  ty = new_type(TY_ARRAY, base->size*len, base->align);
   ty->base = base;
   ty->array_len = len;
+
+  // The map keeps a pointer to the key, so it must outlive the call.
+  ArrayKey *p = arena_alloc(&type_arena, sizeof(ArrayKey));
+  *p = key;
+  hashmap_put2(&array_types, (char *)p, sizeof(*p), ty);
   return ty;
 }
 
@@ -49,18 +87,34 @@ void add_type(Node *node) {
   if (!node || node->ty)
     return;
 
-  add_type(node->lhs);
-  add_type(node->rhs);
-  add_type(node->cond);
-  add_type(node->then);
-  add_type(node->els);
-  add_type(node->init);
-  add_type(node->inc);
-
-  for (Node *n = node->body; n; n = n->next)
-    add_type(n);
-  for (Node *n = node->args; n; n = n->next)
-    add_type(n);
+  switch (node->kind) {
+  case ND_NUM:
+  case ND_VAR:
+    break;
+  case ND_IF:
+  case ND_FOR:
+    add_type(node->cond);
+    add_type(node->then);
+    add_type(node->els);
+    add_type(node->init);
+    add_type(node->inc);
+    break;
+  case ND_BLOCK:
+  case ND_STMT_EXPR:
+    for (Node *n = node->body; n; n = n->next)
+      add_type(n);
+    break;
+  case ND_FUNCALL:
+    for (Node *n = node->args; n; n = n->next)
+      add_type(n);
+    break;
+  case ND_MEMBER:
+    add_type(node->lhs);
+    break;
+  default:
+    add_type(node->lhs);
+    add_type(node->rhs);
+  }
 
   switch (node->kind) {
   case ND_ADD: